@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 #include <ncurses.h>
 #include <dirent.h>
 #include <string.h>
@@ -6,164 +6,8400 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <ftw.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_FILES 4096
 #define PATH_MAX_LEN 4096
+#define ARENA_BLOCK (1 << 20)
+#define MAX_WORKERS 16
+
+#define FILTER_MAX 256
+#define FILTER_PARALLEL_MIN 16384
+#define NO_MATCH INT_MIN
+#define PATTERN_CACHE 8
 
 #define MIN_WIDTH  60
 #define MIN_HEIGHT 10
+#define FRAME_MAX_MS 50
+#define STATUS_MS 1000      // a message stays in the status line this long
+#define MESSAGE_LOG 200     // messages kept for ^W
+#define LATENCY_SUB 16      // histogram buckets per doubling of latency
+#define LATENCY_BUCKETS (40 * LATENCY_SUB)  // values up to 2^43 us
+
+#define LINE_CHECKPOINT 64
+#define INDEX_BLOCK (8 << 20)
+#define SEARCH_BLOCK (4 << 20)
+#define SEARCH_AHEAD 1024
+#define SHOWN_HITS 512
+#define FOLLOW_MS 100
+#define MAP_GUARDS 64      // file mappings a truncation must not crash at once
+
+#define HEX_PAGE 4096
+#define HEX_CACHE 16
+#define HEX_SCAN (1 << 20)
+
+#define IDX_MAGIC "MCNIDX2"
+#define IDX_BLOCK 128
+#define IDX_TRIGRAMS (1 << 24)
+#define IDX_WATCHES 65536
+#define IDX_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define CIDX_MAGIC "MCCIDX1"
+#define CIDX_CHUNK 64
+#define CIDX_EVENTS (IDX_EVENTS | IN_CLOSE_WRITE)
+#define COPY_CHUNK (8 << 20)
+#define DUP_EDGE 4096
+#define DUP_BATCH 64
+
+#define ARC_MAGIC "MCAIDX1"
+#define ARC_CACHE 8
+#define ARC_SPAN (16 << 20)     // uncompressed bytes between gzip access points
+#define ARC_WINDOW 32768
+#define ARC_NONE UINT32_MAX
+
+#define GREP_TEXT 256
+#define GREP_MAX_HITS (1 << 20)
+
+#define VFS_BATCH 256
+#define VFS_MOUNTS 16
+
+#define SFTP_SLOTS 1024     // requests in flight on one connection, above SFTP_STREAMS * SFTP_WINDOW
+#define SFTP_CHUNK 32768    // bytes per READ or WRITE
+#define SFTP_WINDOW 64      // READs, WRITEs or STATs in flight per file or listing
+#define SFTP_READDIRS 4     // READDIRs in flight per listing
+#define SFTP_CACHE 64       // listings kept per connection
+#define SFTP_STREAMS 8      // files transferred at once
+#define SFTP_MAX_PACKET (1 << 20)
+#define SFTP_TIMEOUT_MS 30000   // silence with requests outstanding that means the link is gone
+
+#define PROC_MAX 16         // background processes at once
+#define PROC_CAPTURE 65536  // output kept from each
+
+#define SHELL_LINES 10000   // scrollback kept
+#define SHELL_MEMORY (4 << 20)  // bytes of scrollback text kept at most
+#define SHELL_SPILL 65536   // output collected per write to the shell's log
+#define SHELL_COLS 1024     // longest line kept; longer output wraps here
+#define SHELL_READ 65536    // output taken in per frame
+#define SHELL_MARK "mycommander;"   // starts the control string bash sends at each prompt
+
+#define DU_CHUNK 65536
+#define DU_BINS 32                  // spare runs, by the highest bit of their length
+#define DU_FILE UINT32_MAX          // count of a file node
+#define DU_PENDING (UINT32_MAX - 1) // count of a directory not scanned yet
+#define DU_NONE UINT32_MAX          // parent of the root
+#define DU_DEAD (UINT32_MAX - 1)    // parent of a node dropped by a refresh
+
+typedef enum {
+    TYPE_FOLDER,
+    TYPE_TEXT,
+    TYPE_EXEC,
+    TYPE_IMAGE,
+    TYPE_VIDEO,
+    TYPE_OTHER
+} FileType;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+typedef struct {
+    char *name;
+    int name_len;
+    uint64_t sig;       // set of characters in name, see char_bit()
+    FileType type;
+    int marked;
+    long long size;     // bytes; -1 for a directory not yet measured
+    int sizing;         // size is a running total
+    uint32_t node;      // disk-usage tree or archive node, or DU_NONE
+    uint32_t set;       // duplicate set, counted from 1
+    int score;          // fuzzy find score, best first
+} Entry;
+
+// A directory entry as a backend lists it. name stays valid until the
+// next read_batch on the same directory.
+typedef struct {
+    const char *name;
+    int name_len;
+    uint32_t mode;      // as in st_mode; only the type bits until stat_batch, 0 if unknown
+    int64_t size;
+    uint32_t node;      // the backend's own id (an archive node), or DU_NONE
+} VfsEntry;
+
+enum { VFS_WRITE = 1, VFS_STATS = 2 };  // VFS_STATS: read_batch fills mode and size
+
+typedef struct Vfs Vfs;
+
+// What a panel lists and copies through. Paths are absolute, as in
+// Panel.cwd. A read-only backend leaves put, unlink and rename NULL.
+typedef struct {
+    int caps;
+    void *(*open_dir)(Vfs *fs, const char *path);
+    int (*read_batch)(Vfs *fs, void *dir, VfsEntry *out, int max);     // 0 at the end
+    void (*stat_batch)(Vfs *fs, void *dir, VfsEntry *ents, int n);     // NULL with VFS_STATS
+    void (*close_dir)(Vfs *fs, void *dir);
+    int (*stat)(Vfs *fs, const char *path, VfsEntry *out);             // a final symlink is not followed
+    int (*get)(Vfs *fs, const char *path, const char *local);          // to a new local path
+    int (*put)(Vfs *fs, const char *local, const char *path);
+    int (*unlink)(Vfs *fs, const char *path);                          // directories recursively
+    int (*rename)(Vfs *fs, const char *from, const char *to);
+    void (*forget)(Vfs *fs, const char *path);                         // drops a cached listing
+} VfsOps;
+
+struct Vfs {
+    const VfsOps *ops;
+    void *ctx;
+    const char *root;   // the backend owns the paths below it; "" for the local one
+};
+
+typedef struct {
+    int fd;
+    ssize_t len, off;
+    char buf[32768];
+} LocalDir;
+
+typedef enum {
+    FILTER_FUZZY,
+    FILTER_PATTERN
+} FilterKind;
+
+typedef struct {
+    Entry *entries;
+    int count, cap;
+    Arena names;
+    int selected;
+    int scroll_offset;
+    char cwd[PATH_MAX_LEN];
+    Vfs *vfs;           // what cwd is listed through
+    int marked;
+    int *view;          // entry indices passing the filter, best match first
+    int view_count;
+    int filtered;       // view is shown; kept while toggled off
+    FilterKind filter_kind;
+    int filter_dirty;
+    int filter_reusable; // view holds every match of filter_done
+    char filter[FILTER_MAX];
+    char filter_done[FILTER_MAX];
+    struct SizeJob *sizing;
+    struct DuTree *du;
+    uint32_t du_dir;
+    int du_active;      // entries come from du instead of the disk
+    struct GrepJob *grep;   // shown instead of the entries while set
+    struct FindJob *find;   // entries are its matches while set
+    struct DupJob *dups;    // entries are its duplicate sets while set
+    struct Archive *arc;    // entries are arc_dir's members while set
+    uint32_t arc_dir;       // ARC_NONE until the archive is indexed
+    struct Sftp *sftp;      // cwd is on this connection while set
+} Panel;
+
+typedef struct {
+    int idx;
+    int score;
+} Match;
+
+enum { LIT_NONE, LIT_EXACT, LIT_PREFIX, LIT_SUFFIX, LIT_INFIX };
+
+enum { FOLLOW_GREW = 1, FOLLOW_ROTATED = 2 };
+
+typedef struct {
+    char text[FILTER_MAX];
+    int regex;
+    int lit_kind;       // glob reducible to a plain string comparison
+    char lit[FILTER_MAX];
+    int lit_len;
+    regex_t re[MAX_WORKERS];
+    int nre;
+    unsigned long used;
+} Pattern;
+
+typedef struct {
+    Panel *panel;
+    const int *cand;
+    int begin, end;
+    const char *query;
+    int qlen;
+    uint64_t qsig;
+    Pattern *pat;
+    int worker;
+    Match *out;
+    int nout;
+    atomic_int *cancel;
+    atomic_int *done;
+} FilterTask;
+
+// Tasks are malloc'd blocks owned by the pool until its function runs; the
+// owning worker takes its newest task first, idle workers steal the oldest.
+typedef struct {
+    void **items;
+    int head, count, cap;
+    pthread_mutex_t lock;
+} Deque;
+
+typedef struct Pool Pool;
+typedef void (*TaskFn)(Pool *pool, int worker, void *task);
+
+typedef struct {
+    Pool *pool;
+    int id;
+} PoolWorker;
+
+struct Pool {
+    TaskFn fn;
+    void *ctx;
+    int nworkers;
+    pthread_t threads[MAX_WORKERS];
+    PoolWorker args[MAX_WORKERS];
+    Deque queues[MAX_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_long pending;    // tasks pushed and not yet finished
+    atomic_int cancel;
+    atomic_int next;
+};
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+} FileId;
+
+typedef struct {
+    FileId *slots;
+    size_t cap, count;
+    pthread_mutex_t lock;
+} IdSet;
+
+typedef struct {
+    off_t size;
+    struct timespec mtime;
+    int shared;             // more than one link
+} FileStamp;
+
+// What one scan of a directory found, reused while its mtime is unchanged
+// and every file in it still has the size and mtime it was counted with.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    long long own;          // files with a single link
+    FileId *links;          // files with several, counted once per job
+    int nlinks;
+    char *subdirs;          // NUL-separated names
+    int nsubdirs;
+    char *files;            // NUL-separated names of everything else
+    FileStamp *stamps;      // and how each looked when counted
+    int nfiles;
+} DirSummary;
+
+typedef struct {
+    char *name;
+    int entry;              // index in the panel when the job started
+    atomic_llong bytes;
+    atomic_long pending;    // directories still to scan
+} SizeRoot;
+
+typedef struct SizeJob {
+    Pool pool;
+    SizeRoot *roots;
+    int nroots;
+    IdSet seen;
+    DirSummary **fresh[MAX_WORKERS];    // scanned by each worker, cached when the job ends
+    int nfresh[MAX_WORKERS], fresh_cap[MAX_WORKERS];
+} SizeJob;
+
+typedef struct {
+    SizeRoot *root;
+    char path[];
+} SizeTask;
+
+typedef struct {
+    int64_t size;       // cumulative
+    uint32_t name;      // offset in the name pool
+    uint32_t parent;
+    uint32_t first;     // children are contiguous: [first, first + count)
+    uint32_t count;
+} DuNode;
+
+typedef struct {
+    uint32_t first, count;
+} DuRun;
+
+// A scanned tree for the disk-usage mode. Nodes are 24 bytes in fixed-size
+// chunks and names are interned, so ten million files fit in a few hundred
+// MB. Directories still to scan wait on pending, which makes the scan
+// resumable and lets a refresh simply queue a subtree again; the nodes it
+// drops are kept as spare runs for the rescan.
+typedef struct DuTree {
+    DuNode **chunks;
+    uint32_t nchunks, nnodes;
+    char *names;
+    size_t names_len, names_cap;
+    uint32_t *name_slots;   // offset + 1 of each interned name
+    size_t name_cap, name_count;
+    uint32_t *pending;
+    size_t npending, pending_cap;
+    IdSet links;            // hard-linked files; size holds the owning node
+    DuRun *spare[DU_BINS];  // dropped runs of [2^b, 2^(b+1)) nodes in bin b
+    size_t nspare[DU_BINS], spare_cap[DU_BINS];
+} DuTree;
+
+typedef struct {
+    uint32_t name;
+    int dir;
+    int64_t size;
+    dev_t dev;
+    ino_t ino;
+    int linked;
+} DuScan;
+
+typedef struct {
+    uint32_t file;      // index in GrepJob.files
+    uint32_t len;
+    long line;
+    off_t off;          // start of the line
+    char *text;
+} GrepHit;
+
+typedef struct GrepJob {
+    Pool pool;
+    char root[PATH_MAX_LEN];
+    char text[FILTER_MAX];
+    int regex;
+    regex_t re[MAX_WORKERS];
+    int nre;
+    pthread_mutex_t lock;   // guards strings, files and hits
+    Arena strings;
+    char **files;
+    uint32_t nfiles, files_cap;
+    GrepHit *hits;
+    size_t nhits, hits_cap;
+    atomic_long count;      // hits published to the panel
+    atomic_long scanned;
+    int done;
+    int indexed;            // only candidates from a content index are read
+    long candidates;
+    int selected, scroll_offset;    // the listing's, restored on close
+} GrepJob;
+
+typedef struct {
+    int dir;
+    char path[];        // relative to the job's root
+} GrepTask;
+
+// A file's content hash, reused while its mtime and size are unchanged.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int64_t mtime;
+    off_t size;
+    uint64_t hash;
+} HashEntry;
+
+// A pair of same-named entries the deep compare descends into; differs is
+// set once anything below them is found to differ.
+typedef struct {
+    int entry[2];       // indices in the left and right panels
+    atomic_int differs;
+} CompareTop;
+
+typedef struct CompareJob {
+    Pool pool;
+    char roots[2][PATH_MAX_LEN];
+    int counts[2];      // the panels' entry counts, to notice a reload
+    CompareTop *tops;
+    int ntops;
+    atomic_long files;
+    atomic_llong bytes;
+    int applied;        // tops already marked
+    int done;
+} CompareJob;
+
+typedef struct {
+    CompareTop *top;
+    int dir;
+    char path[];        // relative to both roots
+} CompareTask;
+
+enum { SYNC_DELETE, SYNC_MKDIR, SYNC_COPY, SYNC_LINK, SYNC_TIMES };
+
+typedef struct {
+    int kind;
+    int to;             // the side written; the other one is read
+    long long size;
+    char path[];        // relative to both roots
+} SyncAction;
+
+// A sync from the focused panel's directory (side 0) to the other's: the
+// planned actions, then their execution on the pool.
+typedef struct SyncJob {
+    Pool pool;
+    char roots[2][PATH_MAX_LEN];
+    int two_way, remove, verify;
+    pthread_mutex_t lock;   // guards actions and the plan's counts
+    SyncAction **actions;
+    size_t nactions, cap;
+    long copies, dirs, deletes, touches, unchanged, conflicts;
+    long long bytes;
+    atomic_long done, failed;
+    atomic_llong written;
+    atomic_long scanned;    // directories the plan has read
+    int planning, running;
+} SyncJob;
+
+typedef struct {
+    int only;           // the side holding the directory, or -1 for both
+    char path[];
+} SyncTask;
+
+// A regular file under the duplicate finder's root. hash covers the first
+// and last DUP_EDGE bytes, then the whole file once the ends agree.
+typedef struct {
+    char *path;         // relative to the job's root
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    uint64_t hash;
+    int failed;
+} DupFile;
+
+// Narrows every file under root to sets of equal contents in stages: same
+// size, then same ends, then same full hash, each stage on the pool and
+// only over what the last one left.
+typedef struct DupJob {
+    Pool pool;
+    char root[PATH_MAX_LEN];
+    dev_t dev;
+    pthread_t thread;
+    pthread_mutex_t lock;   // guards strings and files during the walk
+    Arena strings;
+    DupFile *files;
+    size_t nfiles, cap;
+    atomic_int stage;       // 0 walking, 1 reading ends, 2 hashing
+    atomic_long scanned, hashed;
+    atomic_llong bytes;
+    atomic_int cancel;
+    atomic_int done;
+    int applied;            // the sets are in the panel
+    long sets;
+    long long reclaimable;  // bytes held by all but one file of each set
+} DupJob;
+
+typedef struct {
+    size_t from, to;    // a range of DupJob.files
+} DupTask;
+
+enum { ARC_ZIP, ARC_TAR, ARC_TGZ };
+
+// A member of an archive, or a directory its paths imply. A directory's
+// children are a range of Archive.kids.
+typedef struct {
+    uint32_t name;          // offset in the name pool
+    uint32_t parent;
+    uint32_t first, count;
+    int64_t size;
+    int64_t mtime;
+    uint64_t offset;        // zip: its local header; tar: its data in the uncompressed stream
+    uint64_t csize;         // zip: compressed size
+    uint32_t mode;          // as in st_mode
+    uint32_t method;        // zip: 0 stored, 8 deflated
+    uint32_t link;          // a symlink's target in the name pool
+    uint32_t pad;
+} ArcNode;
+
+// Where inflating a gzip stream can resume: a deflate block's compressed
+// offset (and bit within that byte), its uncompressed offset, and the 32K
+// of output before it.
+typedef struct {
+    uint64_t out, in;
+    uint32_t bits, pad;
+    unsigned char window[ARC_WINDOW];
+} ArcPoint;
+
+// On-disk index of a tar: the header, then the nodes, the kids, the name
+// pool padded to 8 bytes and, for a compressed tar, its access points.
+typedef struct {
+    char magic[8];
+    uint64_t dev, ino;
+    int64_t size, mtime;
+    uint64_t nnodes, names_len, npoints;
+} ArcHeader;
+
+typedef struct Archive {
+    Vfs vfs;                    // mounted once a panel opens it
+    char path[PATH_MAX_LEN];
+    char file[PATH_MAX_LEN];    // its index on disk, for a tar
+    int kind;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtime;
+    int fd;
+    const unsigned char *zip;   // a zip is mapped whole
+    ArcNode *nodes;
+    uint32_t nnodes, nodes_cap;
+    uint32_t *kids;
+    char *names;
+    size_t names_len, names_cap;
+    ArcPoint *points;
+    uint32_t npoints, points_cap;
+    void *map;                  // the index, when loaded from disk
+    size_t map_len;
+    uint32_t *slots;            // (parent, name) -> node while indexing
+    size_t nslots;
+    pthread_t thread;
+    int threaded;
+    atomic_llong scanned;       // archive bytes the indexer has read
+    atomic_int cancel;
+    atomic_int done;
+    int failed;
+    int users;                  // panels showing it
+    z_stream z;                 // extraction's inflate, kept where it stopped
+    int z_live;
+    uint64_t z_out;             // the uncompressed offset it stopped at
+    off_t z_at;                 // where its next input is read
+    unsigned char z_in[65536];
+} Archive;
+
+// A tar read front to back, from the file or through inflate; a
+// compressed one leaves an access point about every ARC_SPAN bytes.
+typedef struct {
+    Archive *a;
+    uint64_t pos;               // uncompressed bytes consumed
+    z_stream z;
+    int end;
+    unsigned char *pending;     // inflated and not consumed yet
+    size_t npending;
+    unsigned char in[65536];
+    unsigned char window[ARC_WINDOW];
+    char pax[65536];
+} TarStream;
+
+typedef struct {
+    uint32_t node, next;    // the directory, and the next child to list
+} ArcDir;
+
+enum {
+    SSH_FXP_INIT = 1, SSH_FXP_VERSION = 2, SSH_FXP_OPEN = 3, SSH_FXP_CLOSE = 4, SSH_FXP_READ = 5,
+    SSH_FXP_WRITE = 6, SSH_FXP_LSTAT = 7, SSH_FXP_FSETSTAT = 10, SSH_FXP_OPENDIR = 11, SSH_FXP_READDIR = 12,
+    SSH_FXP_REMOVE = 13, SSH_FXP_MKDIR = 14, SSH_FXP_RMDIR = 15, SSH_FXP_REALPATH = 16, SSH_FXP_STAT = 17,
+    SSH_FXP_RENAME = 18, SSH_FXP_READLINK = 19, SSH_FXP_SYMLINK = 20,
+    SSH_FXP_STATUS = 101, SSH_FXP_HANDLE = 102, SSH_FXP_DATA = 103, SSH_FXP_NAME = 104, SSH_FXP_ATTRS = 105
+};
+enum { SSH_FX_OK, SSH_FX_EOF };
+enum { SSH_FXF_READ = 1, SSH_FXF_WRITE = 2, SSH_FXF_CREAT = 8, SSH_FXF_TRUNC = 16, SSH_FXF_EXCL = 32 };
+enum { SSH_ATTR_SIZE = 1, SSH_ATTR_UIDGID = 2, SSH_ATTR_PERMISSIONS = 4, SSH_ATTR_ACMODTIME = 8 };
+#define SSH_ATTR_EXTENDED 0x80000000u
+
+// An SFTP packet being built; sftp_send fills in its length and id.
+typedef struct {
+    unsigned char *data;
+    size_t len, cap;
+    int bad;            // an allocation failed
+} SftpBuf;
+
+// A reply being parsed; bad is set once a read runs past its end.
+typedef struct {
+    const unsigned char *p, *end;
+    int bad;
+} SftpIn;
+
+typedef struct {
+    uint32_t flags;
+    uint64_t size;
+    uint32_t mode;
+    uint32_t atime, mtime;
+} SftpAttrs;
+
+enum { SLOT_FREE, SLOT_WAIT, SLOT_DONE };
+
+typedef struct {
+    uint32_t id;
+    int state;
+    unsigned char *reply;   // from the type byte on
+    uint32_t len;
+} SftpSlot;
+
+// A remote directory as listed. ents are what the panel shows, a
+// symlink as its target; attrs are the entries' own.
+typedef struct {
+    char *path;
+    VfsEntry *ents;
+    SftpAttrs *attrs;
+    int n, cap;
+    Arena names;
+    unsigned long used;
+} SftpDir;
+
+typedef struct {
+    SftpDir *dir;
+    int next;
+} SftpHandle;
+
+// One ssh process running the sftp subsystem. Any thread may have
+// requests in flight: each holds a slot by id until the reader thread
+// files the reply there.
+typedef struct Sftp {
+    Vfs vfs;
+    char root[PATH_MAX_LEN];    // "sftp://" and the host; remote paths follow
+    char back[PATH_MAX_LEN];    // the local directory it was opened from
+    pid_t pid;
+    int fd;
+    pthread_t reader;
+    pthread_mutex_t lock;       // guards slots, next_id and dead
+    pthread_cond_t cond;
+    pthread_mutex_t write_lock;
+    SftpSlot slots[SFTP_SLOTS];
+    uint32_t next_id;
+    int dead;
+    int inflight;               // requests sent and not yet answered
+    struct timespec heard;      // the last reply, or the first request after a quiet spell
+    SftpDir cache[SFTP_CACHE];  // used from the UI thread only
+    unsigned long clock;
+    atomic_int cancel;          // stops the transfers under way
+    atomic_llong moved;         // bytes they have carried
+} Sftp;
+
+typedef struct {
+    Pool pool;
+    Sftp *s;
+    atomic_int failed;
+} SftpJob;
+
+typedef struct {
+    int put;
+    SftpAttrs at;       // of the remote file, when fetching
+    char *to;           // after from in the same block
+    char from[];
+} SftpTask;
+
+// A paste between a local directory and an SFTP panel. It runs on a worker
+// so the panels stay live, and the main loop polls it as it does compare
+// and sync.
+typedef struct {
+    Pool pool;
+    Sftp *s;
+    int put;
+    char from[PATH_MAX_LEN], to[PATH_MAX_LEN];  // the remote side as a remote path
+    int failed;
+} CopyJob;
+
+// A program started in the background. The main loop wakes on its pidfd
+// and output, and reaps it.
+typedef struct {
+    pid_t pid;          // 0 for a free slot
+    int pidfd;          // readable once it exits; -1 on kernels without pidfds
+    int out;            // its stdout and stderr, -1 once closed
+    char *buf;          // the first PROC_CAPTURE bytes of them
+    size_t len;
+    char name[64];
+} Proc;
+
+typedef struct {
+    time_t at;
+    char text[256];
+} Message;
+
+// Latencies in microseconds, in buckets that are exact below LATENCY_SUB
+// and then split each doubling into LATENCY_SUB equal parts, as an HDR
+// histogram does: every value is known to within 1/LATENCY_SUB.
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t n, sum, max;
+} Histogram;
+
+enum { ACT_NAVIGATE, ACT_OPEN, ACT_COPY, ACT_DELETE, ACT_REFRESH, ACT_COMMAND, ACT_EDIT, ACT_OTHER, ACT_COUNT };
+
+typedef struct {
+    char *text;         // not terminated
+    int len;
+} ShellLine;
+
+enum { ESC_NONE, ESC_START, ESC_CHARSET, ESC_CSI, ESC_STRING, ESC_STRING_END };
+
+// bash on a pseudo-terminal. Its output is kept as lines, as a terminal
+// without cursor addressing shows it: carriage returns, backspaces and
+// line erases are applied, other escape sequences are dropped. Before
+// each prompt bash sends a control string with the last exit status and
+// its directory, which marks where a command's output ends. Every
+// finished line also goes to a temporary log, so output that has left the
+// ring can still be read and searched in the viewer.
+typedef struct {
+    int fd;             // the master side, -1 once bash has exited
+    pid_t pid;
+    ShellLine lines[SHELL_LINES];   // ring of finished lines, oldest at head
+    int head, count;
+    char cur[SHELL_COLS];           // the line still being written
+    int cur_len, col;
+    int esc, param;     // escape sequence state
+    char osc[PATH_MAX_LEN + 32];    // the control string being read
+    int osc_len;
+    int busy;           // bash has not been back at its prompt since the last line sent
+    int done;           // a command finished since the last shell_update
+    int status;         // of the last command
+    char cwd[PATH_MAX_LEN];         // bash's directory at its last prompt
+    int rows, cols;
+    int scroll;         // lines back from the newest on screen
+    size_t bytes;       // text held by the ring
+    int log;            // -1 if it could not be created
+    char log_path[PATH_MAX_LEN];
+    char spill[SHELL_SPILL];        // finished lines not yet written to it
+    int spill_len;
+    off_t log_size;     // written so far
+    off_t mark;         // where the output of the last line sent starts
+    char *queued;       // lines held back until the cd sent ahead of them is done
+    size_t queued_len;
+} Shell;
+
+typedef struct {
+    char *path;         // relative to the job's root
+    int len;
+    int dir;
+    int score;
+} Found;
+
+// On-disk name index: the header, then every path under root sorted and
+// front-coded in blocks of IDX_BLOCK (flags byte, shared prefix and suffix
+// lengths as varints, the suffix, and a directory's mtime), the block
+// offsets, a sorted IdxTri table and the block ids it points into.
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t nblocks;
+    uint64_t blocks;        // offset of nblocks + 1 block offsets
+    uint64_t ntris;
+    uint64_t tris;
+    uint64_t postings;
+    uint64_t ndirs;
+    int64_t built;
+    int64_t root_mtime;
+    char root[PATH_MAX_LEN];
+} IdxHeader;
+
+typedef struct {
+    uint32_t tri;           // three lowercased bytes
+    uint32_t count;
+    uint64_t start;         // where its postings begin
+} IdxTri;
+
+typedef struct {
+    char *path;
+    int len;
+    int dir;
+    int64_t mtime;
+    int64_t size;
+} IdxPath;
+
+// On-disk content index: the header, every path under root as a CidxEntry
+// sorted by path, their names, a sorted IdxTri table, and per trigram the
+// ids of the files holding it as varint deltas.
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t entries;
+    uint64_t names;
+    uint64_t ntris;
+    uint64_t tris;
+    uint64_t postings;
+    int64_t built;
+    int64_t root_mtime;
+    char root[PATH_MAX_LEN];
+} CidxHeader;
+
+typedef struct {
+    uint64_t name;          // offset in the names
+    int64_t mtime;
+    int64_t size;           // -1 for a directory
+} CidxEntry;
+
+typedef struct {
+    uint32_t last, count;
+    uint64_t at;            // postings bytes, then the write cursor
+} CidxSlot;
+
+typedef struct {
+    Pool pool;
+    char root[PATH_MAX_LEN];
+    char file[PATH_MAX_LEN];
+    dev_t dev;
+    pthread_t thread;
+    Arena strings;
+    IdxPath *paths;
+    size_t npaths;
+    Arena found_strings[MAX_WORKERS];   // collected by each worker, merged when the walk ends
+    IdxPath *found[MAX_WORKERS];
+    size_t nfound[MAX_WORKERS], found_cap[MAX_WORKERS];
+    atomic_int lost;        // a path or its trigrams could not be kept, so the index would miss it
+    atomic_long dirs;
+    int64_t root_mtime;
+    int content;            // index file contents rather than names
+    atomic_int reading;
+    atomic_long read;
+    uint8_t **lists;        // per path, its trigrams as varint deltas
+    uint32_t *list_lens;
+    uint64_t *seen[MAX_WORKERS];
+    int failed;
+    atomic_int done;
+} IndexBuild;
+
+// inotify watches on the directories of an index, by descriptor.
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;   // guards paths
+    char **paths;           // relative to the index's root
+    int cap;
+    atomic_int count;
+} Watches;
+
+typedef void (*WatchFn)(void *ctx, const char *rel, uint32_t mask);
+
+// A path created or removed since an index was written, relative to its
+// root. seq orders it against the other changes.
+typedef struct {
+    char *rel;
+    long seq;
+    int dir;
+    int gone;
+} IdxChange;
+
+// A loaded index plus what inotify reported since: paths added and removed,
+// both sorted by path. New directories are listed on the walk pool, which
+// hands back what it finds in found.
+typedef struct {
+    char root[PATH_MAX_LEN];
+    const char *sep;
+    const char *map;
+    size_t size;
+    const IdxHeader *hdr;
+    const uint64_t *blocks;
+    const IdxTri *tris;
+    const uint32_t *postings;
+    uint64_t npostings;
+    Watches watches;
+    pthread_t checker;
+    atomic_int stop;
+    atomic_long stale, checked;
+    IdxChange *added, *removed;
+    int nadded, nremoved;
+    long changes, seq;
+    IdxChange *batch;       // events of the current index_events call
+    int nbatch, batch_cap;
+    Pool walk;
+    int walking;
+    IdxChange *queued;      // new directories waiting for the walk pool
+    int nqueued, queued_cap;
+    pthread_mutex_t lock;   // guards found
+    IdxChange *found;
+    int nfound, found_cap;
+} NameIndex;
+
+// A loaded content index plus the files changed or created since it was
+// built, which every search reads regardless of the postings.
+typedef struct {
+    char root[PATH_MAX_LEN];
+    const char *sep;
+    const char *map;
+    size_t size;
+    const CidxHeader *hdr;
+    const CidxEntry *entries;
+    const char *names;
+    size_t names_size;
+    const IdxTri *tris;
+    const unsigned char *postings;
+    size_t postings_size;
+    Watches watches;
+    pthread_t checker;
+    atomic_int stop;
+    atomic_long checked;
+    pthread_mutex_t lock;   // guards dirty
+    char **dirty;           // sorted, relative to root
+    int ndirty, dirty_cap;
+} ContentIndex;
+
+typedef struct FindJob {
+    Pool pool;          // tasks are malloc'd relative directory paths
+    char root[PATH_MAX_LEN];
+    char text[FILTER_MAX];
+    int fuzzy;
+    char query[FILTER_MAX];     // lowercased fuzzy query
+    int qlen;
+    Pattern pat;
+    pthread_mutex_t lock;       // guards strings and found
+    Arena strings;
+    Found *found;
+    size_t nfound, cap;
+    size_t taken;       // moved into the panel so far
+    atomic_long dirs;
+    int indexed;        // answered from the name index, no walk
+    int done;
+} FindJob;
+
+typedef struct {
+    size_t off, len;
+} Hit;
+
+// Hits holds every match in [lo, hi), sorted; the worker grows that range
+// in direction dir until SEARCH_AHEAD matches lie beyond goal.
+typedef struct {
+    char text[FILTER_MAX];
+    int regex;
+    regex_t re;
+    Hit *hits;
+    size_t nhits, cap;
+    size_t lo, hi;
+    size_t goal;
+    int dir;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int started;
+    atomic_int busy;
+    atomic_int stop;
+} Search;
+
+typedef struct {
+    char path[PATH_MAX_LEN];
+    int fd;
+    const char *map;
+    size_t size;
+    size_t *checkpoints;    // start of every LINE_CHECKPOINT-th line
+    size_t ncheckpoints, cap;
+    size_t indexed_bytes;
+    size_t indexed_lines;
+    int index_done;
+    pthread_mutex_t lock;
+    pthread_t indexer;
+    int indexer_running;
+    atomic_int stop;
+    size_t top;
+    int left;
+    Search search;
+} Viewer;
+
+typedef struct {
+    off_t page;
+    ssize_t len;
+    unsigned long used;
+    unsigned char data[HEX_PAGE];
+} HexPage;
+
+// Binary files are read a page at a time through a small LRU cache, so
+// memory stays bounded however large the file is.
+typedef struct {
+    char path[PATH_MAX_LEN];
+    int fd;
+    off_t size;
+    off_t top;
+    off_t match, match_len;
+    HexPage cache[HEX_CACHE];
+    unsigned long clock;
+} HexView;
+
+Pattern pattern_cache[PATTERN_CACHE];
+unsigned long pattern_clock;
+
+DirSummary **dir_cache;
+size_t dir_cache_cap, dir_cache_count;
+pthread_rwlock_t dir_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+char *arena_strndup(Arena *a, const char *s, size_t len) {
+    ArenaBlock *b = a->head;
+    if (!b || b->used + len + 1 > b->size) {
+        size_t size = len + 1 > ARENA_BLOCK ? len + 1 : ARENA_BLOCK;
+        b = malloc(sizeof(ArenaBlock) + size);
+        if (!b) return NULL;
+        b->next = a->head; b->used = 0; b->size = size;
+        a->head = b;
+    }
+    char *p = b->data + b->used;
+    memcpy(p, s, len); p[len] = '\0';
+    b->used += len + 1;
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+int worker_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    return (int)n;
+}
+
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int latency_bucket(uint64_t us) {
+    if (us < 2 * LATENCY_SUB) return us;
+    int shift = 63 - __builtin_clzll(us) - __builtin_ctz(LATENCY_SUB);
+    int b = shift * LATENCY_SUB + (us >> shift);
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+// The largest value bucket b holds.
+uint64_t latency_bucket_max(int b) {
+    if (b < 2 * LATENCY_SUB) return b;
+    int shift = b / LATENCY_SUB - 1;
+    return ((uint64_t)(b - shift * LATENCY_SUB + 1) << shift) - 1;
+}
+
+void hist_add(Histogram *h, long us) {
+    if (us < 0) us = 0;
+    h->counts[latency_bucket(us)]++;
+    h->n++;
+    h->sum += us;
+    if ((uint64_t)us > h->max) h->max = us;
+}
+
+// The value below which a fraction q of the samples lie.
+uint64_t hist_value(const Histogram *h, double q) {
+    uint64_t rank = q * h->n + 0.999999, seen = 0;
+    if (rank < 1) rank = 1;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) return latency_bucket_max(b) < h->max ? latency_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+int input_pending(int wait_ms) {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, wait_ms) > 0;
+}
+
+volatile sig_atomic_t interrupted;
+
+void on_interrupt(int sig) {
+    interrupted = 1;
+}
+
+// File mappings read while another process may truncate the file. Touching
+// a page past the new end raises SIGBUS; for an address inside a guarded
+// range the handler maps a zero page over it, so the reader sees NULs and
+// carries on until its owner notices the new size and maps the file again.
+_Atomic uintptr_t guard_lo[MAP_GUARDS], guard_hi[MAP_GUARDS];
+uintptr_t guard_page;
+
+void on_sigbus(int sig, siginfo_t *si, void *ctx) {
+    uintptr_t a = (uintptr_t)si->si_addr;
+    for (int i = 0; i < MAP_GUARDS; i++) {
+        if (a < atomic_load(&guard_lo[i]) || a >= atomic_load(&guard_hi[i])) continue;
+        void *page = (void *)(a & ~(guard_page - 1));
+        if (mmap(page, guard_page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) return;
+        break;
+    }
+    signal(SIGBUS, SIG_DFL);    // not ours: fault again and die as before
+}
+
+void map_guard_init(void) {
+    struct sigaction sa = {.sa_sigaction = on_sigbus, .sa_flags = SA_SIGINFO | SA_NODEFER};
+    guard_page = sysconf(_SC_PAGESIZE);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+// Guards [map, map + size); with every slot taken the mapping simply goes
+// unguarded. Pages replaced by the handler split the mapping, so it must
+// be unmapped and mapped again rather than grown with mremap.
+void map_guard(const void *map, size_t size) {
+    for (int i = 0; i < MAP_GUARDS && size; i++) {
+        uintptr_t none = 0;
+        if (atomic_compare_exchange_strong(&guard_lo[i], &none, (uintptr_t)map)) {
+            atomic_store(&guard_hi[i], (uintptr_t)map + size);
+            return;
+        }
+    }
+}
+
+void map_unguard(const void *map) {
+    for (int i = 0; i < MAP_GUARDS; i++)
+        if (atomic_load(&guard_lo[i]) == (uintptr_t)map) {
+            atomic_store(&guard_hi[i], 0);
+            atomic_store(&guard_lo[i], 0);
+            return;
+        }
+}
+
+// Starts argv[0] from PATH with posix_spawnp, which execs without copying
+// our address space and reports exec failures. fds[i] becomes the child's
+// stdin, stdout and stderr: -1 keeps ours, -2 gives /dev/null. With
+// session the child gets its own, away from our terminal.
+pid_t spawn(char *const argv[], const int fds[3], int session) {
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] == -2) posix_spawn_file_actions_addopen(&fa, i, "/dev/null", i ? O_WRONLY : O_RDONLY, 0);
+        else if (fds[i] >= 0) posix_spawn_file_actions_adddup2(&fa, fds[i], i);
+    }
+#ifdef POSIX_SPAWN_SETSID
+    if (session) posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+    pid_t pid;
+    int failed = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    return failed ? -1 : pid;
+}
+
+int latency_skip;   // the key being handled left the main screen: not a sample
+
+// Runs argv on the whole terminal and waits for it. Ctrl-C there is the
+// program's; the copy we get is dropped.
+int run_foreground(char *const argv[]) {
+    const int fds[3] = {-1, -1, -1};
+    latency_skip = 1;
+    int st = -1;
+    def_prog_mode(); endwin();
+    pid_t pid = spawn(argv, fds, 0);
+    while (pid > 0 && waitpid(pid, &st, 0) < 0 && errno == EINTR) {}
+    reset_prog_mode(); refresh();
+    interrupted = 0;
+    return pid > 0 ? st : -1;
+}
+
+Proc procs[PROC_MAX];
+
+// Starts argv in the background, in its own session, with its output
+// captured; proc_update reaps it.
+int proc_start(char *const argv[]) {
+    Proc *p = NULL;
+    for (int i = 0; i < PROC_MAX && !p; i++)
+        if (!procs[i].pid) p = &procs[i];
+    int pipefd[2];
+    if (!p || pipe2(pipefd, O_CLOEXEC) != 0) return -1;
+    const int fds[3] = {-2, pipefd[1], pipefd[1]};
+    pid_t pid = spawn(argv, fds, 1);
+    close(pipefd[1]);
+    if (pid < 0) { close(pipefd[0]); return -1; }
+    *p = (Proc){.pid = pid, .pidfd = -1, .out = pipefd[0]};
+#ifdef SYS_pidfd_open
+    p->pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    fcntl(p->out, F_SETFL, O_NONBLOCK);
+    snprintf(p->name, sizeof(p->name), "%s", argv[0]);
+    return 0;
+}
+
+// Adds the descriptors that signal news from background processes.
+int proc_fds(struct pollfd *fds) {
+    int n = 0;
+    for (int i = 0; i < PROC_MAX; i++) {
+        if (!procs[i].pid) continue;
+        if (procs[i].pidfd >= 0) fds[n++] = (struct pollfd){procs[i].pidfd, POLLIN, 0};
+        if (procs[i].out >= 0) fds[n++] = (struct pollfd){procs[i].out, POLLIN, 0};
+    }
+    return n;
+}
+
+void proc_read(Proc *p) {
+    char buf[4096];
+    ssize_t n;
+    while (p->out >= 0 && (n = read(p->out, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            break;
+        }
+        if (!p->buf) p->buf = malloc(PROC_CAPTURE);
+        size_t keep = p->buf && p->len < PROC_CAPTURE ? PROC_CAPTURE - p->len : 0;
+        if (keep > (size_t)n) keep = n;
+        if (keep) memcpy(p->buf + p->len, buf, keep);
+        p->len += keep;
+    }
+    close(p->out);      // at its end: whoever held it has gone
+    p->out = -1;
+}
+
+// Takes in background output and reaps the processes that have exited.
+// Returns 1 with msg set when one failed: the first line it wrote, or how
+// it ended.
+int proc_update(char *msg, size_t size) {
+    int failed = 0;
+    for (int i = 0; i < PROC_MAX; i++) {
+        Proc *p = &procs[i];
+        int st;
+        if (!p->pid) continue;
+        proc_read(p);
+        if (waitpid(p->pid, &st, WNOHANG) != p->pid) continue;
+        proc_read(p);
+        if (!failed && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) {
+            char *nl = p->len ? memchr(p->buf, '\n', p->len) : NULL;
+            int len = nl ? nl - p->buf : (int)p->len;
+            if (len) snprintf(msg, size, "%s: %.*s", p->name, len, p->buf);
+            else if (WIFEXITED(st)) snprintf(msg, size, "%s exited with status %d", p->name, WEXITSTATUS(st));
+            else snprintf(msg, size, "%s was killed by signal %d", p->name, WTERMSIG(st));
+            failed = 1;
+        }
+        if (p->out >= 0) close(p->out);
+        if (p->pidfd >= 0) close(p->pidfd);
+        free(p->buf);
+        memset(p, 0, sizeof(*p));
+    }
+    return failed;
+}
+
+// Maps a byte to one of 64 signature bits: letters (case-folded) and digits
+// get their own bit, everything else shares the remaining 28.
+int char_bit(unsigned char c) {
+    c = tolower(c);
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= '0' && c <= '9') return 26 + c - '0';
+    return 36 + c % 28;
+}
+
+uint64_t name_signature(const char *s, int len) {
+    uint64_t sig = 0;
+    for (int i = 0; i < len; i++) sig |= 1ULL << char_bit((unsigned char)s[i]);
+    return sig;
+}
+
+FileType detect_file_type(const char *path, struct stat *st) {
+    if (S_ISDIR(st->st_mode)) return TYPE_FOLDER;
+    if (st->st_mode & S_IXUSR) return TYPE_EXEC;
+    const char *ext = strrchr(path, '.');
+    if (ext) {
+        if (strcmp(ext, ".txt") == 0 || strcmp(ext, ".md") == 0) return TYPE_TEXT;
+        if (strcmp(ext, ".png") == 0 || strcmp(ext, ".jpg") == 0) return TYPE_IMAGE;
+        if (strcmp(ext, ".mp4") == 0 || strcmp(ext, ".mkv") == 0) return TYPE_VIDEO;
+    }
+    return TYPE_OTHER;
+}
+
+int compare_entries(const void *a, const void *b) {
+    Entry *ea = (Entry *)a;
+    Entry *eb = (Entry *)b;
+    if (ea->type == TYPE_FOLDER && eb->type != TYPE_FOLDER) return -1;
+    if (ea->type != TYPE_FOLDER && eb->type == TYPE_FOLDER) return 1;
+    return strcmp(ea->name, eb->name);
+}
+
+// Lists cwd through the panel's backend a batch at a time; stats come in
+// one call per batch, or with the names when the backend has them anyway.
+// Returns -1, leaving the panel as it was, when cwd cannot be opened.
+int list_dir(Panel *panel) {
+    Vfs *fs = panel->vfs;
+    void *dir = fs->ops->open_dir(fs, panel->cwd);
+    if (!dir) return -1;
+
+    panel->count = 0;
+    VfsEntry batch[VFS_BATCH];
+    int n;
+    while ((n = fs->ops->read_batch(fs, dir, batch, VFS_BATCH)) > 0) {
+        if (fs->ops->stat_batch) fs->ops->stat_batch(fs, dir, batch, n);
+        for (int i = 0; i < n; i++) {
+            VfsEntry *v = &batch[i];
+            if (strcmp(v->name, ".") == 0) continue;  // skip "."
+            if (panel->count == panel->cap) {
+                int cap = panel->cap ? panel->cap * 2 : 256;
+                Entry *grown = realloc(panel->entries, cap * sizeof(Entry));
+                if (!grown) { n = 0; break; }
+                panel->entries = grown; panel->cap = cap;
+            }
+            Entry *e = &panel->entries[panel->count];
+            e->name_len = v->name_len;
+            e->name = arena_strndup(&panel->names, v->name, e->name_len);
+            if (!e->name) { n = 0; break; }
+            e->sig = name_signature(e->name, e->name_len);
+            e->marked = 0;
+            e->sizing = 0;
+            e->node = v->node;
+            struct stat st = {.st_mode = v->mode};
+            if (v->mode) {
+                e->type = detect_file_type(e->name, &st);
+                e->size = e->type == TYPE_FOLDER ? -1 : v->size;
+            } else {
+                e->type = TYPE_OTHER;
+                e->size = -1;
+            }
+            panel->count++;
+        }
+        if (!n) break;
+    }
+    fs->ops->close_dir(fs, dir);
+    qsort(panel->entries, panel->count, sizeof(Entry), compare_entries);
+    panel->marked = 0;
+    if (panel->filtered || panel->filter[0]) { panel->filter_dirty = 1; panel->filter_reusable = 0; }
+    return 0;
+}
+
+void free_panel(Panel *panel) {
+    arena_reset(&panel->names);
+    panel->count = 0;
+}
+
+int panel_rows(Panel *p) {
+    if (p->grep) return atomic_load(&p->grep->count);
+    return p->filtered ? p->view_count : p->count;
+}
+
+Entry *panel_entry(Panel *p, int row) {
+    return &p->entries[p->filtered ? p->view[row] : row];
+}
+
+Entry *cur_entry(Panel *p) {
+    if (p->grep || p->selected >= panel_rows(p)) return NULL;
+    return panel_entry(p, p->selected);
+}
+
+// Moves the selection straight to row and shifts the scroll offset by the
+// same amount, so page moves keep the cursor at its place on screen.
+void move_selection(Panel *p, int row, int list_h) {
+    int rows = panel_rows(p);
+    if (row >= rows) row = rows - 1;
+    if (row < 0) row = 0;
+    p->scroll_offset += row - p->selected;
+    if (p->scroll_offset > rows - list_h) p->scroll_offset = rows - list_h;
+    if (p->scroll_offset < 0) p->scroll_offset = 0;
+    p->selected = row;
+}
+
+// Scores name against the lowercased query as a subsequence, fzf style:
+// the match window is tightened from its end, then consecutive runs and
+// matches at word boundaries earn bonuses and gaps cost a point each.
+int fuzzy_score(const char *name, int len, const char *q, int qlen) {
+    if (qlen == 0) return 0;
+    int qi = 0, end = -1;
+    for (int i = 0; i < len; i++) {
+        if (tolower((unsigned char)name[i]) == q[qi] && ++qi == qlen) { end = i; break; }
+    }
+    if (end < 0) return NO_MATCH;
+    int start = end;
+    qi = qlen - 1;
+    for (int i = end; i >= 0; i--) {
+        if (tolower((unsigned char)name[i]) == q[qi] && --qi < 0) { start = i; break; }
+    }
+    int score = 0, run = 0;
+    qi = 0;
+    for (int i = start; i <= end; i++) {
+        if (tolower((unsigned char)name[i]) == q[qi]) {
+            unsigned char prev = i ? name[i-1] : '/';
+            if (strchr("/_-. ", prev) || (islower(prev) && isupper((unsigned char)name[i]))) score += 10;
+            if (run++) score += 8;
+            score += 16;
+            qi++;
+        } else {
+            run = 0;
+            score--;
+        }
+    }
+    return score - (len - qlen) / 8;
+}
+
+void pattern_free(Pattern *slot) {
+    for (int i = 0; i < slot->nre; i++) regfree(&slot->re[i]);
+    slot->nre = 0;
+}
+
+// Compiles text into slot; returns -1 if the regex does not compile.
+int pattern_init(Pattern *slot, const char *text) {
+    slot->lit_kind = LIT_NONE;
+    snprintf(slot->text, sizeof(slot->text), "%s", text);
+    slot->regex = text[0] == '/';
+    if (slot->regex) {
+        char re[FILTER_MAX];
+        snprintf(re, sizeof(re), "%s", text + 1);
+        int len = strlen(re);
+        if (len && re[len-1] == '/') re[len-1] = '\0';
+        int n = worker_count();
+        for (; slot->nre < n; slot->nre++)
+            if (regcomp(&slot->re[slot->nre], re, REG_EXTENDED | REG_NOSUB) != 0) break;
+        if (slot->nre < n) {
+            pattern_free(slot);
+            return -1;
+        }
+    } else {
+        int len = strlen(text);
+        int lead = text[0] == '*';
+        int trail = len > lead && text[len-1] == '*';
+        slot->lit_len = len - lead - trail;
+        memcpy(slot->lit, text + lead, slot->lit_len);
+        slot->lit[slot->lit_len] = '\0';
+        if (!strpbrk(slot->lit, "*?[\\"))
+            slot->lit_kind = lead && trail ? LIT_INFIX : lead ? LIT_SUFFIX : trail ? LIT_PREFIX : LIT_EXACT;
+    }
+    return 0;
+}
+
+// Patterns starting with '/' are extended regexes, anything else is a glob.
+// Compiled forms stay in a small LRU cache; regexes get one copy per worker
+// since glibc serializes regexec() calls sharing a regex_t. Returns NULL if
+// the pattern does not compile.
+Pattern *compile_pattern(const char *text) {
+    Pattern *slot = &pattern_cache[0];
+    for (int i = 0; i < PATTERN_CACHE; i++) {
+        Pattern *c = &pattern_cache[i];
+        if (c->used && !strcmp(c->text, text)) { c->used = ++pattern_clock; return c; }
+        if (c->used < slot->used) slot = c;
+    }
+    pattern_free(slot);
+    slot->used = 0;
+    if (pattern_init(slot, text) != 0) return NULL;
+    slot->used = ++pattern_clock;
+    return slot;
+}
+
+int pattern_match(Pattern *pat, int worker, const char *name, int len) {
+    if (pat->regex) return regexec(&pat->re[worker], name, 0, NULL, 0) == 0;
+    switch (pat->lit_kind) {
+        case LIT_EXACT: return len == pat->lit_len && !memcmp(name, pat->lit, len);
+        case LIT_PREFIX: return len >= pat->lit_len && !memcmp(name, pat->lit, pat->lit_len);
+        case LIT_SUFFIX: return len >= pat->lit_len && !memcmp(name + len - pat->lit_len, pat->lit, pat->lit_len);
+        case LIT_INFIX: return memmem(name, len, pat->lit, pat->lit_len) != NULL;
+    }
+    return fnmatch(pat->text, name, 0) == 0;
+}
+
+void *filter_worker(void *arg) {
+    FilterTask *t = arg;
+    for (int i = t->begin; i < t->end; i++) {
+        if ((i & 1023) == 0 && atomic_load(t->cancel)) break;
+        int idx = t->cand ? t->cand[i] : i;
+        Entry *e = &t->panel->entries[idx];
+        int s = 0;
+        if (t->pat) {
+            if (!pattern_match(t->pat, t->worker, e->name, e->name_len)) continue;
+        } else {
+            if (t->qsig & ~e->sig) continue;
+            s = fuzzy_score(e->name, e->name_len, t->query, t->qlen);
+            if (s == NO_MATCH) continue;
+        }
+        t->out[t->nout].idx = idx;
+        t->out[t->nout].score = s;
+        t->nout++;
+    }
+    atomic_fetch_add(t->done, 1);
+    return NULL;
+}
+
+int compare_matches(const void *a, const void *b) {
+    const Match *ma = a, *mb = b;
+    if (ma->score != mb->score) return mb->score > ma->score ? 1 : -1;
+    return ma->idx - mb->idx;
+}
+
+// Evaluates the lowercased fuzzy query q, or pat when given, over cand (every
+// entry when cand is NULL) and writes the matches to out in candidate order.
+// Large inputs are split across worker threads; if cancellable, they are
+// abandoned as soon as another key arrives and -1 is returned.
+int run_filter(Panel *p, const int *cand, int ncand, const char *q, Pattern *pat, int cancellable, Match *out) {
+    int qlen = 0;
+    uint64_t qsig = 0;
+    if (!pat)
+        for (; q[qlen]; qlen++) qsig |= 1ULL << char_bit(q[qlen]);
+
+    int threaded = ncand >= FILTER_PARALLEL_MIN;
+    int nthreads = threaded ? worker_count() : 1;
+    FilterTask tasks[MAX_WORKERS];
+    pthread_t threads[MAX_WORKERS];
+    atomic_int cancel = 0, done = 0;
+    for (int t = 0; t < nthreads; t++) {
+        int begin = (long)ncand * t / nthreads;
+        tasks[t] = (FilterTask){ p, cand, begin, (long)ncand * (t + 1) / nthreads,
+                                 q, qlen, qsig, pat, t, out + begin, 0, &cancel, &done };
+    }
+    if (!threaded) {
+        filter_worker(&tasks[0]);
+    } else {
+        int started = 0;
+        for (; started < nthreads; started++)
+            if (pthread_create(&threads[started], NULL, filter_worker, &tasks[started]) != 0) break;
+        if (started < nthreads) atomic_store(&cancel, 1);
+        while (atomic_load(&done) < started && !atomic_load(&cancel))
+            if (input_pending(2) && cancellable) atomic_store(&cancel, 1);
+        for (int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+        if (atomic_load(&cancel)) return -1;
+    }
+
+    int n = 0;
+    for (int t = 0; t < nthreads; t++) {
+        memmove(out + n, tasks[t].out, tasks[t].nout * sizeof(Match));
+        n += tasks[t].nout;
+    }
+    return n;
+}
+
+// Rebuilds the panel's view for its current filter. When a fuzzy query only
+// extends the last completed one, just the previous matches are rescored.
+// Returns -1 if a newer key interrupted the pass; the panel stays dirty so
+// the next pass retries with the newer query.
+int apply_filter(Panel *p) {
+    p->filter_dirty = 0;
+    char q[FILTER_MAX];
+    Pattern *pat = NULL;
+    const int *cand = NULL;
+    int ncand = p->count;
+    if (p->filter_kind == FILTER_PATTERN) {
+        pat = compile_pattern(p->filter);
+        if (!pat) { p->view_count = 0; return 0; }
+        q[0] = '\0';
+    } else {
+        int qlen = 0;
+        for (; p->filter[qlen]; qlen++) q[qlen] = tolower((unsigned char)p->filter[qlen]);
+        q[qlen] = '\0';
+        if (p->filter_reusable && !strncmp(q, p->filter_done, strlen(p->filter_done))) {
+            cand = p->view; ncand = p->view_count;
+        }
+    }
+    Match *matches = malloc((ncand + 1) * sizeof(Match));
+    if (!matches) return -1;
+    int n = run_filter(p, cand, ncand, q, pat, 1, matches);
+    if (n < 0) {
+        free(matches);
+        p->filter_dirty = 1;
+        return -1;
+    }
+    if (!pat && q[0]) qsort(matches, n, sizeof(Match), compare_matches);
+    int *view = malloc((n + 1) * sizeof(int));
+    if (!view) { free(matches); return -1; }
+    for (int i = 0; i < n; i++) view[i] = matches[i].idx;
+    free(matches);
+    free(p->view);
+    p->view = view;
+    p->view_count = n;
+    strcpy(p->filter_done, q);
+    p->filter_reusable = !pat;
+    p->selected = p->scroll_offset = 0;
+    return 0;
+}
+
+// Marks every shown entry matching pat; returns how many were newly marked.
+int mark_matches(Panel *p, Pattern *pat) {
+    int rows = panel_rows(p);
+    Match *matches = malloc((rows + 1) * sizeof(Match));
+    if (!matches) return 0;
+    int n = run_filter(p, p->filtered ? p->view : NULL, rows, "", pat, 0, matches);
+    int marked = 0;
+    for (int i = 0; i < n; i++) {
+        Entry *e = &p->entries[matches[i].idx];
+        if (e->marked || !strcmp(e->name, "..")) continue;
+        e->marked = 1;
+        marked++;
+    }
+    free(matches);
+    p->marked += marked;
+    return marked;
+}
+
+// Hides or restores the filtered view without recomputing it.
+void toggle_filter(Panel *p) {
+    if (p->filtered) {
+        if (p->selected < p->view_count) p->selected = p->view[p->selected];
+        p->filtered = 0;
+    } else if (p->filter[0]) {
+        p->filtered = 1;
+        p->selected = p->scroll_offset = 0;
+    }
+}
+
+void clear_filter(Panel *p) {
+    if (p->filtered) {
+        if (p->selected < p->view_count) p->selected = p->view[p->selected];
+        else p->selected = 0;
+    }
+    free(p->view);
+    p->view = NULL;
+    p->view_count = 0;
+    p->filtered = p->filter_dirty = p->filter_reusable = 0;
+    p->filter[0] = p->filter_done[0] = '\0';
+    p->filter_kind = FILTER_FUZZY;
+}
+
+int is_dot_entry(const char *name) {
+    return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+int remove_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path) == 0 ? 0 : -1;
+}
+
+// Removes path and everything under it, stopping at the first entry that
+// cannot be removed. A path ending in "." or ".." is refused: the walk
+// would take the directory holding it, and the panel's own, with it.
+int delete_path(const char *path) {
+    const char *base = strrchr(path, '/');
+    if (is_dot_entry(base ? base + 1 : path)) { errno = EINVAL; return -1; }
+    return nftw(path, remove_cb, 64, FTW_DEPTH | FTW_PHYS) == 0 ? 0 : -1;
+}
+
+void deque_push(Deque *d, void *item) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 64;
+        void **items = malloc(cap * sizeof(void *));
+        for (int i = 0; i < d->count; i++) items[i] = d->items[(d->head + i) % d->cap];
+        free(d->items);
+        d->items = items; d->cap = cap; d->head = 0;
+    }
+    d->items[(d->head + d->count++) % d->cap] = item;
+    pthread_mutex_unlock(&d->lock);
+}
+
+void *deque_pop(Deque *d) {
+    void *item = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->count) item = d->items[(d->head + --d->count) % d->cap];
+    pthread_mutex_unlock(&d->lock);
+    return item;
+}
+
+void *deque_steal(Deque *d) {
+    void *item = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->count) {
+        item = d->items[d->head];
+        d->head = (d->head + 1) % d->cap;
+        d->count--;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return item;
+}
+
+void *pool_worker(void *arg) {
+    PoolWorker *w = arg;
+    Pool *p = w->pool;
+    while (1) {
+        void *task = deque_pop(&p->queues[w->id]);
+        for (int i = 1; !task && i < p->nworkers; i++)
+            task = deque_steal(&p->queues[(w->id + i) % p->nworkers]);
+        if (task) {
+            if (atomic_load(&p->cancel)) free(task);
+            else p->fn(p, w->id, task);
+            if (atomic_fetch_sub(&p->pending, 1) == 1) {
+                pthread_mutex_lock(&p->lock);
+                pthread_cond_broadcast(&p->wake);
+                pthread_mutex_unlock(&p->lock);
+            }
+            continue;
+        }
+        pthread_mutex_lock(&p->lock);
+        if (atomic_load(&p->pending) == 0) { pthread_mutex_unlock(&p->lock); break; }
+        // A push can slip in between the failed steal and the wait, so
+        // never sleep for long.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+// Sets up n workers, for a pool that waits on something other than the CPU.
+void pool_init_workers(Pool *p, TaskFn fn, void *ctx, int n) {
+    p->fn = fn;
+    p->ctx = ctx;
+    p->nworkers = n < MAX_WORKERS ? n : MAX_WORKERS;
+    for (int i = 0; i < p->nworkers; i++) {
+        memset(&p->queues[i], 0, sizeof(Deque));
+        pthread_mutex_init(&p->queues[i].lock, NULL);
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    atomic_init(&p->pending, 0);
+    atomic_init(&p->cancel, 0);
+    atomic_init(&p->next, 0);
+}
+
+void pool_init(Pool *p, TaskFn fn, void *ctx) {
+    pool_init_workers(p, fn, ctx, worker_count());
+}
+
+// Queues a task; worker is the calling pool worker, or -1 from outside.
+void pool_push(Pool *p, int worker, void *task) {
+    if (worker < 0) worker = atomic_fetch_add(&p->next, 1) % p->nworkers;
+    atomic_fetch_add(&p->pending, 1);
+    deque_push(&p->queues[worker], task);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Starts the workers; they exit once no task is queued or running, so every
+// initial task must be pushed first.
+void pool_run(Pool *p) {
+    for (int i = 0; i < p->nworkers; i++) {
+        p->args[i].pool = p;
+        p->args[i].id = i;
+        pthread_create(&p->threads[i], NULL, pool_worker, &p->args[i]);
+    }
+}
+
+// Waits for the workers, dropping whatever is still queued when cancel is set.
+void pool_join(Pool *p, int cancel) {
+    if (cancel) atomic_store(&p->cancel, 1);
+    for (int i = 0; i < p->nworkers; i++) pthread_join(p->threads[i], NULL);
+    for (int i = 0; i < p->nworkers; i++) {
+        free(p->queues[i].items);
+        pthread_mutex_destroy(&p->queues[i].lock);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+}
+
+size_t id_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)dev * 0xc2b2ae3d27d4eb4fULL;
+    return h ^ h >> 29;
+}
+
+// Finds or adds the slot of a file without locking; *added tells which.
+FileId *idset_probe(IdSet *s, dev_t dev, ino_t ino, int *added) {
+    if ((s->count + 1) * 4 > s->cap * 3) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        FileId *slots = calloc(cap, sizeof(FileId));
+        for (size_t i = 0; i < s->cap; i++) {
+            if (!s->slots[i].ino) continue;
+            size_t j = id_hash(s->slots[i].dev, s->slots[i].ino) & (cap - 1);
+            while (slots[j].ino) j = (j + 1) & (cap - 1);
+            slots[j] = s->slots[i];
+        }
+        free(s->slots);
+        s->slots = slots; s->cap = cap;
+    }
+    size_t j = id_hash(dev, ino) & (s->cap - 1);
+    while (s->slots[j].ino && (s->slots[j].ino != ino || s->slots[j].dev != dev))
+        j = (j + 1) & (s->cap - 1);
+    *added = !s->slots[j].ino;
+    if (*added) {
+        s->slots[j].dev = dev; s->slots[j].ino = ino;
+        s->count++;
+    }
+    return &s->slots[j];
+}
+
+size_t name_hash(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return h ^ h >> 32;
+}
+
+// Returns 1 the first time a file is seen.
+int idset_add(IdSet *s, dev_t dev, ino_t ino) {
+    int added;
+    pthread_mutex_lock(&s->lock);
+    idset_probe(s, dev, ino, &added);
+    pthread_mutex_unlock(&s->lock);
+    return added;
+}
+
+void free_summary(DirSummary *d) {
+    if (!d) return;
+    free(d->links);
+    free(d->subdirs);
+    free(d->files);
+    free(d->stamps);
+    free(d);
+}
+
+// Looks (dev, ino) up; the caller holds dir_cache_lock, for reading or
+// writing.
+DirSummary *dir_cache_find(dev_t dev, ino_t ino) {
+    if (!dir_cache_cap) return NULL;
+    size_t j = id_hash(dev, ino) & (dir_cache_cap - 1);
+    while (dir_cache[j] && (dir_cache[j]->ino != ino || dir_cache[j]->dev != dev))
+        j = (j + 1) & (dir_cache_cap - 1);
+    return dir_cache[j];
+}
+
+// Returns the slot for (dev, ino), growing the table; the caller holds
+// dir_cache_lock for writing.
+DirSummary **dir_cache_slot(dev_t dev, ino_t ino) {
+    if ((dir_cache_count + 1) * 4 > dir_cache_cap * 3) {
+        size_t cap = dir_cache_cap ? dir_cache_cap * 2 : 1024;
+        DirSummary **slots = calloc(cap, sizeof(DirSummary *));
+        for (size_t i = 0; i < dir_cache_cap; i++) {
+            DirSummary *d = dir_cache[i];
+            if (!d) continue;
+            size_t j = id_hash(d->dev, d->ino) & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = d;
+        }
+        free(dir_cache);
+        dir_cache = slots; dir_cache_cap = cap;
+    }
+    size_t j = id_hash(dev, ino) & (dir_cache_cap - 1);
+    while (dir_cache[j] && (dir_cache[j]->ino != ino || dir_cache[j]->dev != dev))
+        j = (j + 1) & (dir_cache_cap - 1);
+    return &dir_cache[j];
+}
+
+void size_push(Pool *pool, int worker, SizeRoot *root, const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    SizeTask *t = malloc(sizeof(SizeTask) + len);
+    if (!t) return;
+    t->root = root;
+    snprintf(t->path, len, "%s/%s", dir, name);
+    atomic_fetch_add(&root->pending, 1);
+    pool_push(pool, worker, t);
+}
+
+// Whether every file a cached summary counted still looks the same: a file
+// growing in place leaves its directory's mtime alone.
+int summary_fresh(const DirSummary *d, int fd) {
+    const char *name = d->files;
+    for (int i = 0; i < d->nfiles; i++, name += strlen(name) + 1) {
+        const FileStamp *f = &d->stamps[i];
+        struct stat st;
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_size != f->size || (st.st_nlink > 1) != f->shared ||
+            st.st_mtim.tv_sec != f->mtime.tv_sec || st.st_mtim.tv_nsec != f->mtime.tv_nsec) return 0;
+    }
+    return 1;
+}
+
+// Adds a summary to its root and queues the subdirectories.
+void size_apply(Pool *pool, int worker, SizeTask *t, DirSummary *d) {
+    SizeJob *job = pool->ctx;
+    long long bytes = d->own;
+    for (int i = 0; i < d->nlinks; i++)
+        if (idset_add(&job->seen, d->links[i].dev, d->links[i].ino)) bytes += d->links[i].size;
+    atomic_fetch_add(&t->root->bytes, bytes);
+    const char *name = d->subdirs;
+    for (int i = 0; i < d->nsubdirs; i++, name += strlen(name) + 1)
+        size_push(pool, worker, t->root, t->path, name);
+}
+
+// Scans one directory with fstatat on its fd, unless the cache already holds
+// a summary for the same (dev, ino, mtime).
+DirSummary *size_scan(int fd, const struct stat *dst) {
+    DIR *dir = fdopendir(fd);
+    if (!dir) { close(fd); return NULL; }
+    DirSummary *d = calloc(1, sizeof(DirSummary));
+    d->dev = dst->st_dev; d->ino = dst->st_ino; d->mtime = dst->st_mtim;
+    size_t names_len = 0, names_cap = 0, files_len = 0, files_cap = 0;
+    int links_cap = 0, stamps_cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            size_t len = strlen(de->d_name) + 1;
+            if (names_len + len > names_cap) {
+                names_cap = (names_len + len) * 2;
+                d->subdirs = realloc(d->subdirs, names_cap);
+            }
+            memcpy(d->subdirs + names_len, de->d_name, len);
+            names_len += len;
+            d->nsubdirs++;
+            continue;
+        }
+        size_t len = strlen(de->d_name) + 1;
+        if (files_len + len > files_cap) {
+            files_cap = (files_len + len) * 2;
+            d->files = realloc(d->files, files_cap);
+        }
+        memcpy(d->files + files_len, de->d_name, len);
+        files_len += len;
+        if (d->nfiles == stamps_cap) {
+            stamps_cap = stamps_cap ? stamps_cap * 2 : 16;
+            d->stamps = realloc(d->stamps, stamps_cap * sizeof(FileStamp));
+        }
+        d->stamps[d->nfiles++] = (FileStamp){st.st_size, st.st_mtim, st.st_nlink > 1};
+        if (st.st_nlink > 1) {
+            if (d->nlinks == links_cap) {
+                links_cap = links_cap ? links_cap * 2 : 16;
+                d->links = realloc(d->links, links_cap * sizeof(FileId));
+            }
+            d->links[d->nlinks++] = (FileId){st.st_dev, st.st_ino, st.st_size};
+        } else {
+            d->own += st.st_size;
+        }
+    }
+    closedir(dir);
+    return d;
+}
+
+// Measures one directory. Cache hits are looked up under the shared read
+// lock; new summaries stay with the worker until the job ends, so the walk
+// never waits for the write lock.
+void size_task(Pool *pool, int worker, void *arg) {
+    SizeJob *job = pool->ctx;
+    SizeTask *t = arg;
+    int fd = open(t->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        pthread_rwlock_rdlock(&dir_cache_lock);
+        DirSummary *d = dir_cache_find(st.st_dev, st.st_ino);
+        int hit = d && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec && summary_fresh(d, fd);
+        if (hit) size_apply(pool, worker, t, d);
+        pthread_rwlock_unlock(&dir_cache_lock);
+        if (hit) {
+            close(fd);
+        } else if ((d = size_scan(fd, &st)) != NULL) {
+            size_apply(pool, worker, t, d);
+            if (job->nfresh[worker] == job->fresh_cap[worker]) {
+                int cap = job->fresh_cap[worker] ? job->fresh_cap[worker] * 2 : 64;
+                DirSummary **grown = realloc(job->fresh[worker], cap * sizeof(DirSummary *));
+                if (grown) { job->fresh[worker] = grown; job->fresh_cap[worker] = cap; }
+            }
+            if (job->nfresh[worker] < job->fresh_cap[worker]) job->fresh[worker][job->nfresh[worker]++] = d;
+            else free_summary(d);
+        }
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    atomic_fetch_sub(&t->root->pending, 1);
+    free(t);
+}
+
+void size_cancel(Panel *p) {
+    SizeJob *job = p->sizing;
+    if (!job) return;
+    pool_join(&job->pool, 1);
+    pthread_rwlock_wrlock(&dir_cache_lock);
+    for (int w = 0; w < MAX_WORKERS; w++) {
+        for (int i = 0; i < job->nfresh[w]; i++) {
+            DirSummary *d = job->fresh[w][i], **slot = dir_cache_slot(d->dev, d->ino);
+            if (*slot) free_summary(*slot);
+            else dir_cache_count++;
+            *slot = d;
+        }
+        free(job->fresh[w]);
+    }
+    pthread_rwlock_unlock(&dir_cache_lock);
+    for (int i = 0; i < job->nroots; i++) free(job->roots[i].name);
+    free(job->roots);
+    free(job->seen.slots);
+    pthread_mutex_destroy(&job->seen.lock);
+    free(job);
+    p->sizing = NULL;
+}
+
+// Measures the marked directories, or the selected one, or with all set every
+// directory in the panel. Totals appear in the panel as they grow.
+void size_start(Panel *p, int all) {
+    size_cancel(p);
+    Entry *sel = cur_entry(p);
+    int n = 0;
+    for (int i = 0; i < p->count; i++) {
+        Entry *e = &p->entries[i];
+        if (e->type != TYPE_FOLDER || !strcmp(e->name, "..")) continue;
+        if (all || (p->marked ? e->marked : e == sel)) n++;
+    }
+    if (!n) return;
+    SizeJob *job = calloc(1, sizeof(SizeJob));
+    job->roots = calloc(n, sizeof(SizeRoot));
+    pthread_mutex_init(&job->seen.lock, NULL);
+    pool_init(&job->pool, size_task, job);
+    for (int i = 0; i < p->count; i++) {
+        Entry *e = &p->entries[i];
+        if (e->type != TYPE_FOLDER || !strcmp(e->name, "..")) continue;
+        if (!(all || (p->marked ? e->marked : e == sel))) continue;
+        SizeRoot *root = &job->roots[job->nroots++];
+        root->name = strdup(e->name);
+        root->entry = i;
+        atomic_init(&root->bytes, 0);
+        atomic_init(&root->pending, 0);
+        e->size = 0;
+        e->sizing = 1;
+        size_push(&job->pool, -1, root, p->cwd, e->name);
+    }
+    p->sizing = job;
+    pool_run(&job->pool);
+}
+
+// Copies the running totals into the panel; returns 1 while the job runs.
+int size_update(Panel *p) {
+    SizeJob *job = p->sizing;
+    if (!job) return 0;
+    int running = 0;
+    for (int i = 0; i < job->nroots; i++) {
+        SizeRoot *root = &job->roots[i];
+        long pending = atomic_load(&root->pending);
+        Entry *e = root->entry < p->count ? &p->entries[root->entry] : NULL;
+        if (!e || strcmp(e->name, root->name)) {
+            e = NULL;
+            for (int j = 0; j < p->count; j++)
+                if (!strcmp(p->entries[j].name, root->name)) { e = &p->entries[j]; root->entry = j; break; }
+        }
+        if (e) {
+            e->size = atomic_load(&root->bytes);
+            e->sizing = pending > 0;
+        }
+        if (pending) running = 1;
+    }
+    if (!running) size_cancel(p);
+    return running;
+}
+
+void format_size(long long n, char *buf, size_t len) {
+    const char *units = "BKMGTPE";
+    if (n < 1024) { snprintf(buf, len, "%lld", n); return; }
+    double v = n;
+    int u = 0;
+    while (v >= 1024 && u < 6) { v /= 1024; u++; }
+    snprintf(buf, len, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+// Records a match; name is the relative path and base its last component.
+void find_add(FindJob *job, const char *name, int len, int dir, int score) {
+    pthread_mutex_lock(&job->lock);
+    if (job->nfound == job->cap) {
+        size_t cap = job->cap ? job->cap * 2 : 1024;
+        Found *found = realloc(job->found, cap * sizeof(Found));
+        if (found) { job->found = found; job->cap = cap; }
+    }
+    char *path = job->nfound < job->cap ? arena_strndup(&job->strings, name, len) : NULL;
+    if (path) job->found[job->nfound++] = (Found){path, len, dir, score};
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Reads one directory with getdents64, so names and d_type come in large
+// batches without a stat per entry; only DT_UNKNOWN costs an fstatat.
+void find_task(Pool *pool, int worker, void *arg) {
+    char *rel = arg;
+    FindJob *job = pool->ctx;
+    char path[PATH_MAX_LEN];
+    int sep = rel[0] && job->root[strlen(job->root) - 1] != '/';
+    snprintf(path, sizeof(path), "%s%s%s", job->root, sep ? "/" : "", rel);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) { free(rel); return; }
+    atomic_fetch_add(&job->dirs, 1);
+    char buf[32768];
+    char name[PATH_MAX_LEN];
+    int rlen = strlen(rel);
+    ssize_t n;
+    while ((n = getdents64(fd, buf, sizeof(buf))) > 0 && !atomic_load(&pool->cancel)) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *base = de->d_name;
+            if (base[0] == '.' && (!base[1] || (base[1] == '.' && !base[2]))) continue;
+            int type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, base, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            int blen = strlen(base);
+            int len = snprintf(name, sizeof(name), "%s%s%s", rel, rlen ? "/" : "", base);
+            if (len >= (int)sizeof(name)) continue;
+            int score = 0;
+            int hit = job->fuzzy ? (score = fuzzy_score(base, blen, job->query, job->qlen)) != NO_MATCH
+                                 : pattern_match(&job->pat, worker, base, blen);
+            if (hit) find_add(job, name, len, type == DT_DIR, score);
+            if (type == DT_DIR) {
+                char *sub = strdup(name);
+                if (sub) pool_push(pool, worker, sub);
+            }
+        }
+    }
+    close(fd);
+    free(rel);
+}
+
+int encode_varint(unsigned char *buf, uint64_t v) {
+    int n = 0;
+    do { buf[n] = v & 0x7f; v >>= 7; if (v) buf[n] |= 0x80; n++; } while (v);
+    return n;
+}
+
+int put_varint(FILE *f, uint64_t v) {
+    unsigned char buf[10];
+    int n = encode_varint(buf, v);
+    return fwrite(buf, 1, n, f) == (size_t)n ? 0 : -1;
+}
+
+const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+// The kind ("names" or "content") of index of root lives under
+// $XDG_CACHE_HOME (or ~/.cache), named by a hash of the root path.
+int index_file(const char *root, const char *kind, char *out, size_t size) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX_LEN];
+    if (cache && cache[0]) snprintf(dir, sizeof(dir), "%s/mycommander", cache);
+    else if (home && home[0]) snprintf(dir, sizeof(dir), "%s/.cache/mycommander", home);
+    else return -1;
+    snprintf(out, size, "%s/%s-%016llx.idx", dir, kind, (unsigned long long)name_hash(root, strlen(root)));
+    return 0;
+}
+
+// Creates the directory an index file goes in, and the one above it.
+void index_dir_create(const char *file) {
+    char dir[PATH_MAX_LEN];
+    snprintf(dir, sizeof(dir), "%s", file);
+    *strrchr(dir, '/') = '\0';
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+    mkdir(dir, 0700);
+}
+
+// Whole-second mtimes would miss changes made in the second an index was
+// built.
+int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+uint32_t trigram(const char *s) {
+    return (uint32_t)tolower((unsigned char)s[0]) << 16 | tolower((unsigned char)s[1]) << 8 | tolower((unsigned char)s[2]);
+}
+
+const char *base_name(const char *path, int len) {
+    const char *slash = memrchr(path, '/', len);
+    return slash ? slash + 1 : path;
+}
+
+int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Collects the distinct trigrams of the base names in paths[from, to).
+int block_trigrams(IdxPath *paths, size_t from, size_t to, uint32_t **buf, size_t *cap) {
+    size_t n = 0;
+    for (size_t i = from; i < to; i++) {
+        const char *base = base_name(paths[i].path, paths[i].len);
+        int blen = paths[i].path + paths[i].len - base;
+        if (n + blen > *cap) {
+            size_t grown_cap = (n + blen) * 2;
+            uint32_t *grown = realloc(*buf, grown_cap * sizeof(uint32_t));
+            if (!grown) return -1;
+            *buf = grown; *cap = grown_cap;
+        }
+        for (int k = 0; k + 3 <= blen; k++) (*buf)[n++] = trigram(base + k);
+    }
+    qsort(*buf, n, sizeof(uint32_t), compare_u32);
+    size_t u = 0;
+    for (size_t i = 0; i < n; i++)
+        if (!u || (*buf)[u-1] != (*buf)[i]) (*buf)[u++] = (*buf)[i];
+    return u;
+}
+
+int compare_idx_paths(const void *a, const void *b) {
+    return strcmp(((const IdxPath *)a)->path, ((const IdxPath *)b)->path);
+}
+
+// Adds a path to what the worker has found.
+void idx_collect(IndexBuild *b, int worker, const char *rel, int len, int dir, int64_t mtime) {
+    if (b->nfound[worker] == b->found_cap[worker]) {
+        size_t cap = b->found_cap[worker] ? b->found_cap[worker] * 2 : 4096;
+        IdxPath *grown = realloc(b->found[worker], cap * sizeof(IdxPath));
+        if (!grown) { atomic_store(&b->lost, 1); return; }
+        b->found[worker] = grown; b->found_cap[worker] = cap;
+    }
+    char *path = arena_strndup(&b->found_strings[worker], rel, len);
+    if (path) b->found[worker][b->nfound[worker]++] = (IdxPath){path, len, dir, mtime};
+    else atomic_store(&b->lost, 1);
+}
+
+// Moves what the workers found into paths, once the walk has ended.
+int idx_merge(IndexBuild *b) {
+    size_t n = 0;
+    for (int w = 0; w < MAX_WORKERS; w++) n += b->nfound[w];
+    b->paths = malloc((n ? n : 1) * sizeof(IdxPath));
+    for (int w = 0; w < MAX_WORKERS; w++) {
+        if (b->paths) memcpy(b->paths + b->npaths, b->found[w], b->nfound[w] * sizeof(IdxPath));
+        if (b->paths) b->npaths += b->nfound[w];
+        free(b->found[w]);
+        b->found[w] = NULL;
+        b->nfound[w] = b->found_cap[w] = 0;
+        ArenaBlock *tail = b->found_strings[w].head;
+        if (!tail) continue;
+        while (tail->next) tail = tail->next;
+        tail->next = b->strings.head;
+        b->strings.head = b->found_strings[w].head;
+        b->found_strings[w].head = NULL;
+    }
+    return b->paths && !atomic_load(&b->lost) ? 0 : -1;
+}
+
+void index_task(Pool *pool, int worker, void *arg) {
+    char *rel = arg;
+    IndexBuild *b = pool->ctx;
+    char path[PATH_MAX_LEN];
+    int sep = rel[0] && b->root[strlen(b->root) - 1] != '/';
+    snprintf(path, sizeof(path), "%s%s%s", b->root, sep ? "/" : "", rel);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { if (fd >= 0) close(fd); free(rel); return; }
+    atomic_fetch_add(&b->dirs, 1);
+    if (!rel[0]) b->root_mtime = mtime_ns(&st);
+    else idx_collect(b, worker, rel, strlen(rel), 1, mtime_ns(&st));
+    // Other file systems (/proc, mounts) are listed but not entered.
+    int descend = st.st_dev == b->dev;
+    char buf[32768];
+    char name[PATH_MAX_LEN];
+    int rlen = strlen(rel);
+    ssize_t n;
+    while (descend && (n = getdents64(fd, buf, sizeof(buf))) > 0 && !atomic_load(&pool->cancel)) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *base = de->d_name;
+            if (base[0] == '.' && (!base[1] || (base[1] == '.' && !base[2]))) continue;
+            int type = de->d_type;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(fd, base, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            int len = snprintf(name, sizeof(name), "%s%s%s", rel, rlen ? "/" : "", base);
+            if (len >= (int)sizeof(name)) continue;
+            char *sub;
+            if (type != DT_DIR) idx_collect(b, worker, name, len, 0, 0);
+            else if ((sub = strdup(name)) != NULL) pool_push(pool, worker, sub);
+            else atomic_store(&b->lost, 1);
+        }
+    }
+    close(fd);
+    free(rel);
+}
+
+// Writes the sorted paths front-coded in blocks of IDX_BLOCK, then the
+// block offsets, then for every trigram of a base name the blocks holding
+// it. The file is written aside and renamed over the old index.
+int index_write(IndexBuild *b) {
+    qsort(b->paths, b->npaths, sizeof(IdxPath), compare_idx_paths);
+    char tmp[PATH_MAX_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", b->file);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    IdxHeader hdr = {0};
+    memcpy(hdr.magic, IDX_MAGIC, sizeof(hdr.magic));
+    hdr.count = b->npaths;
+    hdr.nblocks = (b->npaths + IDX_BLOCK - 1) / IDX_BLOCK;
+    hdr.ndirs = atomic_load(&b->dirs);
+    hdr.built = time(NULL);
+    hdr.root_mtime = b->root_mtime;
+    snprintf(hdr.root, sizeof(hdr.root), "%s", b->root);
+    uint64_t *blocks = malloc((hdr.nblocks + 1) * sizeof(uint64_t));
+    uint32_t *starts = calloc(IDX_TRIGRAMS + 1, sizeof(uint32_t));
+    uint32_t *tris = NULL;
+    size_t tris_cap = 0;
+    int ok = blocks && starts && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    const char *prev = "";
+    for (size_t i = 0; ok && i < b->npaths; i++) {
+        IdxPath *p = &b->paths[i];
+        if (i % IDX_BLOCK == 0) { blocks[i / IDX_BLOCK] = ftell(f); prev = ""; }
+        int shared = 0;
+        while (prev[shared] && prev[shared] == p->path[shared]) shared++;
+        ok = fputc(p->dir, f) != EOF && put_varint(f, shared) == 0 && put_varint(f, p->len - shared) == 0 &&
+             fwrite(p->path + shared, 1, p->len - shared, f) == (size_t)(p->len - shared) &&
+             (!p->dir || put_varint(f, p->mtime) == 0);
+        prev = p->path;
+    }
+    if (ok) {
+        blocks[hdr.nblocks] = ftell(f);
+        hdr.blocks = ftell(f);
+        ok = fwrite(blocks, sizeof(uint64_t), hdr.nblocks + 1, f) == hdr.nblocks + 1;
+    }
+    // Two passes over the blocks: count the postings per trigram, then
+    // place each block id at its trigram's cursor.
+    for (uint64_t k = 0; ok && k < hdr.nblocks; k++) {
+        int n = block_trigrams(b->paths, k * IDX_BLOCK, k * IDX_BLOCK + IDX_BLOCK < b->npaths ? k * IDX_BLOCK + IDX_BLOCK : b->npaths, &tris, &tris_cap);
+        if (n < 0) ok = 0;
+        for (int t = 0; t < n; t++) starts[tris[t] + 1]++;
+    }
+    uint32_t *postings = NULL;
+    if (ok) {
+        for (uint32_t t = 0; t < IDX_TRIGRAMS; t++) {
+            if (starts[t + 1]) hdr.ntris++;
+            starts[t + 1] += starts[t];
+        }
+        hdr.tris = ftell(f);
+        for (uint32_t t = 0; ok && t < IDX_TRIGRAMS; t++) {
+            if (starts[t + 1] == starts[t]) continue;
+            IdxTri tri = {t, starts[t + 1] - starts[t], starts[t]};
+            ok = fwrite(&tri, sizeof(tri), 1, f) == 1;
+        }
+        ok = ok && (postings = malloc((starts[IDX_TRIGRAMS] + 1) * sizeof(uint32_t)));
+    }
+    for (uint64_t k = 0; ok && k < hdr.nblocks; k++) {
+        int n = block_trigrams(b->paths, k * IDX_BLOCK, k * IDX_BLOCK + IDX_BLOCK < b->npaths ? k * IDX_BLOCK + IDX_BLOCK : b->npaths, &tris, &tris_cap);
+        for (int t = 0; t < n; t++) postings[starts[tris[t]]++] = k;
+    }
+    if (ok) {
+        hdr.postings = ftell(f);
+        size_t total = starts[IDX_TRIGRAMS];
+        ok = fwrite(postings, sizeof(uint32_t), total, f) == total;
+    }
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    free(blocks); free(starts); free(tris); free(postings);
+    if (ok && rename(tmp, b->file) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
+
+unsigned char fold_byte(unsigned char c) {
+    return c - 'A' < 26u ? c + 32 : c;
+}
+
+// Reads a run of CIDX_CHUNK paths and keeps every file's distinct trigrams,
+// sorted and varint-delta coded. Files grep skips as binaries (a NUL in the
+// first 4 KB) keep an empty list. One truncated while it is read keeps the
+// size it had before, so the index sees it as changed when next opened.
+void content_task(Pool *pool, int worker, void *arg) {
+    IndexBuild *b = pool->ctx;
+    size_t from = *(size_t *)arg, to = from + CIDX_CHUNK < b->npaths ? from + CIDX_CHUNK : b->npaths;
+    free(arg);
+    if (!b->seen[worker] && !(b->seen[worker] = calloc(IDX_TRIGRAMS / 64, sizeof(uint64_t)))) { atomic_store(&b->lost, 1); return; }
+    uint64_t *seen = b->seen[worker];
+    uint32_t *tris = NULL;
+    size_t cap = 0;
+    char path[PATH_MAX_LEN], head[4096];
+    int sep = b->root[strlen(b->root) - 1] != '/';
+    for (size_t i = from; i < to && !atomic_load(&pool->cancel); i++) {
+        IdxPath *p = &b->paths[i];
+        if (p->dir) continue;
+        snprintf(path, sizeof(path), "%s%s%s", b->root, sep ? "/" : "", p->path);
+        int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            else if (lstat(path, &st) == 0) { p->mtime = mtime_ns(&st); p->size = st.st_size; }
+            continue;
+        }
+        p->mtime = mtime_ns(&st);
+        p->size = st.st_size;
+        ssize_t n;
+        if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+            (n = pread(fd, head, sizeof(head), 0)) <= 0 || memchr(head, 0, n)) {
+            close(fd);
+            continue;
+        }
+        const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { atomic_store(&b->lost, 1); continue; }
+        map_guard(map, st.st_size);
+        madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+        atomic_fetch_add(&b->read, 1);
+        size_t count = 0;
+        uint32_t t = 0;
+        int whole = 1;
+        for (size_t k = 0; k < (size_t)st.st_size; k++) {
+            t = (t << 8 | fold_byte(map[k])) & (IDX_TRIGRAMS - 1);
+            if (k < 2 || seen[t >> 6] & 1ULL << (t & 63)) continue;
+            if (count == cap) {
+                size_t grown_cap = cap ? cap * 2 : 4096;
+                uint32_t *grown = realloc(tris, grown_cap * sizeof(uint32_t));
+                if (!grown) { whole = 0; break; }
+                tris = grown; cap = grown_cap;
+            }
+            seen[t >> 6] |= 1ULL << (t & 63);
+            tris[count++] = t;
+        }
+        map_unguard(map);
+        munmap((void *)map, st.st_size);
+        qsort(tris, count, sizeof(uint32_t), compare_u32);
+        // A list short of any trigram would hide the file from searches
+        // that match it: without the whole list the build fails.
+        unsigned char *list = whole ? malloc(count * 4 + 1) : NULL;
+        uint32_t len = 0, prev = 0;
+        for (size_t j = 0; j < count; j++) {
+            seen[tris[j] >> 6] = 0;
+            if (list) len += encode_varint(list + len, tris[j] - prev);
+            prev = tris[j];
+        }
+        if (!list) { atomic_store(&b->lost, 1); continue; }
+        unsigned char *shrunk = list ? realloc(list, len + 1) : NULL;
+        b->lists[i] = shrunk ? shrunk : list;
+        b->list_lens[i] = len;
+    }
+    free(tris);
+}
+
+// Sorts the walked paths, which fixes the file ids, then reads the files
+// in parallel.
+int content_read(IndexBuild *b) {
+    qsort(b->paths, b->npaths, sizeof(IdxPath), compare_idx_paths);
+    b->lists = calloc(b->npaths + 1, sizeof(uint8_t *));
+    b->list_lens = calloc(b->npaths + 1, sizeof(uint32_t));
+    if (!b->lists || !b->list_lens) return -1;
+    atomic_store(&b->reading, 1);
+    pool_init(&b->pool, content_task, b);
+    for (size_t i = 0; i < b->npaths; i += CIDX_CHUNK) {
+        size_t *from = malloc(sizeof(size_t));
+        if (!from) { atomic_store(&b->lost, 1); continue; }
+        *from = i;
+        pool_push(&b->pool, -1, from);
+    }
+    pool_run(&b->pool);
+    pool_join(&b->pool, 0);
+    for (int w = 0; w < MAX_WORKERS; w++) free(b->seen[w]);
+    return atomic_load(&b->lost) ? -1 : 0;
+}
+
+// Turns the per-file trigram lists into per-trigram file lists in two
+// passes: size every trigram's postings, then encode each at its cursor.
+int content_write(IndexBuild *b) {
+    char tmp[PATH_MAX_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", b->file);
+    uint32_t *dense = calloc(IDX_TRIGRAMS, sizeof(uint32_t));
+    CidxSlot *slots = NULL;
+    IdxTri *tris = NULL;
+    unsigned char *postings = NULL, buf[10];
+    size_t nslots = 0, slots_cap = 0, names_size = 0;
+    int ok = dense != NULL;
+    for (size_t i = 0; ok && i < b->npaths; i++) {
+        names_size += b->paths[i].len + 1;
+        const unsigned char *p = b->lists[i], *end = p + b->list_lens[i];
+        uint64_t t = 0, delta;
+        while (p && p < end && (p = get_varint(p, end, &delta))) {
+            t += delta;
+            if (!dense[t]) {
+                if (nslots == slots_cap) {
+                    slots_cap = slots_cap ? slots_cap * 2 : 65536;
+                    CidxSlot *grown = realloc(slots, slots_cap * sizeof(CidxSlot));
+                    if (!grown) { ok = 0; break; }
+                    slots = grown;
+                }
+                slots[nslots++] = (CidxSlot){0, 0, 0};
+                dense[t] = nslots;
+            }
+            CidxSlot *s = &slots[dense[t] - 1];
+            s->at += encode_varint(buf, i - s->last);
+            s->last = i;
+            s->count++;
+        }
+    }
+    CidxHeader hdr = {0};
+    memcpy(hdr.magic, CIDX_MAGIC, sizeof(hdr.magic));
+    hdr.count = b->npaths;
+    hdr.built = time(NULL);
+    hdr.root_mtime = b->root_mtime;
+    snprintf(hdr.root, sizeof(hdr.root), "%s", b->root);
+    hdr.entries = sizeof(hdr);
+    hdr.names = hdr.entries + b->npaths * sizeof(CidxEntry);
+    hdr.tris = (hdr.names + names_size + 7) & ~7ULL;
+    hdr.ntris = nslots;
+    hdr.postings = hdr.tris + nslots * sizeof(IdxTri);
+    uint64_t total = 0;
+    if (ok && (tris = malloc((nslots + 1) * sizeof(IdxTri))) != NULL) {
+        size_t k = 0;
+        for (uint32_t t = 0; t < IDX_TRIGRAMS; t++) {
+            if (!dense[t]) continue;
+            CidxSlot *s = &slots[dense[t] - 1];
+            tris[k++] = (IdxTri){t, s->count, total};
+            total += s->at;
+            s->at = tris[k - 1].start;
+            s->last = 0;
+        }
+    }
+    ok = ok && tris && (postings = malloc(total + 1));
+    for (size_t i = 0; ok && i < b->npaths; i++) {
+        const unsigned char *p = b->lists[i], *end = p + b->list_lens[i];
+        uint64_t t = 0, delta;
+        while (p && p < end && (p = get_varint(p, end, &delta))) {
+            t += delta;
+            CidxSlot *s = &slots[dense[t] - 1];
+            s->at += encode_varint(postings + s->at, i - s->last);
+            s->last = i;
+        }
+    }
+    FILE *f = ok ? fopen(tmp, "wb") : NULL;
+    ok = f && fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    uint64_t name = 0;
+    for (size_t i = 0; ok && i < b->npaths; i++) {
+        IdxPath *p = &b->paths[i];
+        CidxEntry e = {name, p->mtime, p->dir ? -1 : p->size};
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+        name += p->len + 1;
+    }
+    for (size_t i = 0; ok && i < b->npaths; i++)
+        ok = fwrite(b->paths[i].path, 1, b->paths[i].len + 1, f) == (size_t)b->paths[i].len + 1;
+    for (uint64_t pad = hdr.tris - hdr.names - names_size; ok && pad; pad--) ok = fputc(0, f) != EOF;
+    ok = ok && fwrite(tris, sizeof(IdxTri), nslots, f) == nslots && fwrite(postings, 1, total, f) == total;
+    if (f) ok = (fclose(f) == 0) && ok;
+    free(dense); free(slots); free(tris); free(postings);
+    if (ok && rename(tmp, b->file) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
+
+// Builds the index of b->root on its own thread: a parallel walk, then
+// sorting and writing, so the UI never waits for either.
+void *index_builder(void *arg) {
+    IndexBuild *b = arg;
+    struct stat st;
+    char *rel = strdup("");
+    if (rel && stat(b->root, &st) == 0) {
+        b->dev = st.st_dev;
+        pool_init(&b->pool, index_task, b);
+        pool_push(&b->pool, -1, rel);
+        pool_run(&b->pool);
+        pool_join(&b->pool, 0);
+        index_dir_create(b->file);
+        if (idx_merge(b) != 0) b->failed = 1;
+        else if (b->content) b->failed = content_read(b) != 0 || content_write(b) != 0;
+        else b->failed = index_write(b) != 0;
+    } else {
+        free(rel);
+        b->failed = 1;
+    }
+    atomic_store(&b->done, 1);
+    return NULL;
+}
+
+IndexBuild *index_build;
+NameIndex *name_index;
+ContentIndex *content_index;
+
+int index_build_start(const char *root, int content) {
+    if (index_build) return -1;
+    IndexBuild *b = calloc(1, sizeof(IndexBuild));
+    if (!b) return -1;
+    snprintf(b->root, sizeof(b->root), "%s", root);
+    b->content = content;
+    if (index_file(root, content ? "content" : "names", b->file, sizeof(b->file)) != 0) { free(b); return -1; }
+    if (pthread_create(&b->thread, NULL, index_builder, b) != 0) {
+        free(b);
+        return -1;
+    }
+    index_build = b;
+    return 0;
+}
+
+// Decodes one record after prev (the previous path of the block, in rel).
+const unsigned char *index_record(const unsigned char *p, const unsigned char *end, char *rel, int *len, int *dir, uint64_t *mtime) {
+    uint64_t shared, rest;
+    if (p >= end) return NULL;
+    *dir = *p++;
+    if (!(p = get_varint(p, end, &shared)) || !(p = get_varint(p, end, &rest))) return NULL;
+    if (shared > (uint64_t)*len || shared + rest >= PATH_MAX_LEN || rest > (uint64_t)(end - p)) return NULL;
+    memcpy(rel + shared, p, rest);
+    p += rest;
+    *len = shared + rest;
+    rel[*len] = '\0';
+    if (*dir && !(p = get_varint(p, end, mtime))) return NULL;
+    return p;
+}
+
+// Returns the last block whose first path sorts at or before key.
+uint64_t index_seek(NameIndex *ix, const char *key) {
+    uint64_t lo = 0, hi = ix->hdr->nblocks;
+    char rel[PATH_MAX_LEN];
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        int len = 0, dir;
+        uint64_t mtime;
+        const unsigned char *p = (const unsigned char *)ix->map + ix->blocks[mid];
+        if (!index_record(p, (const unsigned char *)ix->map + ix->blocks[mid + 1], rel, &len, &dir, &mtime)) break;
+        if (strcmp(rel, key) <= 0) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int watches_init(Watches *w) {
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return -1;
+    pthread_mutex_init(&w->lock, NULL);
+    return 0;
+}
+
+// Watches path, known as rel in events; returns the descriptor or -1.
+int watches_add(Watches *w, const char *path, const char *rel, uint32_t mask) {
+    int wd = inotify_add_watch(w->fd, path, mask);
+    if (wd < 0) return -1;
+    pthread_mutex_lock(&w->lock);
+    if (wd >= w->cap) {
+        int cap = wd * 2 + 64;
+        char **grown = realloc(w->paths, cap * sizeof(char *));
+        if (grown) {
+            memset(grown + w->cap, 0, (cap - w->cap) * sizeof(char *));
+            w->paths = grown; w->cap = cap;
+        }
+    }
+    if (wd < w->cap) {
+        free(w->paths[wd]);
+        w->paths[wd] = strdup(rel);
+        atomic_fetch_add(&w->count, 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return wd;
+}
+
+// Hands every queued event on a named entry to fn with its relative path.
+void watches_read(Watches *w, WatchFn fn, void *ctx) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (!ev->len) continue;
+            char rel[PATH_MAX_LEN];
+            pthread_mutex_lock(&w->lock);
+            const char *dir = ev->wd < w->cap ? w->paths[ev->wd] : NULL;
+            if (dir) snprintf(rel, sizeof(rel), "%s%s%s", dir, dir[0] ? "/" : "", ev->name);
+            pthread_mutex_unlock(&w->lock);
+            if (dir) fn(ctx, rel, ev->mask);
+        }
+    }
+}
+
+void watches_free(Watches *w) {
+    close(w->fd);
+    for (int i = 0; i < w->cap; i++) free(w->paths[i]);
+    free(w->paths);
+    pthread_mutex_destroy(&w->lock);
+}
+
+// Checks every indexed directory's mtime against the disk and puts an
+// inotify watch on it, so later changes are seen as they happen.
+void *index_checker(void *arg) {
+    NameIndex *ix = arg;
+    char path[PATH_MAX_LEN], rel[PATH_MAX_LEN];
+    struct stat st;
+    int watching = 1;
+    watches_add(&ix->watches, ix->root, "", IDX_EVENTS);
+    if (stat(ix->root, &st) == 0 && mtime_ns(&st) != ix->hdr->root_mtime) atomic_fetch_add(&ix->stale, 1);
+    for (uint64_t k = 0; k < ix->hdr->nblocks && !atomic_load(&ix->stop); k++) {
+        const unsigned char *p = (const unsigned char *)ix->map + ix->blocks[k];
+        const unsigned char *end = (const unsigned char *)ix->map + ix->blocks[k + 1];
+        int len = 0;
+        while (p && p < end) {
+            int dir;
+            uint64_t mtime = 0;
+            if (!(p = index_record(p, end, rel, &len, &dir, &mtime))) break;
+            if (!dir) continue;
+            snprintf(path, sizeof(path), "%s%s%s", ix->root, ix->sep, rel);
+            if (stat(path, &st) != 0 || (uint64_t)mtime_ns(&st) != mtime) atomic_fetch_add(&ix->stale, 1);
+            atomic_fetch_add(&ix->checked, 1);
+            if (watching && watches_add(&ix->watches, path, rel, IDX_EVENTS) < 0) watching = 0;
+            if (atomic_load(&ix->watches.count) >= IDX_WATCHES) watching = 0;
+        }
+    }
+    return NULL;
+}
+
+void changes_free(IdxChange *c, int n) {
+    for (int i = 0; i < n; i++) free(c[i].rel);
+    free(c);
+}
+
+void index_close(NameIndex *ix) {
+    if (!ix) return;
+    atomic_store(&ix->stop, 1);
+    pthread_join(ix->checker, NULL);
+    if (ix->walking) pool_join(&ix->walk, 1);
+    watches_free(&ix->watches);
+    munmap((void *)ix->map, ix->size);
+    changes_free(ix->added, ix->nadded);
+    changes_free(ix->removed, ix->nremoved);
+    changes_free(ix->batch, ix->nbatch);
+    changes_free(ix->queued, ix->nqueued);
+    changes_free(ix->found, ix->nfound);
+    pthread_mutex_destroy(&ix->lock);
+    free(ix);
+}
+
+NameIndex *index_open(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(IdxHeader)) { close(fd); return NULL; }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    const IdxHeader *hdr = (const IdxHeader *)map;
+    size_t size = st.st_size;
+    if (memcmp(hdr->magic, IDX_MAGIC, sizeof(hdr->magic)) || hdr->blocks > size ||
+        hdr->nblocks >= (size - hdr->blocks) / sizeof(uint64_t) || hdr->tris > size ||
+        (size - hdr->tris) / sizeof(IdxTri) < hdr->ntris || hdr->postings > size ||
+        !hdr->root[0] || !memchr(hdr->root, 0, sizeof(hdr->root))) {
+        munmap((void *)map, size);
+        return NULL;
+    }
+    const uint64_t *blocks = (const uint64_t *)(map + hdr->blocks);
+    for (uint64_t k = 0; k <= hdr->nblocks; k++) {
+        if (blocks[k] > hdr->blocks || (k && blocks[k] < blocks[k - 1])) {
+            munmap((void *)map, size);
+            return NULL;
+        }
+    }
+    NameIndex *ix = calloc(1, sizeof(NameIndex));
+    if (!ix || watches_init(&ix->watches) != 0) { free(ix); munmap((void *)map, size); return NULL; }
+    ix->map = map;
+    ix->size = size;
+    ix->hdr = hdr;
+    ix->blocks = blocks;
+    ix->tris = (const IdxTri *)(map + hdr->tris);
+    ix->postings = (const uint32_t *)(map + hdr->postings);
+    ix->npostings = (size - hdr->postings) / sizeof(uint32_t);
+    snprintf(ix->root, sizeof(ix->root), "%s", hdr->root);
+    ix->sep = ix->root[strlen(ix->root) - 1] == '/' ? "" : "/";
+    pthread_mutex_init(&ix->lock, NULL);
+    if (pthread_create(&ix->checker, NULL, index_checker, ix) != 0) {
+        watches_free(&ix->watches);
+        munmap((void *)map, size);
+        pthread_mutex_destroy(&ix->lock);
+        free(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+// Returns dir relative to root, or NULL when dir is not under root.
+const char *index_covers(const char *root, const char *dir) {
+    size_t rlen = strlen(root);
+    if (strncmp(dir, root, rlen)) return NULL;
+    if (root[rlen - 1] == '/' || !dir[rlen]) return dir + rlen;
+    return dir[rlen] == '/' ? dir + rlen + 1 : NULL;
+}
+
+// Finds the file of the nearest index of the kind at or above dir.
+int index_lookup(const char *dir, const char *kind, char *file, size_t size) {
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s", dir);
+    while (1) {
+        if (index_file(path, kind, file, size) == 0 && access(file, R_OK) == 0) return 0;
+        char *slash = strrchr(path, '/');
+        if (!slash || !strcmp(path, "/")) return -1;
+        if (slash == path) slash[1] = '\0';
+        else *slash = '\0';
+    }
+}
+
+// Returns the index covering dir, loading the nearest one on disk if the
+// loaded index does not.
+NameIndex *index_for(const char *dir) {
+    if (name_index && index_covers(name_index->root, dir)) return name_index;
+    char file[PATH_MAX_LEN];
+    NameIndex *ix;
+    if (index_lookup(dir, "names", file, sizeof(file)) != 0 || !(ix = index_open(file))) return NULL;
+    index_close(name_index);
+    return name_index = ix;
+}
+
+// Returns the entry id of rel, or -1 when the index does not have it.
+long content_lookup(ContentIndex *ix, const char *rel) {
+    uint64_t lo = 0, hi = ix->hdr->count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        int c = strcmp(ix->names + ix->entries[mid].name, rel);
+        if (!c) return mid;
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return -1;
+}
+
+// The first entry sorting at or after key.
+uint64_t content_seek(ContentIndex *ix, const char *key) {
+    uint64_t lo = 0, hi = ix->hdr->count;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (strcmp(ix->names + ix->entries[mid].name, key) < 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+void content_dirty(ContentIndex *ix, const char *rel) {
+    pthread_mutex_lock(&ix->lock);
+    int lo = 0, hi = ix->ndirty;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(ix->dirty[mid], rel);
+        if (!c) { lo = -1; break; }
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    if (lo >= 0 && ix->ndirty == ix->dirty_cap) {
+        int cap = ix->dirty_cap ? ix->dirty_cap * 2 : 64;
+        char **grown = realloc(ix->dirty, cap * sizeof(char *));
+        if (grown) { ix->dirty = grown; ix->dirty_cap = cap; }
+    }
+    char *copy = lo >= 0 && ix->ndirty < ix->dirty_cap ? strdup(rel) : NULL;
+    if (copy) {
+        memmove(ix->dirty + lo + 1, ix->dirty + lo, (ix->ndirty - lo) * sizeof(char *));
+        ix->dirty[lo] = copy;
+        ix->ndirty++;
+    }
+    pthread_mutex_unlock(&ix->lock);
+}
+
+// Marks the files of directory rel that the index lacks (all of them when
+// the directory itself is new) and watches new subdirectories.
+void content_scan(ContentIndex *ix, const char *rel, int fresh) {
+    char path[PATH_MAX_LEN], sub[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s%s%s", ix->root, rel[0] ? ix->sep : "", rel);
+    DIR *d = opendir(path);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2]))) continue;
+        snprintf(sub, sizeof(sub), "%s%s%s", rel, rel[0] ? "/" : "", e->d_name);
+        if (!fresh && content_lookup(ix, sub) >= 0) continue;
+        if (e->d_type == DT_DIR) {
+            snprintf(path, sizeof(path), "%s%s%s", ix->root, ix->sep, sub);
+            if (atomic_load(&ix->watches.count) < IDX_WATCHES) watches_add(&ix->watches, path, sub, CIDX_EVENTS);
+            content_scan(ix, sub, 1);
+        } else {
+            content_dirty(ix, sub);
+        }
+    }
+    closedir(d);
+}
+
+// Compares every indexed file's mtime and size with the disk, lists the
+// directories whose mtime moved, and watches them all for what comes next.
+void *content_checker(void *arg) {
+    ContentIndex *ix = arg;
+    char path[PATH_MAX_LEN];
+    struct stat st;
+    watches_add(&ix->watches, ix->root, "", CIDX_EVENTS);
+    if (stat(ix->root, &st) == 0 && mtime_ns(&st) != ix->hdr->root_mtime) content_scan(ix, "", 0);
+    for (uint64_t i = 0; i < ix->hdr->count && !atomic_load(&ix->stop); i++) {
+        const CidxEntry *e = &ix->entries[i];
+        const char *rel = ix->names + e->name;
+        snprintf(path, sizeof(path), "%s%s%s", ix->root, ix->sep, rel);
+        int found = lstat(path, &st) == 0;
+        if (e->size < 0) {
+            if (found && atomic_load(&ix->watches.count) < IDX_WATCHES) watches_add(&ix->watches, path, rel, CIDX_EVENTS);
+            if (found && mtime_ns(&st) != e->mtime) content_scan(ix, rel, 0);
+        } else if (found && (mtime_ns(&st) != e->mtime || st.st_size != e->size)) {
+            content_dirty(ix, rel);
+        }
+        atomic_fetch_add(&ix->checked, 1);
+    }
+    return NULL;
+}
+
+void content_close(ContentIndex *ix) {
+    if (!ix) return;
+    atomic_store(&ix->stop, 1);
+    pthread_join(ix->checker, NULL);
+    watches_free(&ix->watches);
+    munmap((void *)ix->map, ix->size);
+    for (int i = 0; i < ix->ndirty; i++) free(ix->dirty[i]);
+    free(ix->dirty);
+    pthread_mutex_destroy(&ix->lock);
+    free(ix);
+}
+
+ContentIndex *content_open(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CidxHeader)) { close(fd); return NULL; }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    const CidxHeader *hdr = (const CidxHeader *)map;
+    size_t size = st.st_size;
+    int ok = !memcmp(hdr->magic, CIDX_MAGIC, sizeof(hdr->magic)) && hdr->root[0] && memchr(hdr->root, 0, sizeof(hdr->root)) &&
+             hdr->entries == sizeof(CidxHeader) && hdr->names <= size &&
+             (hdr->names - hdr->entries) / sizeof(CidxEntry) >= hdr->count &&
+             hdr->tris >= hdr->names && hdr->tris <= size && hdr->postings <= size &&
+             (hdr->postings - hdr->tris) / sizeof(IdxTri) >= hdr->ntris;
+    const CidxEntry *entries = (const CidxEntry *)(map + hdr->entries);
+    size_t names_size = ok ? hdr->tris - hdr->names : 0;
+    for (uint64_t i = 0; ok && i < hdr->count; i++) ok = entries[i].name < names_size;
+    ok = ok && (!hdr->count || map[hdr->names + names_size - 1] == '\0');
+    ContentIndex *ix = ok ? calloc(1, sizeof(ContentIndex)) : NULL;
+    if (!ix || watches_init(&ix->watches) != 0) { free(ix); munmap((void *)map, size); return NULL; }
+    ix->map = map;
+    ix->size = size;
+    ix->hdr = hdr;
+    ix->entries = entries;
+    ix->names = map + hdr->names;
+    ix->names_size = names_size;
+    ix->tris = (const IdxTri *)(map + hdr->tris);
+    ix->postings = (const unsigned char *)map + hdr->postings;
+    ix->postings_size = size - hdr->postings;
+    snprintf(ix->root, sizeof(ix->root), "%s", hdr->root);
+    ix->sep = ix->root[strlen(ix->root) - 1] == '/' ? "" : "/";
+    pthread_mutex_init(&ix->lock, NULL);
+    if (pthread_create(&ix->checker, NULL, content_checker, ix) != 0) {
+        watches_free(&ix->watches);
+        munmap((void *)map, size);
+        pthread_mutex_destroy(&ix->lock);
+        free(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+ContentIndex *content_for(const char *dir) {
+    if (content_index && index_covers(content_index->root, dir)) return content_index;
+    char file[PATH_MAX_LEN];
+    ContentIndex *ix;
+    if (index_lookup(dir, "content", file, sizeof(file)) != 0 || !(ix = content_open(file))) return NULL;
+    content_close(content_index);
+    return content_index = ix;
+}
+
+// Swaps a finished build in for the loaded index; returns 1 while one runs.
+int index_build_update(char *status, size_t size) {
+    IndexBuild *b = index_build;
+    if (!b) return 0;
+    if (!atomic_load(&b->done)) {
+        if (atomic_load(&b->reading))
+            snprintf(status, size, "Indexing contents of %s: %ld of %zu files", b->root, atomic_load(&b->read), b->npaths);
+        else
+            snprintf(status, size, "Indexing %s: %ld directories", b->root, atomic_load(&b->dirs));
+        return 1;
+    }
+    pthread_join(b->thread, NULL);
+    if (b->failed) {
+        snprintf(status, size, "Indexing %s failed", b->root);
+    } else if (b->content) {
+        snprintf(status, size, "Indexed the contents of %ld files under %s", atomic_load(&b->read), b->root);
+        content_close(content_index);
+        content_index = content_open(b->file);
+    } else {
+        snprintf(status, size, "Indexed %zu names under %s", b->npaths, b->root);
+        index_close(name_index);
+        name_index = index_open(b->file);
+    }
+    arena_reset(&b->strings);
+    for (size_t i = 0; b->lists && i < b->npaths; i++) free(b->lists[i]);
+    free(b->lists);
+    free(b->list_lens);
+    free(b->paths);
+    free(b);
+    index_build = NULL;
+    return 0;
+}
+
+int compare_changes(const void *a, const void *b) {
+    const IdxChange *ca = a, *cb = b;
+    int c = strcmp(ca->rel, cb->rel);
+    return c ? c : (ca->seq < cb->seq) - (ca->seq > cb->seq);
+}
+
+// The latest removal of rel itself, or NULL.
+IdxChange *index_removal(NameIndex *ix, const char *rel) {
+    int lo = 0, hi = ix->nremoved;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = strcmp(ix->removed[mid].rel, rel);
+        if (!c) return &ix->removed[mid];
+        if (c < 0) lo = mid + 1; else hi = mid;
+    }
+    return NULL;
+}
+
+// Whether rel or one of its parents was deleted or moved away after seq;
+// with seq at -1, since the index was built at all.
+int index_removed(NameIndex *ix, const char *rel, long seq) {
+    char buf[PATH_MAX_LEN];
+    snprintf(buf, sizeof(buf), "%s", rel);
+    while (1) {
+        IdxChange *r = index_removal(ix, buf);
+        if (r && r->seq > seq) return 1;
+        char *slash = strrchr(buf, '/');
+        if (!slash) return 0;
+        *slash = '\0';
+    }
+}
+
+int changes_add(IdxChange **c, int *n, int *cap, IdxChange change) {
+    if (*n == *cap) {
+        int grown_cap = *cap ? *cap * 2 : 64;
+        IdxChange *grown = realloc(*c, grown_cap * sizeof(IdxChange));
+        if (!grown) return -1;
+        *c = grown; *cap = grown_cap;
+    }
+    if (!(change.rel = strdup(change.rel))) return -1;
+    (*c)[(*n)++] = change;
+    return 0;
+}
+
+// Sorts c once and keeps the latest change of each path.
+int changes_sort(IdxChange *c, int n) {
+    qsort(c, n, sizeof(IdxChange), compare_changes);
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (kept && !strcmp(c[kept - 1].rel, c[i].rel)) free(c[i].rel);
+        else c[kept++] = c[i];
+    }
+    return kept;
+}
+
+// Appends the m changes in more to the sorted list *c, then sorts it once.
+void changes_merge(IdxChange **c, int *n, IdxChange *more, int m) {
+    IdxChange *grown = m ? realloc(*c, (*n + m) * sizeof(IdxChange)) : NULL;
+    if (!grown) { changes_free(more, m); return; }
+    memcpy(grown + *n, more, m * sizeof(IdxChange));
+    *c = grown;
+    *n = changes_sort(grown, *n + m);
+    free(more);
+}
+
+// A walk task: the change and its path in one block, so a cancelled pool
+// frees it whole.
+IdxChange *walk_task(const char *rel, long seq) {
+    size_t len = strlen(rel) + 1;
+    IdxChange *dir = malloc(sizeof(IdxChange) + len);
+    if (!dir) return NULL;
+    *dir = (IdxChange){memcpy(dir + 1, rel, len), seq, 1, 0};
+    return dir;
+}
+
+// Lists a new directory on the walk pool and watches it first, since
+// anything made inside it before the watch existed sent no event. What it
+// holds comes back through found with the seq of the directory's creation.
+void index_walk_task(Pool *pool, int worker, void *arg) {
+    NameIndex *ix = pool->ctx;
+    IdxChange *dir = arg;
+    char path[PATH_MAX_LEN], sub[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s%s%s", ix->root, ix->sep, dir->rel);
+    if (atomic_load(&ix->watches.count) < IDX_WATCHES) watches_add(&ix->watches, path, dir->rel, IDX_EVENTS);
+    DIR *d = opendir(path);
+    struct dirent *e;
+    while (d && !atomic_load(&pool->cancel) && (e = readdir(d))) {
+        if (is_dot_entry(e->d_name)) continue;
+        snprintf(sub, sizeof(sub), "%s/%s", dir->rel, e->d_name);
+        IdxChange found = {sub, dir->seq, e->d_type == DT_DIR, 0};
+        pthread_mutex_lock(&ix->lock);
+        changes_add(&ix->found, &ix->nfound, &ix->found_cap, found);
+        pthread_mutex_unlock(&ix->lock);
+        IdxChange *next = found.dir ? walk_task(sub, dir->seq) : NULL;
+        if (next) pool_push(pool, worker, next);
+    }
+    if (d) closedir(d);
+    free(dir);
+}
+
+// Queues one inotify event for the batch index_events applies.
+void index_event(void *ctx, const char *rel, uint32_t mask) {
+    NameIndex *ix = ctx;
+    ix->changes++;
+    IdxChange change = {(char *)rel, ++ix->seq, !!(mask & IN_ISDIR), !!(mask & (IN_DELETE | IN_MOVED_FROM))};
+    changes_add(&ix->batch, &ix->nbatch, &ix->batch_cap, change);
+}
+
+// Applies the queued events and whatever the walk pool found to the
+// in-memory changes; the file itself stays as built. The batch is sorted
+// once, however many events it holds. A path counts as added while no
+// removal of it or a parent came after its latest creation.
+void index_events(NameIndex *ix) {
+    if (ix->walking && !atomic_load(&ix->walk.pending)) {
+        pool_join(&ix->walk, 0);
+        ix->walking = 0;
+    }
+    watches_read(&ix->watches, index_event, ix);
+    pthread_mutex_lock(&ix->lock);
+    IdxChange *found = ix->found;
+    int nfound = ix->nfound;
+    ix->found = NULL;
+    ix->nfound = ix->found_cap = 0;
+    pthread_mutex_unlock(&ix->lock);
+    if (!ix->nbatch && !nfound && !ix->nqueued) return;
+    IdxChange *gone = malloc((ix->nbatch + 1) * sizeof(IdxChange)), *made = malloc((ix->nbatch + nfound + 1) * sizeof(IdxChange));
+    if (!gone || !made) {
+        free(gone); free(made);
+        changes_free(found, nfound);
+        return;
+    }
+    int ngone = 0, nmade = 0;
+    for (int i = 0; i < ix->nbatch; i++) {
+        IdxChange *c = &ix->batch[i];
+        if (c->gone) { gone[ngone++] = *c; continue; }
+        made[nmade++] = *c;
+        if (c->dir) changes_add(&ix->queued, &ix->nqueued, &ix->queued_cap, *c);
+    }
+    memcpy(made + nmade, found, nfound * sizeof(IdxChange));
+    nmade += nfound;
+    free(found);
+    ix->nbatch = 0;
+    changes_merge(&ix->removed, &ix->nremoved, gone, ngone);
+    changes_merge(&ix->added, &ix->nadded, made, nmade);
+    int kept = 0;
+    for (int i = 0; i < ix->nadded; i++) {
+        if (index_removed(ix, ix->added[i].rel, ix->added[i].seq)) free(ix->added[i].rel);
+        else ix->added[kept++] = ix->added[i];
+    }
+    ix->nadded = kept;
+    if (ix->walking || !ix->nqueued) return;
+    pool_init(&ix->walk, index_walk_task, ix);
+    for (int i = 0; i < ix->nqueued; i++) {
+        IdxChange *dir = walk_task(ix->queued[i].rel, ix->queued[i].seq);
+        if (dir) pool_push(&ix->walk, -1, dir);
+        free(ix->queued[i].rel);
+    }
+    ix->nqueued = 0;
+    pool_run(&ix->walk);
+    ix->walking = 1;
+}
+
+void content_event(void *ctx, const char *rel, uint32_t mask) {
+    ContentIndex *ix = ctx;
+    if (mask & (IN_DELETE | IN_MOVED_FROM)) return;
+    if (!(mask & IN_ISDIR)) { content_dirty(ix, rel); return; }
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s%s%s", ix->root, ix->sep, rel);
+    if (atomic_load(&ix->watches.count) < IDX_WATCHES) watches_add(&ix->watches, path, rel, CIDX_EVENTS);
+    content_scan(ix, rel, 1);
+}
+
+void content_events(ContentIndex *ix) {
+    watches_read(&ix->watches, content_event, ix);
+}
+
+void index_match(FindJob *job, const char *rel, int len, int plen, int dir) {
+    const char *base = base_name(rel, len);
+    int blen = rel + len - base, score = 0;
+    int hit = job->fuzzy ? (score = fuzzy_score(base, blen, job->query, job->qlen)) != NO_MATCH
+                         : pattern_match(&job->pat, 0, base, blen);
+    if (hit) find_add(job, rel + plen, len - plen, dir, score);
+}
+
+// Answers a find from the index: a binary search bounds the blocks under
+// the panel's directory, and a literal name of three or more characters
+// narrows them further to the blocks holding all of its trigrams.
+const IdxTri *tri_find(const IdxTri *tris, uint64_t n, uint32_t t) {
+    uint64_t a = 0, b = n;
+    while (a < b) {
+        uint64_t m = (a + b) / 2;
+        if (tris[m].tri < t) a = m + 1; else b = m;
+    }
+    return a < n && tris[a].tri == t ? &tris[a] : NULL;
+}
+
+void index_query(NameIndex *ix, FindJob *job, const char *dir) {
+    char prefix[PATH_MAX_LEN], upper[PATH_MAX_LEN], rel[PATH_MAX_LEN];
+    size_t rlen = strlen(ix->root);
+    const char *sub = dir + rlen + (dir[rlen] == '/');
+    int plen = snprintf(prefix, sizeof(prefix), "%s%s", sub, sub[0] ? "/" : "");
+    snprintf(upper, sizeof(upper), "%.*s0", plen - 1, prefix);
+    uint64_t lo = 0, hi = ix->hdr->nblocks;
+    if (plen) {
+        lo = index_seek(ix, prefix);
+        hi = index_seek(ix, upper) + 1;
+    }
+    uint32_t *cand = NULL;
+    uint64_t ncand = 0;
+    Pattern *pat = &job->pat;
+    if (!job->fuzzy && !pat->regex && pat->lit_kind != LIT_NONE && pat->lit_len >= 3) {
+        for (int k = 0; k + 3 <= pat->lit_len; k++) {
+            const IdxTri *tri = tri_find(ix->tris, ix->hdr->ntris, trigram(pat->lit + k));
+            if (!tri || tri->start + tri->count > ix->npostings) {
+                ncand = 0;
+                free(cand);
+                cand = malloc(sizeof(uint32_t));
+                break;
+            }
+            const uint32_t *list = ix->postings + tri->start;
+            uint32_t n = tri->count;
+            if (!cand) {
+                if (!(cand = malloc(n * sizeof(uint32_t)))) break;
+                memcpy(cand, list, n * sizeof(uint32_t));
+                ncand = n;
+                continue;
+            }
+            uint64_t kept = 0;
+            for (uint64_t i = 0, j = 0; i < ncand && j < n;) {
+                if (cand[i] < list[j]) i++;
+                else if (cand[i] > list[j]) j++;
+                else { cand[kept++] = cand[i]; i++; j++; }
+            }
+            ncand = kept;
+        }
+    }
+    uint64_t ci = 0;
+    for (uint64_t k = lo; k < hi; k++) {
+        if (cand) {
+            while (ci < ncand && cand[ci] < k) ci++;
+            if (ci == ncand) break;
+            k = cand[ci];
+            if (k >= hi) break;
+        }
+        const unsigned char *p = (const unsigned char *)ix->map + ix->blocks[k];
+        const unsigned char *end = (const unsigned char *)ix->map + ix->blocks[k + 1];
+        int len = 0, isdir;
+        uint64_t mtime;
+        while ((p = index_record(p, end, rel, &len, &isdir, &mtime)) != NULL) {
+            if (strncmp(rel, prefix, plen)) continue;
+            if (ix->nremoved && index_removed(ix, rel, -1)) continue;
+            index_match(job, rel, len, plen, isdir);
+        }
+    }
+    free(cand);
+    for (int i = 0; i < ix->nadded; i++) {
+        const char *a = ix->added[i].rel;
+        if (!strncmp(a, prefix, plen)) index_match(job, a, strlen(a), plen, ix->added[i].dir);
+    }
+}
+
+// Copies out the longest run of plain characters that every match of the
+// extended regex re contains; returns its length, 0 when there is none.
+int regex_literal(const char *re, char *out, int size) {
+    const char *meta = ".[]()*+?{}|^$\\";
+    char run[FILTER_MAX];
+    int n = 0, best = 0, depth = 0;
+    if (strchr(re, '|')) return 0;
+    for (const char *p = re;; p++) {
+        int c = *p, lit = -1;
+        if (c == '\\' && p[1]) lit = strchr(meta, *++p) ? *p : -1;
+        else if (c && !strchr(meta, c)) lit = c;
+        else if (c == '*' || c == '?') n -= n > 0;
+        else if (c == '{') {
+            n -= n > 0;
+            while (p[1] && p[1] != '}') p++;
+            p += p[1] == '}';
+        }
+        else if (c == '(') depth++;
+        else if (c == ')') depth--;
+        else if (c == '[') {
+            p += p[1] == '^';
+            p += p[1] == ']';
+            while (p[1] && p[1] != ']') p++;
+            p += p[1] == ']';
+        }
+        if (lit >= 0 && !depth && n < (int)sizeof(run)) { run[n++] = lit; continue; }
+        if (n > best && n < size) { best = n; memcpy(out, run, n); }
+        n = 0;
+        if (!c) break;
+    }
+    out[best] = '\0';
+    return best;
+}
+
+// Collects the files under sub (relative to the index's root) whose
+// postings hold every trigram of lit, in id order. Returns how many.
+long content_query(ContentIndex *ix, const char *sub, const char *lit, size_t len, uint32_t **out) {
+    char prefix[PATH_MAX_LEN], upper[PATH_MAX_LEN];
+    int plen = snprintf(prefix, sizeof(prefix), "%s%s", sub, sub[0] ? "/" : "");
+    snprintf(upper, sizeof(upper), "%.*s0", plen - 1, prefix);
+    uint64_t lo = plen ? content_seek(ix, prefix) : 0, hi = plen ? content_seek(ix, upper) : ix->hdr->count;
+    const IdxTri *lists[FILTER_MAX];
+    int nlists = 0;
+    for (size_t k = 0; k + 3 <= len; k++) {
+        uint32_t t = fold_byte(lit[k]) << 16 | fold_byte(lit[k + 1]) << 8 | fold_byte(lit[k + 2]);
+        const IdxTri *tri = tri_find(ix->tris, ix->hdr->ntris, t);
+        if (!tri || tri->start > ix->postings_size) return *out = NULL, 0;
+        int i = nlists;
+        while (i > 0 && lists[i - 1]->count > tri->count) { lists[i] = lists[i - 1]; i--; }
+        lists[i] = tri;
+        nlists++;
+    }
+    uint32_t *cand = malloc((nlists ? lists[0]->count : 0) * sizeof(uint32_t) + 1);
+    long ncand = 0;
+    if (!cand) return *out = NULL, 0;
+    const unsigned char *end = ix->postings + ix->postings_size;
+    for (int l = 0; l < nlists; l++) {
+        const unsigned char *p = ix->postings + lists[l]->start;
+        uint64_t id = 0, delta;
+        long kept = 0, ci = 0;
+        for (uint32_t k = 0; k < lists[l]->count && (p = get_varint(p, end, &delta)); k++) {
+            id += delta;
+            if (l == 0) {
+                if (id >= lo && id < hi) cand[ncand++] = id;
+                continue;
+            }
+            while (ci < ncand && cand[ci] < id) ci++;
+            if (ci == ncand) break;
+            if (cand[ci] == id) cand[kept++] = cand[ci++];
+        }
+        if (l > 0) ncand = kept;
+        if (!ncand) break;
+    }
+    *out = cand;
+    return ncand;
+}
+
+void find_stop(Panel *p) {
+    FindJob *job = p->find;
+    if (!job) return;
+    if (!job->done && !job->indexed) pool_join(&job->pool, 1);
+    pattern_free(&job->pat);
+    arena_reset(&job->strings);
+    free(job->found);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    p->find = NULL;
+}
+
+void dup_stop(Panel *p) {
+    DupJob *job = p->dups;
+    if (!job) return;
+    if (!job->applied) {
+        atomic_store(&job->cancel, 1);
+        pthread_join(job->thread, NULL);
+    }
+    arena_reset(&job->strings);
+    free(job->files);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    p->dups = NULL;
+}
+
+// Lists every name under the panel's directory matching text: a glob, a
+// regex after '/', or a fuzzy query after '~'. Matches become the panel's
+// entries as paths relative to its directory, so the usual keys work on
+// them. A name index covering the directory answers at once; otherwise
+// the tree is walked.
+int find_start(Panel *p, const char *text) {
+    FindJob *job = calloc(1, sizeof(FindJob));
+    if (!job) return -1;
+    job->fuzzy = text[0] == '~';
+    if (job->fuzzy) {
+        for (; text[job->qlen + 1]; job->qlen++) job->query[job->qlen] = tolower((unsigned char)text[job->qlen + 1]);
+    } else if (pattern_init(&job->pat, text) != 0) {
+        free(job);
+        return -1;
+    }
+    NameIndex *ix = index_for(p->cwd);
+    char *rel = ix ? NULL : strdup("");
+    if (!ix && !rel) { pattern_free(&job->pat); free(job); return -1; }
+    find_stop(p);
+    dup_stop(p);
+    size_cancel(p);
+    clear_filter(p);
+    p->du_active = 0;
+    snprintf(job->text, sizeof(job->text), "%s", text);
+    snprintf(job->root, sizeof(job->root), "%s", p->cwd);
+    pthread_mutex_init(&job->lock, NULL);
+    arena_reset(&p->names);
+    p->count = p->marked = 0;
+    p->selected = p->scroll_offset = 0;
+    p->find = job;
+    if (ix) {
+        job->indexed = 1;
+        index_query(ix, job, p->cwd);
+        return 0;
+    }
+    pool_init(&job->pool, find_task, job);
+    pool_push(&job->pool, -1, rel);
+    pool_run(&job->pool);
+    return 0;
+}
+
+// Best score first, then by path; every score is 0 unless the query is fuzzy.
+int compare_found(const void *a, const void *b) {
+    const Entry *ea = a, *eb = b;
+    if (ea->score != eb->score) return eb->score > ea->score ? 1 : -1;
+    return strcmp(ea->name, eb->name);
+}
+
+// Moves new matches into the panel and, once the walk is over, sorts them
+// by path, or best first for a fuzzy query. Returns 1 while the walk runs.
+int find_update(Panel *p) {
+    FindJob *job = p->find;
+    if (!job) return 0;
+    pthread_mutex_lock(&job->lock);
+    for (; job->taken < job->nfound; job->taken++) {
+        Found *f = &job->found[job->taken];
+        if (p->count == p->cap) {
+            int cap = p->cap ? p->cap * 2 : 256;
+            Entry *grown = realloc(p->entries, cap * sizeof(Entry));
+            if (!grown) break;
+            p->entries = grown; p->cap = cap;
+        }
+        Entry *e = &p->entries[p->count];
+        e->name_len = f->len;
+        if (!(e->name = arena_strndup(&p->names, f->path, f->len))) break;
+        e->sig = name_signature(e->name, e->name_len);
+        struct stat st = {.st_mode = f->dir ? S_IFDIR : S_IFREG};
+        e->type = detect_file_type(e->name, &st);
+        e->marked = e->sizing = 0;
+        e->size = -1;
+        e->node = DU_NONE;
+        e->score = f->score;
+        p->count++;
+        if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+    }
+    pthread_mutex_unlock(&job->lock);
+    if (job->done) return 0;
+    if (!job->indexed) {
+        if (atomic_load(&job->pool.pending)) return 1;
+        pool_join(&job->pool, 0);
+    }
+    job->done = 1;
+    Entry *sel = cur_entry(p);
+    char name[PATH_MAX_LEN] = "";
+    if (sel) snprintf(name, sizeof(name), "%s", sel->name);
+    qsort(p->entries, p->count, sizeof(Entry), compare_found);
+    for (int i = 0; name[0] && !p->filtered && i < p->count; i++)
+        if (!strcmp(p->entries[i].name, name)) { p->selected = i; break; }
+    if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+    return 0;
+}
+
+// Drops results that no longer exist after a change on disk.
+void find_prune(Panel *p) {
+    char path[PATH_MAX_LEN];
+    struct stat st;
+    int kept = 0;
+    for (int i = 0; i < p->count; i++) {
+        Entry *e = &p->entries[i];
+        snprintf(path, sizeof(path), "%s/%s", p->cwd, e->name);
+        if (lstat(path, &st) != 0) { p->marked -= e->marked; continue; }
+        p->entries[kept++] = *e;
+    }
+    p->count = kept;
+    if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+}
+
+// Counts the sets in a duplicates panel and the bytes held by all but the
+// first member of each.
+void dup_count(Panel *p) {
+    DupJob *job = p->dups;
+    job->sets = job->reclaimable = 0;
+    for (int i = 0; i < p->count; i++) {
+        if (i && p->entries[i].set == p->entries[i - 1].set) job->reclaimable += p->entries[i].size;
+        else job->sets++;
+    }
+}
+
+// Drops members that are gone or have become links to an earlier member of
+// their set, then the sets left with a single member.
+void dup_prune(Panel *p) {
+    char path[PATH_MAX_LEN];
+    struct stat st;
+    FileId *ids = malloc((p->count + 1) * sizeof(FileId));
+    if (!ids) return;
+    int kept = 0;
+    for (int i = 0; i < p->count; i++) {
+        Entry *e = &p->entries[i];
+        snprintf(path, sizeof(path), "%s/%s", p->cwd, e->name);
+        int drop = lstat(path, &st) != 0;
+        for (int j = kept - 1; !drop && j >= 0 && p->entries[j].set == e->set; j--) {
+            if (ids[j].dev != st.st_dev || ids[j].ino != st.st_ino) continue;
+            // The same file twice: it stays marked only if both were.
+            p->marked -= p->entries[j].marked && !e->marked;
+            p->entries[j].marked &= e->marked;
+            drop = 1;
+        }
+        if (drop) { p->marked -= e->marked; continue; }
+        ids[kept] = (FileId){st.st_dev, st.st_ino, st.st_size};
+        p->entries[kept++] = *e;
+    }
+    free(ids);
+    int n = 0;
+    for (int i = 0; i < kept; i++) {
+        Entry *e = &p->entries[i];
+        if ((!i || p->entries[i - 1].set != e->set) && (i + 1 == kept || p->entries[i + 1].set != e->set)) {
+            p->marked -= e->marked;
+            continue;
+        }
+        p->entries[n++] = *e;
+    }
+    p->count = n;
+    dup_count(p);
+    if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+}
+
+DuNode *du_node(DuTree *t, uint32_t i) {
+    return &t->chunks[i / DU_CHUNK][i % DU_CHUNK];
+}
+
+const char *du_name(DuTree *t, uint32_t i) {
+    return t->names + du_node(t, i)->name;
+}
+
+// Returns the pool offset of a name, adding it on first use, or UINT32_MAX
+// once the pool is full.
+uint32_t du_intern(DuTree *t, const char *s, size_t len) {
+    if ((t->name_count + 1) * 4 > t->name_cap * 3) {
+        size_t cap = t->name_cap ? t->name_cap * 2 : 4096;
+        uint32_t *slots = calloc(cap, sizeof(uint32_t));
+        if (!slots) return UINT32_MAX;
+        for (size_t i = 0; i < t->name_cap; i++) {
+            uint32_t off = t->name_slots[i];
+            if (!off) continue;
+            const char *n = t->names + off - 1;
+            size_t j = name_hash(n, strlen(n)) & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = off;
+        }
+        free(t->name_slots);
+        t->name_slots = slots; t->name_cap = cap;
+    }
+    size_t j = name_hash(s, len) & (t->name_cap - 1);
+    for (; t->name_slots[j]; j = (j + 1) & (t->name_cap - 1)) {
+        const char *n = t->names + t->name_slots[j] - 1;
+        if (!strncmp(n, s, len) && !n[len]) return t->name_slots[j] - 1;
+    }
+    if (t->names_len + len + 2 >= UINT32_MAX) return UINT32_MAX;
+    if (t->names_len + len + 1 > t->names_cap) {
+        size_t cap = t->names_cap ? t->names_cap * 2 : 65536;
+        while (cap < t->names_len + len + 1) cap *= 2;
+        char *names = realloc(t->names, cap);
+        if (!names) return UINT32_MAX;
+        t->names = names; t->names_cap = cap;
+    }
+    uint32_t off = t->names_len;
+    memcpy(t->names + off, s, len);
+    t->names[off + len] = '\0';
+    t->names_len += len + 1;
+    t->name_slots[j] = off + 1;
+    t->name_count++;
+    return off;
+}
+
+int du_bin(uint32_t n) {
+    return 31 - __builtin_clz(n);
+}
+
+// Keeps a run of dropped nodes for du_alloc. One that does not fit is
+// simply never reused.
+void du_release(DuTree *t, uint32_t first, uint32_t count) {
+    if (!count) return;
+    int b = du_bin(count);
+    if (t->nspare[b] == t->spare_cap[b]) {
+        size_t cap = t->spare_cap[b] ? t->spare_cap[b] * 2 : 64;
+        DuRun *grown = realloc(t->spare[b], cap * sizeof(DuRun));
+        if (!grown) return;
+        t->spare[b] = grown; t->spare_cap[b] = cap;
+    }
+    t->spare[b][t->nspare[b]++] = (DuRun){first, count};
+}
+
+// Reserves n consecutive node indices, from a spare run when one is long
+// enough: the newest of n's own bin, or any of a higher one, whose rest
+// goes back. Returns DU_NONE when out of room.
+uint32_t du_alloc(DuTree *t, uint32_t n) {
+    for (int b = du_bin(n); b < DU_BINS; b++) {
+        if (!t->nspare[b]) continue;
+        DuRun run = t->spare[b][t->nspare[b] - 1];
+        if (run.count < n) continue;
+        t->nspare[b]--;
+        du_release(t, run.first + n, run.count - n);
+        return run.first;
+    }
+    if ((uint64_t)t->nnodes + n >= DU_DEAD) return DU_NONE;
+    while (((uint64_t)t->nnodes + n + DU_CHUNK - 1) / DU_CHUNK > t->nchunks) {
+        DuNode **chunks = realloc(t->chunks, (t->nchunks + 1) * sizeof(DuNode *));
+        if (!chunks) return DU_NONE;
+        t->chunks = chunks;
+        if (!(t->chunks[t->nchunks] = malloc(DU_CHUNK * sizeof(DuNode)))) return DU_NONE;
+        t->nchunks++;
+    }
+    uint32_t first = t->nnodes;
+    t->nnodes += n;
+    return first;
+}
+
+void du_push(DuTree *t, uint32_t i) {
+    if (t->npending == t->pending_cap) {
+        size_t cap = t->pending_cap ? t->pending_cap * 2 : 1024;
+        uint32_t *pending = realloc(t->pending, cap * sizeof(uint32_t));
+        if (!pending) return;
+        t->pending = pending; t->pending_cap = cap;
+    }
+    t->pending[t->npending++] = i;
+}
+
+// Writes the path of node i; the root is named by its absolute path.
+void du_path(DuTree *t, uint32_t i, char *buf, size_t size) {
+    uint32_t chain[PATH_MAX_LEN / 2];
+    int n = 0;
+    for (; i != DU_NONE && n < PATH_MAX_LEN / 2; i = du_node(t, i)->parent) chain[n++] = i;
+    size_t len = snprintf(buf, size, "%s", du_name(t, chain[n - 1]));
+    for (int k = n - 2; k >= 0 && len < size; k--)
+        len += snprintf(buf + len, size - len, "%s%s", buf[len - 1] == '/' ? "" : "/", du_name(t, chain[k]));
+}
+
+void du_add(DuTree *t, uint32_t i, int64_t delta) {
+    for (; i != DU_NONE; i = du_node(t, i)->parent) du_node(t, i)->size += delta;
+}
+
+// Reads one pending directory: its entries become consecutive child nodes,
+// file sizes are added up the tree and subdirectories are queued. A file
+// with several links counts at its first place, or where it is found again
+// after that place was dropped by a refresh.
+void du_scan(DuTree *t, uint32_t i) {
+    char path[PATH_MAX_LEN];
+    du_path(t, i, path, sizeof(path));
+    du_node(t, i)->count = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) { if (fd >= 0) close(fd); return; }
+    DuScan *found = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            DuScan *grown = realloc(found, cap * sizeof(DuScan));
+            if (!grown) break;
+            found = grown;
+        }
+        uint32_t name = du_intern(t, de->d_name, strlen(de->d_name));
+        if (name == UINT32_MAX) break;
+        int isdir = S_ISDIR(st.st_mode);
+        found[n++] = (DuScan){name, isdir, isdir ? 0 : st.st_size, st.st_dev, st.st_ino, !isdir && st.st_nlink > 1};
+    }
+    closedir(dir);
+    uint32_t first = n ? du_alloc(t, n) : 0;
+    if (first == DU_NONE) n = 0;
+    int64_t sum = 0;
+    for (size_t k = 0; k < n; k++) {
+        DuNode *c = du_node(t, first + k);
+        *c = (DuNode){found[k].size, found[k].name, i, 0, found[k].dir ? DU_PENDING : DU_FILE};
+        if (found[k].linked) {
+            int added;
+            FileId *id = idset_probe(&t->links, found[k].dev, found[k].ino, &added);
+            if (added || id->size == DU_DEAD) id->size = first + k;
+            else c->size = 0;
+        }
+        sum += c->size;
+        if (found[k].dir) du_push(t, first + k);
+    }
+    free(found);
+    DuNode *d = du_node(t, i);
+    d->first = first;
+    d->count = n;
+    du_add(t, i, sum);
+}
+
+// Scans pending directories for up to budget_ms; returns 1 while any remain.
+int du_step(DuTree *t, int budget_ms) {
+    long start = now_ms();
+    while (t->npending && now_ms() - start < budget_ms) {
+        uint32_t i = t->pending[--t->npending];
+        DuNode *d = du_node(t, i);
+        if (d->parent != DU_DEAD && d->count == DU_PENDING) du_scan(t, i);
+    }
+    return t->npending > 0;
+}
+
+// Drops everything below directory i and queues it for a new scan. Dropped
+// nodes are marked dead, so queued ones are skipped, and their runs are
+// kept for the scans to reuse. A file with several links that counted at
+// a dropped node loses its owner first, as the index may soon be another's.
+void du_refresh(DuTree *t, uint32_t i) {
+    DuNode *d = du_node(t, i);
+    if (d->count == DU_FILE || d->count == DU_PENDING) return;
+    uint32_t *stack = NULL;
+    size_t n = 0, cap = 0;
+    for (uint32_t j = i;; j = stack[--n]) {
+        DuNode *dj = du_node(t, j);
+        if (dj->count != DU_FILE && dj->count != DU_PENDING) {
+            du_release(t, dj->first, dj->count);
+            for (uint32_t c = dj->first; c < dj->first + dj->count; c++) {
+                du_node(t, c)->parent = DU_DEAD;
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 256;
+                    uint32_t *grown = realloc(stack, cap * sizeof(uint32_t));
+                    if (!grown) continue;
+                    stack = grown;
+                }
+                stack[n++] = c;
+            }
+        }
+        if (!n) break;
+    }
+    free(stack);
+    for (size_t k = 0; k < t->links.cap; k++) {
+        FileId *id = &t->links.slots[k];
+        if (id->ino && id->size != DU_DEAD && du_node(t, id->size)->parent == DU_DEAD) id->size = DU_DEAD;
+    }
+    du_add(t, i, -d->size);
+    d->first = 0;
+    d->count = DU_PENDING;
+    du_push(t, i);
+}
+
+void du_free(DuTree *t) {
+    if (!t) return;
+    for (uint32_t i = 0; i < t->nchunks; i++) free(t->chunks[i]);
+    free(t->chunks);
+    free(t->names);
+    free(t->name_slots);
+    free(t->pending);
+    free(t->links.slots);
+    for (int b = 0; b < DU_BINS; b++) free(t->spare[b]);
+    pthread_mutex_destroy(&t->links.lock);
+    free(t);
+}
+
+DuTree *du_open(const char *root) {
+    DuTree *t = calloc(1, sizeof(DuTree));
+    if (!t) return NULL;
+    pthread_mutex_init(&t->links.lock, NULL);
+    uint32_t i = du_alloc(t, 1);
+    uint32_t name = du_intern(t, root, strlen(root));
+    if (i == DU_NONE || name == UINT32_MAX) { du_free(t); return NULL; }
+    *du_node(t, i) = (DuNode){0, name, DU_NONE, 0, DU_PENDING};
+    du_push(t, i);
+    return t;
+}
+
+// Finds the node of a path inside the tree, or DU_NONE when the path lies
+// outside it or has not been scanned yet.
+uint32_t du_locate(DuTree *t, const char *path) {
+    const char *root = du_name(t, 0);
+    size_t len = strlen(root);
+    if (strncmp(path, root, len)) return DU_NONE;
+    const char *s = path + len;
+    if (*s && *s != '/' && root[len - 1] != '/') return DU_NONE;
+    uint32_t i = 0;
+    while (*s) {
+        while (*s == '/') s++;
+        size_t n = strcspn(s, "/");
+        if (!n) break;
+        DuNode *d = du_node(t, i);
+        if (d->count == DU_FILE || d->count == DU_PENDING) return DU_NONE;
+        uint32_t c = d->first;
+        for (; c < d->first + d->count; c++) {
+            const char *name = du_name(t, c);
+            if (!strncmp(name, s, n) && !name[n]) break;
+        }
+        if (c == d->first + d->count) return DU_NONE;
+        i = c;
+        s += n;
+    }
+    return i;
+}
+
+int compare_du(const void *a, const void *b) {
+    const Entry *ea = a, *eb = b;
+    if (!strcmp(ea->name, "..")) return -1;
+    if (!strcmp(eb->name, "..")) return 1;
+    if (ea->size != eb->size) return ea->size < eb->size ? 1 : -1;
+    return strcmp(ea->name, eb->name);
+}
+
+int compare_nodes(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Lists the children of p->du_dir, largest first, keeping the selection and
+// marks on the same nodes.
+void du_fill(Panel *p) {
+    DuTree *t = p->du;
+    Entry *sel = p->filtered ? NULL : cur_entry(p);
+    uint32_t sel_node = sel ? sel->node : DU_NONE;
+    uint32_t *marked = p->marked ? malloc(p->marked * sizeof(uint32_t)) : NULL;
+    int nmarked = 0;
+    for (int i = 0; marked && i < p->count; i++)
+        if (p->entries[i].marked) marked[nmarked++] = p->entries[i].node;
+    if (marked) qsort(marked, nmarked, sizeof(uint32_t), compare_nodes);
+    arena_reset(&p->names);
+    p->count = p->marked = 0;
+    DuNode *d = du_node(t, p->du_dir);
+    uint32_t n = d->count == DU_PENDING ? 0 : d->count;
+    if ((int)n + 1 > p->cap) {
+        Entry *grown = realloc(p->entries, (n + 1) * sizeof(Entry));
+        if (!grown) { free(marked); return; }
+        p->entries = grown; p->cap = n + 1;
+    }
+    for (uint32_t k = 0; k <= n; k++) {
+        uint32_t c = k ? d->first + k - 1 : d->parent;
+        const char *name = k ? du_name(t, c) : "..";
+        Entry *e = &p->entries[p->count];
+        e->name_len = strlen(name);
+        if (!(e->name = arena_strndup(&p->names, name, e->name_len))) break;
+        e->sig = name_signature(e->name, e->name_len);
+        e->node = c;
+        if (!k || du_node(t, c)->count != DU_FILE) {
+            e->type = TYPE_FOLDER;
+        } else {
+            struct stat st = {.st_mode = S_IFREG};
+            e->type = detect_file_type(name, &st);
+        }
+        e->size = k ? du_node(t, c)->size : -1;
+        e->sizing = e->type == TYPE_FOLDER && t->npending;
+        e->marked = k && marked && bsearch(&c, marked, nmarked, sizeof(uint32_t), compare_nodes);
+        p->marked += e->marked;
+        p->count++;
+    }
+    free(marked);
+    qsort(p->entries, p->count, sizeof(Entry), compare_du);
+    for (int i = 0; sel_node != DU_NONE && i < p->count; i++)
+        if (p->entries[i].node == sel_node) { p->selected = i; break; }
+    if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+}
+
+void du_enter(Panel *p, uint32_t node) {
+    uint32_t from = p->du_dir;
+    clear_filter(p);
+    p->du_dir = node;
+    du_path(p->du, node, p->cwd, sizeof(p->cwd));
+    chdir(p->cwd);
+    p->count = p->marked = 0;
+    p->selected = p->scroll_offset = 0;
+    du_fill(p);
+    for (int i = 0; i < p->count; i++)
+        if (p->entries[i].node == from) { p->selected = i; break; }
+}
+
+// Switches the panel between the disk and a disk-usage tree of its
+// directory. The tree is kept on the way out, so coming back anywhere
+// inside it resumes the scan instead of starting over.
+void du_toggle(Panel *p) {
+    size_cancel(p);
+    find_stop(p);
+    dup_stop(p);
+    if (p->du_active) {
+        p->du_active = 0;
+        clear_filter(p);
+        free_panel(p); list_dir(p);
+        p->selected = p->scroll_offset = 0;
+        return;
+    }
+    uint32_t node = p->du ? du_locate(p->du, p->cwd) : DU_NONE;
+    if (node == DU_NONE) {
+        du_free(p->du);
+        if (!(p->du = du_open(p->cwd))) return;
+        node = 0;
+    }
+    p->du_active = 1;
+    du_enter(p, node);
+}
+
+// Runs a slice of the scan behind a disk-usage panel; returns 1 while it lasts.
+int du_update(Panel *p, int budget_ms) {
+    if (!p->du_active || !p->du->npending) return 0;
+    du_step(p->du, budget_ms);
+    du_fill(p);
+    return 1;
+}
+
+Vfs *vfs_mounts[VFS_MOUNTS];
+char vfs_tmp[PATH_MAX_LEN];
+
+int vfs_mount(Vfs *fs) {
+    for (int i = 0; i < VFS_MOUNTS; i++)
+        if (!vfs_mounts[i]) { vfs_mounts[i] = fs; return 0; }
+    return -1;
+}
+
+void vfs_unmount(Vfs *fs) {
+    for (int i = 0; i < VFS_MOUNTS; i++)
+        if (vfs_mounts[i] == fs) vfs_mounts[i] = NULL;
+}
+
+// Copies src to dst through a temporary name beside dst, keeping mode and
+// times. copy_file_range keeps the data in the kernel (or lets the file
+// system clone it); across file systems it falls back to read and write.
+int copy_file(const char *src, const char *dst, atomic_llong *written, atomic_int *cancel) {
+    int in = open(src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    struct stat st;
+    if (in < 0) return -1;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) { close(in); return -1; }
+    char tmp[PATH_MAX_LEN];
+    const char *base = strrchr(dst, '/');
+    base = base ? base + 1 : dst;
+    snprintf(tmp, sizeof(tmp), "%.*s.%s.mcsync", (int)(base - dst), dst, base);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out < 0) { close(in); return -1; }
+    int ok = 1, fallback = 0;
+    char buf[65536];
+    for (off_t done = 0; ok && done < st.st_size;) {
+        if (cancel && atomic_load(cancel)) { ok = 0; break; }
+        size_t want = st.st_size - done < COPY_CHUNK ? st.st_size - done : COPY_CHUNK;
+        ssize_t n = fallback ? -1 : copy_file_range(in, NULL, out, NULL, want, 0);
+        if (n < 0 && !fallback && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            fallback = 1;
+            continue;
+        }
+        if (fallback && (n = read(in, buf, want < sizeof(buf) ? want : sizeof(buf))) > 0)
+            for (ssize_t put = 0, w; put < n; put += w)
+                if ((w = write(out, buf + put, n - put)) <= 0) { n = -1; break; }
+        if (n <= 0) { ok = n == 0; break; }
+        done += n;
+        if (written) atomic_fetch_add(written, n);
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    ok = ok && fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0;
+    ok = close(out) == 0 && ok;
+    close(in);
+    if (ok && rename(tmp, dst) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
+
+// Copies a local path to dst, a directory with everything below it;
+// symlinks are copied as links.
+int local_copy(const char *src, const char *dst) {
+    struct stat st;
+    if (lstat(src, &st) != 0) return -1;
+    if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX_LEN];
+        ssize_t n = readlink(src, link, sizeof(link) - 1);
+        if (n < 0) return -1;
+        link[n] = '\0';
+        return symlink(link, dst);
+    }
+    if (!S_ISDIR(st.st_mode)) return copy_file(src, dst, NULL, NULL);
+    DIR *dir = opendir(src);
+    if (!dir) return -1;
+    if (mkdir(dst, 0700) != 0) { closedir(dir); return -1; }
+    int failed = 0;
+    struct dirent *de;
+    char from[PATH_MAX_LEN], to[PATH_MAX_LEN];
+    while ((de = readdir(dir)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        snprintf(from, sizeof(from), "%s/%s", src, de->d_name);
+        snprintf(to, sizeof(to), "%s/%s", dst, de->d_name);
+        failed |= local_copy(from, to) != 0;
+    }
+    closedir(dir);
+    chmod(dst, st.st_mode & 07777);
+    return failed ? -1 : 0;
+}
+
+void *local_open_dir(Vfs *fs, const char *path) {
+    LocalDir *d = malloc(sizeof(LocalDir));
+    if (!d) return NULL;
+    if ((d->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) { free(d); return NULL; }
+    d->len = d->off = 0;
+    return d;
+}
+
+// Hands out what one getdents64 call returned, so a batch never spans two
+// buffers; d_type gives the type bits without a stat.
+int local_read_batch(Vfs *fs, void *dir, VfsEntry *out, int max) {
+    LocalDir *d = dir;
+    if (d->off == d->len) {
+        d->off = 0;
+        if ((d->len = getdents64(d->fd, d->buf, sizeof(d->buf))) <= 0) return d->len < 0 ? -1 : 0;
+    }
+    int n = 0;
+    while (n < max && d->off < d->len) {
+        struct dirent64 *de = (struct dirent64 *)(d->buf + d->off);
+        d->off += de->d_reclen;
+        out[n++] = (VfsEntry){.name = de->d_name, .name_len = strlen(de->d_name),
+            .mode = DTTOIF(de->d_type), .size = -1, .node = DU_NONE};
+    }
+    return n;
+}
+
+// Stats a batch relative to the directory's descriptor, following links
+// as the listing always has; directories need nothing beyond d_type.
+void local_stat_batch(Vfs *fs, void *dir, VfsEntry *ents, int n) {
+    LocalDir *d = dir;
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        if (S_ISDIR(ents[i].mode)) continue;
+        if (fstatat(d->fd, ents[i].name, &st, 0) == 0) {
+            ents[i].mode = st.st_mode;
+            ents[i].size = st.st_size;
+        } else {
+            ents[i].mode = 0;
+        }
+    }
+}
+
+void local_close_dir(Vfs *fs, void *dir) {
+    LocalDir *d = dir;
+    close(d->fd);
+    free(d);
+}
+
+int local_stat(Vfs *fs, const char *path, VfsEntry *out) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return -1;
+    *out = (VfsEntry){.name = path, .name_len = strlen(path), .mode = st.st_mode, .size = st.st_size, .node = DU_NONE};
+    return 0;
+}
+
+// Whether path (which need not exist yet) lies at or below the directory
+// dir, by device and inode of each existing ancestor, so links and
+// spellings like "a/../a" cannot hide it.
+int path_within(const char *path, const struct stat *dir) {
+    char up[PATH_MAX_LEN];
+    struct stat st;
+    snprintf(up, sizeof(up), "%s", path);
+    for (;;) {
+        if (stat(up[0] ? up : "/", &st) == 0 && st.st_dev == dir->st_dev && st.st_ino == dir->st_ino) return 1;
+        char *slash = strrchr(up, '/');
+        if (!slash || (slash == up && !up[1])) return 0;
+        if (slash == up) slash++;
+        *slash = '\0';
+    }
+}
+
+int local_get(Vfs *fs, const char *path, const char *local) {
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && path_within(local, &st)) {
+        errno = EINVAL;    // into itself
+        return -1;
+    }
+    return local_copy(path, local);
+}
+
+int local_put(Vfs *fs, const char *local, const char *path) {
+    return local_get(fs, local, path);
+}
+
+int local_unlink(Vfs *fs, const char *path) {
+    return delete_path(path);
+}
+
+int local_rename(Vfs *fs, const char *from, const char *to) {
+    return rename(from, to);
+}
+
+const VfsOps local_ops = {
+    .caps = VFS_WRITE,
+    .open_dir = local_open_dir,
+    .read_batch = local_read_batch,
+    .stat_batch = local_stat_batch,
+    .close_dir = local_close_dir,
+    .stat = local_stat,
+    .get = local_get,
+    .put = local_put,
+    .unlink = local_unlink,
+    .rename = local_rename,
+};
+
+Vfs vfs_local = { &local_ops, NULL, "" };
+
+// The backend owning path: a mount it lies strictly below, else the local
+// one. A mount's root itself is a local file, such as the archive.
+Vfs *vfs_resolve(const char *path) {
+    for (int i = 0; i < VFS_MOUNTS; i++) {
+        Vfs *fs = vfs_mounts[i];
+        size_t len = fs ? strlen(fs->root) : 0;
+        if (fs && !strncmp(path, fs->root, len) && path[len] == '/') return fs;
+    }
+    return &vfs_local;
+}
+
+// Makes the private temporary directory on first use; removed at exit.
+int vfs_tmp_dir(void) {
+    if (!vfs_tmp[0]) {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(vfs_tmp, sizeof(vfs_tmp), "%s/mycommander-XXXXXX", tmp && tmp[0] ? tmp : "/tmp");
+        if (!mkdtemp(vfs_tmp)) { vfs_tmp[0] = '\0'; return -1; }
+    }
+    return 0;
+}
+
+// Fetches a file into a private temporary directory, for the viewers,
+// which map or pread local files.
+int vfs_temp(Vfs *fs, const char *path, char *out, size_t size) {
+    if (vfs_tmp_dir() != 0) return -1;
+    const char *base = strrchr(path, '/');
+    snprintf(out, size, "%s/%s", vfs_tmp, base ? base + 1 : path);
+    delete_path(out);
+    return fs->ops->get(fs, path, out);
+}
+
+// Copies between any two backends; when neither end is local the data
+// goes through a temporary copy.
+int vfs_copy(Vfs *src, const char *from, Vfs *dst, const char *to) {
+    if (dst == &vfs_local) return src->ops->get(src, from, to);
+    if (!dst->ops->put) return -1;
+    if (src == &vfs_local) return dst->ops->put(dst, from, to);
+    char tmp[PATH_MAX_LEN];
+    int ok = vfs_temp(src, from, tmp, sizeof(tmp)) == 0 && dst->ops->put(dst, tmp, to) == 0;
+    delete_path(tmp);
+    return ok ? 0 : -1;
+}
+
+// Opens a directory of a non-local panel, or its parent for "..". The
+// backend's root has no parent to go to. Keeps the listing when the
+// directory cannot be read.
+void vfs_enter(Panel *p, const char *name) {
+    char old[PATH_MAX_LEN];
+    size_t root = strlen(p->vfs->root);
+    snprintf(old, sizeof(old), "%s", p->cwd);
+    if (strcmp(name, "..")) {
+        size_t len = strlen(p->cwd);
+        snprintf(p->cwd + len, sizeof(p->cwd) - len, "%s%s", p->cwd[len - 1] == '/' ? "" : "/", name);
+    } else {
+        char *slash = strrchr(p->cwd, '/');
+        if (!slash || (size_t)(slash - p->cwd) < root) return;
+        if ((size_t)(slash - p->cwd) == root) slash[1] = '\0';
+        else *slash = '\0';
+    }
+    clear_filter(p);
+    free_panel(p);
+    if (list_dir(p) != 0) {
+        snprintf(p->cwd, sizeof(p->cwd), "%s", old);
+        list_dir(p);
+        return;
+    }
+    p->selected = p->scroll_offset = 0;
+}
+
+int archive_kind(const char *name) {
+    size_t n = strlen(name);
+    const char *zips[] = {".zip", ".jar"}, *tars[] = {".tar"}, *tgzs[] = {".tar.gz", ".tgz"};
+    for (int i = 0; i < 2; i++)
+        if (n > strlen(zips[i]) && !strcasecmp(name + n - strlen(zips[i]), zips[i])) return ARC_ZIP;
+    if (n > strlen(tars[0]) && !strcasecmp(name + n - strlen(tars[0]), tars[0])) return ARC_TAR;
+    for (int i = 0; i < 2; i++)
+        if (n > strlen(tgzs[i]) && !strcasecmp(name + n - strlen(tgzs[i]), tgzs[i])) return ARC_TGZ;
+    return -1;
+}
+
+uint32_t arc_name(Archive *a, const char *s, size_t len) {
+    if (a->names_len + len + 1 > a->names_cap) {
+        size_t cap = (a->names_len + len + 1) * 2;
+        char *names = cap < UINT32_MAX ? realloc(a->names, cap) : NULL;
+        if (!names) return ARC_NONE;
+        a->names = names; a->names_cap = cap;
+    }
+    uint32_t off = a->names_len;
+    memcpy(a->names + off, s, len);
+    a->names[off + len] = '\0';
+    a->names_len += len + 1;
+    return off;
+}
+
+size_t arc_slot(Archive *a, uint32_t parent, const char *name, size_t len) {
+    return (name_hash(name, len) ^ parent * 0x9e3779b97f4a7c15ULL) & (a->nslots - 1);
+}
+
+// Finds the child of parent called name, adding it as a directory when
+// create is set; returns ARC_NONE if there is none.
+uint32_t arc_child(Archive *a, uint32_t parent, const char *name, size_t len, int create) {
+    if ((a->nnodes + 1) * 2 > a->nslots) {
+        size_t n = a->nslots ? a->nslots * 2 : 1024;
+        uint32_t *slots = malloc(n * sizeof(uint32_t));
+        if (!slots) return ARC_NONE;
+        memset(slots, 0xff, n * sizeof(uint32_t));
+        free(a->slots);
+        a->slots = slots; a->nslots = n;
+        for (uint32_t i = 1; i < a->nnodes; i++) {
+            const char *s = a->names + a->nodes[i].name;
+            size_t j = arc_slot(a, a->nodes[i].parent, s, strlen(s));
+            while (slots[j] != ARC_NONE) j = (j + 1) & (n - 1);
+            slots[j] = i;
+        }
+    }
+    size_t j = arc_slot(a, parent, name, len);
+    for (; a->slots[j] != ARC_NONE; j = (j + 1) & (a->nslots - 1)) {
+        ArcNode *c = &a->nodes[a->slots[j]];
+        if (c->parent == parent && !strncmp(a->names + c->name, name, len) && !a->names[c->name + len]) return a->slots[j];
+    }
+    if (!create) return ARC_NONE;
+    if (a->nnodes == a->nodes_cap) {
+        uint32_t cap = a->nodes_cap ? a->nodes_cap * 2 : 1024;
+        ArcNode *nodes = realloc(a->nodes, cap * sizeof(ArcNode));
+        if (!nodes) return ARC_NONE;
+        a->nodes = nodes; a->nodes_cap = cap;
+    }
+    uint32_t off = arc_name(a, name, len);
+    if (off == ARC_NONE) return ARC_NONE;
+    a->nodes[a->nnodes] = (ArcNode){.name = off, .parent = parent, .size = -1, .mode = S_IFDIR | 0755};
+    a->slots[j] = a->nnodes;
+    return a->nnodes++;
+}
+
+// Returns the node of a member's path, adding it and the directories above
+// it; "." and ".." components are dropped. ARC_NONE if it names nothing.
+uint32_t arc_add(Archive *a, const char *path, size_t len, int create) {
+    uint32_t node = 0;
+    for (size_t i = 0; i < len;) {
+        size_t j = i;
+        while (j < len && path[j] != '/') j++;
+        int skip = j == i || (j - i == 1 && path[i] == '.') || (j - i == 2 && path[i] == '.' && path[i + 1] == '.');
+        if (!skip && (node = arc_child(a, node, path + i, j - i, create)) == ARC_NONE) return ARC_NONE;
+        i = j + 1;
+    }
+    return node ? node : ARC_NONE;
+}
+
+// Lays every node's children out as one range of kids.
+int arc_link(Archive *a) {
+    if (!(a->kids = calloc(a->nnodes, sizeof(uint32_t)))) return -1;
+    for (uint32_t i = 1; i < a->nnodes; i++) a->nodes[a->nodes[i].parent].count++;
+    uint32_t at = 0;
+    for (uint32_t i = 0; i < a->nnodes; i++) {
+        a->nodes[i].first = at;
+        at += a->nodes[i].count;
+        a->nodes[i].count = 0;
+    }
+    for (uint32_t i = 1; i < a->nnodes; i++) {
+        ArcNode *d = &a->nodes[a->nodes[i].parent];
+        a->kids[d->first + d->count++] = i;
+    }
+    return 0;
+}
+
+uint64_t le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    while (n--) v = v << 8 | p[n];
+    return v;
+}
+
+// Whether the archive's file changed since it was opened. Anything read
+// from a zip's mapping since may have come from the guard's zero pages.
+int arc_changed(Archive *a) {
+    struct stat st;
+    return fstat(a->fd, &st) != 0 || st.st_size != a->size || mtime_ns(&st) != a->mtime;
+}
+
+// Lists a zip from its central directory, read in place from the mapped
+// file; zip64 sizes and offsets are taken from their extra field. The
+// mapping stays guarded for as long as the archive is cached.
+int zip_index(Archive *a) {
+    if (a->size < 22) return -1;
+    const unsigned char *z = mmap(NULL, a->size, PROT_READ, MAP_SHARED, a->fd, 0);
+    if (z == MAP_FAILED) return -1;
+    map_guard(z, a->size);
+    a->zip = z;
+    size_t eocd = a->size - 22, stop = a->size > 65557 ? a->size - 65557 : 0;
+    while (le(z + eocd, 4) != 0x06054b50)
+        if (eocd-- == stop) return -1;
+    uint64_t count = le(z + eocd + 10, 2), cd = le(z + eocd + 16, 4);
+    if (eocd >= 20 && le(z + eocd - 20, 4) == 0x07064b50) {
+        uint64_t at = le(z + eocd - 12, 8);
+        if (a->size < 56 || at > (uint64_t)a->size - 56 || le(z + at, 4) != 0x06064b50) return -1;
+        count = le(z + at + 32, 8);
+        cd = le(z + at + 48, 8);
+    }
+    for (uint64_t i = 0, at = cd; i < count && !atomic_load(&a->cancel); i++) {
+        if (a->size < 46 || at > (uint64_t)a->size - 46 || le(z + at, 4) != 0x02014b50) return -1;
+        const unsigned char *h = z + at;
+        uint64_t csize = le(h + 20, 4), usize = le(h + 24, 4), local = le(h + 42, 4);
+        size_t nlen = le(h + 28, 2), xlen = le(h + 30, 2), clen = le(h + 32, 2);
+        if (at + 46 + nlen + xlen + clen > (uint64_t)a->size) return -1;
+        for (const unsigned char *x = h + 46 + nlen, *end = x + xlen; x + 4 <= end; x += 4 + le(x + 2, 2)) {
+            if (le(x, 2) != 1 || x + 4 + le(x + 2, 2) > end) continue;
+            const unsigned char *v = x + 4, *vend = x + 4 + le(x + 2, 2);
+            if (usize == 0xffffffff && v + 8 <= vend) { usize = le(v, 8); v += 8; }
+            if (csize == 0xffffffff && v + 8 <= vend) { csize = le(v, 8); v += 8; }
+            if (local == 0xffffffff && v + 8 <= vend) local = le(v, 8);
+        }
+        uint32_t k = arc_add(a, (const char *)h + 46, nlen, 1);
+        if (k != ARC_NONE && !(nlen && h[46 + nlen - 1] == '/')) {
+            ArcNode *n = &a->nodes[k];
+            unsigned date = le(h + 14, 2), time = le(h + 12, 2);
+            struct tm tm = {.tm_year = (date >> 9) + 80, .tm_mon = ((date >> 5) & 15) - 1, .tm_mday = date & 31,
+                .tm_hour = time >> 11, .tm_min = (time >> 5) & 63, .tm_sec = (time & 31) * 2, .tm_isdst = -1};
+            uint32_t mode = h[5] == 3 ? le(h + 38, 4) >> 16 : 0;
+            n->mode = S_IFREG | (mode & 0777 ? mode & 0777 : 0644);
+            n->size = usize;
+            n->csize = csize;
+            n->offset = local;
+            n->method = le(h + 10, 2);
+            n->mtime = mktime(&tm);
+            // A symlink stored by zip -y keeps its target as the contents.
+            uint64_t data = local + 30;
+            if (S_ISLNK(mode) && n->method == 0 && local < (uint64_t)a->size - 30 && le(z + local, 4) == 0x04034b50 &&
+                (data += le(z + local + 26, 2) + le(z + local + 28, 2)) + csize <= (uint64_t)a->size && csize < PATH_MAX_LEN) {
+                uint32_t link = arc_name(a, (const char *)z + data, csize);
+                if (link != ARC_NONE) { n->link = link; n->mode = S_IFLNK | 0777; n->size = 0; }
+            }
+        }
+        at += 46 + nlen + xlen + clen;
+        atomic_store(&a->scanned, at - cd);
+    }
+    return 0;
+}
+
+int tar_point(TarStream *s) {
+    Archive *a = s->a;
+    if (a->npoints == a->points_cap) {
+        uint32_t cap = a->points_cap ? a->points_cap * 2 : 64;
+        ArcPoint *points = realloc(a->points, cap * sizeof(ArcPoint));
+        if (!points) return -1;
+        a->points = points; a->points_cap = cap;
+    }
+    ArcPoint *pt = &a->points[a->npoints++];
+    pt->out = s->z.total_out;
+    pt->in = s->z.total_in;
+    pt->bits = s->z.data_type & 7;
+    pt->pad = 0;
+    size_t left = s->z.avail_out;
+    if (left) memcpy(pt->window, s->window + ARC_WINDOW - left, left);
+    if (left < ARC_WINDOW) memcpy(pt->window + left, s->window, ARC_WINDOW - left);
+    return 0;
+}
+
+// Reads n bytes into buf, or skips them when buf is NULL.
+int tar_pull(TarStream *s, unsigned char *buf, uint64_t n) {
+    Archive *a = s->a;
+    if (a->kind == ARC_TAR) {
+        if (buf && pread(a->fd, buf, n, s->pos) != (ssize_t)n) return -1;
+        if (!buf && s->pos + n > (uint64_t)a->size) return -1;
+        s->pos += n;
+        atomic_store(&a->scanned, s->pos);
+        return 0;
+    }
+    while (n) {
+        if (s->npending) {
+            size_t take = s->npending < n ? s->npending : n;
+            if (buf) { memcpy(buf, s->pending, take); buf += take; }
+            s->pending += take; s->npending -= take;
+            s->pos += take; n -= take;
+            continue;
+        }
+        if (s->end || atomic_load(&a->cancel)) return -1;
+        if (!s->z.avail_in) {
+            ssize_t got = read(a->fd, s->in, sizeof(s->in));
+            if (got <= 0) return -1;
+            s->z.next_in = s->in;
+            s->z.avail_in = got;
+            atomic_fetch_add(&a->scanned, got);
+        }
+        if (!s->z.avail_out) { s->z.next_out = s->window; s->z.avail_out = ARC_WINDOW; }
+        s->pending = s->z.next_out;
+        int ret = inflate(&s->z, Z_BLOCK);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return -1;
+        s->npending = s->z.next_out - s->pending;
+        s->end = ret == Z_STREAM_END;
+        uint64_t last = a->npoints ? a->points[a->npoints - 1].out : 0;
+        if ((s->z.data_type & 128) && !(s->z.data_type & 64) && (!a->npoints || s->z.total_out - last >= ARC_SPAN) &&
+            tar_point(s) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Parses a header number: octal, or base-256 when the top bit is set.
+int64_t tar_number(const unsigned char *p, int len) {
+    int64_t v = 0;
+    if (p[0] & 0x80) {
+        for (int i = 1; i < len; i++) v = v << 8 | p[i];
+        return v;
+    }
+    for (int i = 0; i < len && p[i]; i++)
+        if (p[i] >= '0' && p[i] <= '7') v = v * 8 + p[i] - '0';
+    return v;
+}
+
+// Reads a member's data (a long name or pax records) up to size - 1 bytes
+// and skips the rest with its padding.
+int tar_text(TarStream *s, int64_t len, char *out, size_t size) {
+    size_t take = (uint64_t)len < size ? (size_t)len : size - 1;
+    if (tar_pull(s, (unsigned char *)out, take) != 0) return -1;
+    out[take] = '\0';
+    return tar_pull(s, NULL, ((len + 511) & ~511) - take);
+}
+
+// Walks the headers once, recording each member's data offset. A plain tar
+// is read with pread and never touches member data; a compressed one has to
+// be inflated all the way, which is why its index is kept on disk.
+int tar_index(Archive *a) {
+    TarStream *s = calloc(1, sizeof(TarStream));
+    if (!s) return -1;
+    s->a = a;
+    if (a->kind == ARC_TGZ && inflateInit2(&s->z, 47) != Z_OK) { free(s); return -1; }
+    unsigned char h[512];
+    char name[PATH_MAX_LEN] = "", link[PATH_MAX_LEN] = "";
+    int64_t pax_size = -1;
+    int failed = 0;
+    while (!atomic_load(&a->cancel)) {
+        if (tar_pull(s, h, 512) != 0) { failed = s->pos != 512 * (s->pos / 512) || !s->pos; break; }
+        int zero = 1;
+        for (int i = 0; i < 512 && zero; i++) zero = !h[i];
+        if (zero) break;
+        int64_t sum = 0;
+        for (int i = 0; i < 512; i++) sum += i >= 148 && i < 156 ? ' ' : h[i];
+        if (sum != tar_number(h + 148, 8)) { failed = 1; break; }
+        int64_t size = pax_size >= 0 ? pax_size : tar_number(h + 124, 12);
+        int type = h[156];
+        if (type == 'L' || type == 'K') {
+            if (tar_text(s, size, type == 'L' ? name : link, PATH_MAX_LEN) != 0) { failed = 1; break; }
+            continue;
+        }
+        if (type == 'x') {
+            char *pax = s->pax;
+            if (tar_text(s, size, pax, sizeof(s->pax)) != 0) { failed = 1; break; }
+            for (char *r = pax; *r;) {
+                char *end;
+                long len = strtol(r, &end, 10);
+                if (len <= 0 || *end != ' ' || r + len > pax + strlen(pax)) break;
+                char *key = end + 1, *stop = r + len - 1;
+                if (!strncmp(key, "path=", 5)) snprintf(name, sizeof(name), "%.*s", (int)(stop - key - 5), key + 5);
+                else if (!strncmp(key, "linkpath=", 9)) snprintf(link, sizeof(link), "%.*s", (int)(stop - key - 9), key + 9);
+                else if (!strncmp(key, "size=", 5)) pax_size = strtoll(key + 5, NULL, 10);
+                r += len;
+            }
+            continue;
+        }
+        if (!name[0]) {
+            if (!memcmp(h + 257, "ustar", 5) && h[345])
+                snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+            else
+                snprintf(name, sizeof(name), "%.100s", (const char *)h);
+        }
+        if (!link[0]) snprintf(link, sizeof(link), "%.100s", (const char *)h + 157);
+        uint32_t k = type == 'g' ? ARC_NONE : arc_add(a, name, strlen(name), 1);
+        if (k != ARC_NONE && type != '5') {
+            ArcNode *n = &a->nodes[k];
+            uint32_t target = type == '1' ? arc_add(a, link, strlen(link), 0) : ARC_NONE;
+            n->mode = (type == '2' ? S_IFLNK : S_IFREG) | (tar_number(h + 100, 8) & 0777);
+            n->mtime = tar_number(h + 136, 12);
+            if (target != ARC_NONE && S_ISREG(a->nodes[target].mode)) {
+                n->offset = a->nodes[target].offset;
+                n->size = a->nodes[target].size;
+            } else {
+                n->offset = s->pos;
+                n->size = type == '2' || type == '1' ? 0 : size;
+            }
+            if (type == '2' && (n->link = arc_name(a, link, strlen(link))) == ARC_NONE) { failed = 1; break; }
+        } else if (k != ARC_NONE) {
+            a->nodes[k].mode = S_IFDIR | (tar_number(h + 100, 8) & 0777);
+            a->nodes[k].mtime = tar_number(h + 136, 12);
+        }
+        if (type != '1' && type != '2' && type != '5' && tar_pull(s, NULL, (size + 511) & ~511) != 0) { failed = 1; break; }
+        name[0] = link[0] = '\0';
+        pax_size = -1;
+    }
+    if (a->kind == ARC_TGZ) inflateEnd(&s->z);
+    free(s);
+    return failed || atomic_load(&a->cancel) ? -1 : 0;
+}
+
+int arc_write(Archive *a) {
+    char tmp[PATH_MAX_LEN + 8];
+    index_dir_create(a->file);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", a->file);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return -1;
+    ArcHeader hdr = {.dev = a->dev, .ino = a->ino, .size = a->size, .mtime = a->mtime,
+        .nnodes = a->nnodes, .names_len = a->names_len, .npoints = a->npoints};
+    memcpy(hdr.magic, ARC_MAGIC, sizeof(hdr.magic));
+    static const char zeros[8];
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+        fwrite(a->nodes, sizeof(ArcNode), a->nnodes, f) == a->nnodes &&
+        fwrite(a->kids, sizeof(uint32_t), a->nnodes, f) == a->nnodes &&
+        fwrite(a->names, 1, a->names_len, f) == a->names_len &&
+        fwrite(zeros, 1, -(a->nnodes * 4 + a->names_len) & 7, f) == (-(a->nnodes * 4 + a->names_len) & 7) &&
+        fwrite(a->points, sizeof(ArcPoint), a->npoints, f) == a->npoints;
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tmp, a->file) == 0) return 0;
+    unlink(tmp);
+    return -1;
+}
+
+// Maps the index of an unchanged tar; nothing is read until it is used.
+int arc_load(Archive *a) {
+    int fd = open(a->file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ArcHeader)) { close(fd); return -1; }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const ArcHeader *hdr = (const ArcHeader *)map;
+    size_t size = st.st_size, nodes = sizeof(ArcHeader), kids = nodes + hdr->nnodes * sizeof(ArcNode);
+    size_t names = kids + hdr->nnodes * sizeof(uint32_t), points = (names + hdr->names_len + 7) & ~(size_t)7;
+    int ok = !memcmp(hdr->magic, ARC_MAGIC, sizeof(hdr->magic)) && hdr->dev == (uint64_t)a->dev &&
+        hdr->ino == (uint64_t)a->ino && hdr->size == a->size && hdr->mtime == a->mtime &&
+        hdr->nnodes && hdr->nnodes < UINT32_MAX / sizeof(ArcNode) && hdr->names_len < size &&
+        hdr->npoints <= size / sizeof(ArcPoint) && points + hdr->npoints * sizeof(ArcPoint) == size &&
+        map[names + hdr->names_len - 1] == '\0';
+    const ArcNode *n = (const ArcNode *)(map + nodes);
+    for (uint64_t i = 0; ok && i < hdr->nnodes; i++)
+        ok = n[i].name < hdr->names_len && (!i || n[i].parent < hdr->nnodes) &&
+             n[i].first <= hdr->nnodes && n[i].count <= hdr->nnodes - n[i].first && n[i].link < hdr->names_len;
+    const uint32_t *k = (const uint32_t *)(map + kids);
+    for (uint64_t i = 0; ok && i + 1 < hdr->nnodes; i++) ok = k[i] < hdr->nnodes;
+    if (!ok) { munmap(map, size); return -1; }
+    a->map = map;
+    a->map_len = size;
+    a->nodes = (ArcNode *)(map + nodes);
+    a->nnodes = hdr->nnodes;
+    a->kids = (uint32_t *)(map + kids);
+    a->names = map + names;
+    a->names_len = hdr->names_len;
+    a->points = (ArcPoint *)(map + points);
+    a->npoints = hdr->npoints;
+    return 0;
+}
+
+void *arc_indexer(void *arg) {
+    Archive *a = arg;
+    a->nodes_cap = 1024;
+    a->failed = !(a->nodes = malloc(a->nodes_cap * sizeof(ArcNode))) || arc_name(a, "", 0) != 0;
+    if (!a->failed) {
+        a->nodes[0] = (ArcNode){.parent = ARC_NONE, .size = -1, .mode = S_IFDIR | 0755};
+        a->nnodes = 1;
+        a->failed = (a->kind == ARC_ZIP ? zip_index(a) != 0 || arc_changed(a) : tar_index(a) != 0) || atomic_load(&a->cancel) || arc_link(a) != 0;
+    }
+    free(a->slots);
+    a->slots = NULL;
+    if (!a->failed && a->kind != ARC_ZIP && a->file[0]) arc_write(a);
+    atomic_store(&a->done, 1);
+    return NULL;
+}
+
+Archive *archives[ARC_CACHE];
+
+void arc_free(Archive *a) {
+    if (!a) return;
+    vfs_unmount(&a->vfs);
+    atomic_store(&a->cancel, 1);
+    if (a->threaded) pthread_join(a->thread, NULL);
+    if (a->z_live) inflateEnd(&a->z);
+    if (a->map) {
+        munmap(a->map, a->map_len);
+    } else {
+        free(a->nodes); free(a->kids); free(a->names); free(a->points);
+    }
+    if (a->zip) {
+        map_unguard(a->zip);
+        munmap((void *)a->zip, a->size);
+    }
+    close(a->fd);
+    free(a);
+}
+
+// Returns the archive at path, from the cache while the file is unchanged.
+// A tar whose index on disk still matches is mapped at once; anything else
+// is indexed on a thread.
+Archive *arc_get(const char *path) {
+    struct stat st;
+    int kind = archive_kind(path);
+    if (kind < 0 || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+    int slot = -1;
+    for (int i = 0; i < ARC_CACHE; i++) {
+        Archive *a = archives[i];
+        if (a && !strcmp(a->path, path) && a->dev == st.st_dev && a->ino == st.st_ino && a->size == st.st_size &&
+            a->mtime == mtime_ns(&st) && !(atomic_load(&a->done) && a->failed))
+            return a;
+        if (!a) slot = i;
+        else if (!a->users && (slot < 0 || archives[slot])) slot = i;
+    }
+    if (slot < 0) return NULL;
+    Archive *a = calloc(1, sizeof(Archive));
+    if (!a) return NULL;
+    if ((a->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) { free(a); return NULL; }
+    arc_free(archives[slot]);
+    archives[slot] = a;
+    snprintf(a->path, sizeof(a->path), "%s", path);
+    a->kind = kind;
+    a->dev = st.st_dev;
+    a->ino = st.st_ino;
+    a->size = st.st_size;
+    a->mtime = mtime_ns(&st);
+    if (kind != ARC_ZIP && index_file(path, "archive", a->file, sizeof(a->file)) == 0 && arc_load(a) == 0) {
+        atomic_store(&a->done, 1);
+    } else if (pthread_create(&a->thread, NULL, arc_indexer, a) == 0) {
+        a->threaded = 1;
+    } else {
+        a->failed = 1;
+        atomic_store(&a->done, 1);
+    }
+    return a;
+}
+
+int write_all(int fd, const void *buf, size_t n) {
+    for (const char *p = buf; n;) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w; n -= w;
+    }
+    return 0;
+}
+
+// Copies count bytes of a compressed tar's stream from off to fd. Inflate
+// carries on from where the last copy stopped when that is no further back
+// than the nearest access point before off, so the members of a directory
+// come out in one pass.
+int tgz_copy(Archive *a, uint64_t off, uint64_t count, int fd) {
+    uint32_t lo = 0, hi = a->npoints;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (a->points[mid].out <= off) lo = mid + 1; else hi = mid;
+    }
+    if (!lo) return -1;
+    const ArcPoint *pt = &a->points[lo - 1];
+    if (!a->z_live || a->z_out > off || a->z_out < pt->out) {
+        if (a->z_live) inflateEnd(&a->z);
+        memset(&a->z, 0, sizeof(a->z));
+        if (inflateInit2(&a->z, -15) != Z_OK) return -1;
+        a->z_live = 1;
+        a->z_at = pt->in - (pt->bits ? 1 : 0);
+        if (pt->bits) {
+            unsigned char c;
+            if (pread(a->fd, &c, 1, a->z_at++) != 1) goto fail;
+            inflatePrime(&a->z, pt->bits, c >> (8 - pt->bits));
+        }
+        inflateSetDictionary(&a->z, pt->window, ARC_WINDOW);
+        a->z_out = pt->out;
+    }
+    unsigned char buf[65536];
+    while (count) {
+        if (!a->z.avail_in) {
+            ssize_t got = pread(a->fd, a->z_in, sizeof(a->z_in), a->z_at);
+            if (got <= 0) goto fail;
+            a->z_at += got;
+            a->z.next_in = a->z_in;
+            a->z.avail_in = got;
+        }
+        uint64_t skip = off - a->z_out, want = skip ? skip : count;
+        a->z.next_out = buf;
+        a->z.avail_out = want < sizeof(buf) ? want : sizeof(buf);
+        size_t room = a->z.avail_out;
+        int ret = inflate(&a->z, Z_NO_FLUSH);
+        size_t got = room - a->z.avail_out;
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || (ret == Z_BUF_ERROR && !got)) goto fail;
+        a->z_out += got;
+        if (!skip) {
+            if (write_all(fd, buf, got) != 0) goto fail;
+            off += got;
+            count -= got;
+        }
+        if (ret == Z_STREAM_END) {
+            inflateEnd(&a->z);
+            a->z_live = 0;
+            return count ? -1 : 0;
+        }
+    }
+    return 0;
+fail:
+    inflateEnd(&a->z);
+    a->z_live = 0;
+    return -1;
+}
+
+// Writes a zip member's contents to fd straight from the mapping,
+// inflated if need be.
+int zip_data(Archive *a, const ArcNode *n, int fd) {
+    const unsigned char *z = a->zip, *h = z + n->offset;
+    if (n->offset > (uint64_t)a->size - 30 || le(h, 4) != 0x04034b50) return -1;
+    uint64_t start = n->offset + 30 + le(h + 26, 2) + le(h + 28, 2);
+    if (start > (uint64_t)a->size || n->csize > a->size - start) return -1;
+    if (n->method == 0) return n->csize == (uint64_t)n->size ? write_all(fd, z + start, n->size) : -1;
+    if (n->method != 8) return -1;
+    z_stream s = {0};
+    if (inflateInit2(&s, -15) != Z_OK) return -1;
+    unsigned char buf[65536];
+    const unsigned char *in = z + start;
+    uint64_t left = n->csize, total = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        if (!s.avail_in && left) {
+            s.next_in = (unsigned char *)in;
+            s.avail_in = left < (1u << 30) ? left : (1u << 30);
+            in += s.avail_in; left -= s.avail_in;
+        }
+        s.next_out = buf;
+        s.avail_out = sizeof(buf);
+        ret = inflate(&s, Z_NO_FLUSH);
+        size_t got = sizeof(buf) - s.avail_out;
+        if ((ret != Z_OK && ret != Z_STREAM_END && !(ret == Z_BUF_ERROR && got)) || write_all(fd, buf, got) != 0) break;
+        total += got;
+    }
+    inflateEnd(&s);
+    return ret == Z_STREAM_END && total == (uint64_t)n->size ? 0 : -1;
+}
+
+// Writes a member's contents to fd: a zip's from the mapping, failing if
+// the file changed meanwhile; a tar's from its recorded offset.
+int arc_data(Archive *a, const ArcNode *n, int fd) {
+    if (a->kind == ARC_TGZ) return tgz_copy(a, n->offset, n->size, fd);
+    if (a->kind == ARC_ZIP) return zip_data(a, n, fd) == 0 && !arc_changed(a) ? 0 : -1;
+    unsigned char buf[65536];
+    for (int64_t done = 0; done < n->size;) {
+        size_t want = n->size - done < (int64_t)sizeof(buf) ? (size_t)(n->size - done) : sizeof(buf);
+        ssize_t got = pread(a->fd, buf, want, n->offset + done);
+        if (got <= 0 || write_all(fd, buf, got) != 0) return -1;
+        done += got;
+    }
+    return 0;
+}
+
+// Extracts a member to dst; a directory with everything below it.
+int arc_extract(Archive *a, uint32_t k, const char *dst) {
+    const ArcNode *n = &a->nodes[k];
+    if (S_ISDIR(n->mode)) {
+        if (mkdir(dst, 0700) != 0 && errno != EEXIST) return -1;
+        char sub[PATH_MAX_LEN];
+        int failed = 0;
+        for (uint32_t i = 0; i < n->count; i++) {
+            uint32_t c = a->kids[n->first + i];
+            snprintf(sub, sizeof(sub), "%s/%s", dst, a->names + a->nodes[c].name);
+            failed |= arc_extract(a, c, sub) != 0;
+        }
+        chmod(dst, n->mode & 07777);
+        return failed ? -1 : 0;
+    }
+    if (S_ISLNK(n->mode)) return symlink(a->names + n->link, dst);
+    int fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, n->mode & 0777);
+    if (fd < 0) return -1;
+    int ok = arc_data(a, n, fd) == 0;
+    struct timespec times[2] = {{n->mtime, 0}, {n->mtime, 0}};
+    futimens(fd, times);
+    ok = close(fd) == 0 && ok;
+    if (!ok) unlink(dst);
+    return ok ? 0 : -1;
+}
+
+// Finds a member by its path below the archive's root.
+uint32_t arc_lookup(Archive *a, const char *rel) {
+    uint32_t node = 0;
+    while (*rel && node != ARC_NONE) {
+        const char *end = strchrnul(rel, '/');
+        const ArcNode *d = &a->nodes[node];
+        node = ARC_NONE;
+        for (uint32_t i = 0; i < d->count; i++) {
+            uint32_t c = a->kids[d->first + i];
+            const char *name = a->names + a->nodes[c].name;
+            if (!strncmp(name, rel, end - rel) && !name[end - rel]) { node = c; break; }
+        }
+        rel = *end ? end + 1 : end;
+    }
+    return node;
+}
+
+void arc_path(Archive *a, uint32_t k, char *buf, size_t size) {
+    if (!k) { snprintf(buf, size, "%s", a->path); return; }
+    arc_path(a, a->nodes[k].parent, buf, size);
+    size_t len = strlen(buf);
+    snprintf(buf + len, size - len, "/%s", a->names + a->nodes[k].name);
+}
+
+// The member at path, which lies in or below the archive's own path.
+uint32_t arc_member(Archive *a, const char *path) {
+    size_t len = strlen(a->path);
+    if (!atomic_load(&a->done) || a->failed || strncmp(path, a->path, len) || (path[len] && path[len] != '/'))
+        return ARC_NONE;
+    return arc_lookup(a, path[len] ? path + len + 1 : path + len);
+}
+
+void *arc_open_dir(Vfs *fs, const char *path) {
+    Archive *a = fs->ctx;
+    uint32_t k = arc_member(a, path);
+    ArcDir *d = k != ARC_NONE && S_ISDIR(a->nodes[k].mode) ? malloc(sizeof(ArcDir)) : NULL;
+    if (d) *d = (ArcDir){k, 0};
+    return d;
+}
+
+// Lists ".." first, as the node above (ARC_NONE at the root), then the
+// members with their modes and sizes from the index.
+int arc_read_batch(Vfs *fs, void *dir, VfsEntry *out, int max) {
+    Archive *a = fs->ctx;
+    ArcDir *d = dir;
+    const ArcNode *n = &a->nodes[d->node];
+    int got = 0;
+    for (; got < max && d->next <= n->count; d->next++) {
+        uint32_t c = d->next ? a->kids[n->first + d->next - 1] : n->parent;
+        const char *name = d->next ? a->names + a->nodes[c].name : "..";
+        out[got++] = (VfsEntry){.name = name, .name_len = strlen(name), .mode = d->next ? a->nodes[c].mode : S_IFDIR,
+            .size = d->next ? a->nodes[c].size : -1, .node = c};
+    }
+    return got;
+}
+
+void arc_close_dir(Vfs *fs, void *dir) {
+    free(dir);
+}
+
+int arc_stat(Vfs *fs, const char *path, VfsEntry *out) {
+    Archive *a = fs->ctx;
+    uint32_t k = arc_member(a, path);
+    if (k == ARC_NONE) return -1;
+    *out = (VfsEntry){.name = a->names + a->nodes[k].name, .name_len = strlen(a->names + a->nodes[k].name),
+        .mode = a->nodes[k].mode, .size = a->nodes[k].size, .node = k};
+    return 0;
+}
+
+int arc_get_member(Vfs *fs, const char *path, const char *local) {
+    Archive *a = fs->ctx;
+    uint32_t k = arc_member(a, path);
+    return k == ARC_NONE ? -1 : arc_extract(a, k, local);
+}
+
+const VfsOps arc_ops = {
+    .caps = VFS_STATS,
+    .open_dir = arc_open_dir,
+    .read_batch = arc_read_batch,
+    .close_dir = arc_close_dir,
+    .stat = arc_stat,
+    .get = arc_get_member,
+};
+
+void arc_enter(Panel *p, uint32_t node) {
+    uint32_t from = p->arc_dir;
+    clear_filter(p);
+    p->arc_dir = node;
+    arc_path(p->arc, node, p->cwd, sizeof(p->cwd));
+    p->selected = p->scroll_offset = 0;
+    free_panel(p); list_dir(p);
+    for (int i = 0; i < p->count; i++)
+        if (p->entries[i].node == from && strcmp(p->entries[i].name, "..")) { p->selected = i; break; }
+}
+
+// Shows an archive in the panel as a read-only directory, once indexed.
+int arc_open(Panel *p, const char *path) {
+    Archive *a = arc_get(path);
+    if (!a) return -1;
+    size_cancel(p);
+    find_stop(p);
+    dup_stop(p);
+    clear_filter(p);
+    p->du_active = 0;
+    if (!a->vfs.ops) {
+        a->vfs = (Vfs){&arc_ops, a, a->path};
+        vfs_mount(&a->vfs);
+    }
+    a->users++;
+    p->arc = a;
+    p->vfs = &a->vfs;
+    p->arc_dir = ARC_NONE;
+    snprintf(p->cwd, sizeof(p->cwd), "%s", a->path);
+    arena_reset(&p->names);
+    p->count = p->marked = 0;
+    p->selected = p->scroll_offset = 0;
+    if (atomic_load(&a->done) && !a->failed) arc_enter(p, 0);
+    return 0;
+}
+
+// Returns to the directory holding the archive, with the archive selected.
+void arc_leave(Panel *p) {
+    Archive *a = p->arc;
+    if (!a) return;
+    a->users--;
+    p->arc = NULL;
+    p->vfs = &vfs_local;
+    clear_filter(p);
+    snprintf(p->cwd, sizeof(p->cwd), "%s", a->path);
+    char *slash = strrchr(p->cwd, '/');
+    if (slash == p->cwd) slash[1] = '\0';
+    else *slash = '\0';
+    free_panel(p); list_dir(p);
+    p->selected = p->scroll_offset = 0;
+    const char *base = strrchr(a->path, '/') + 1;
+    for (int i = 0; i < p->count; i++)
+        if (!strcmp(p->entries[i].name, base)) { p->selected = i; break; }
+}
+
+// Shows the archive's root once indexing is over; returns 1 while it runs
+// and -1 when the archive could not be read.
+int arc_update(Panel *p) {
+    Archive *a = p->arc;
+    if (!a || p->arc_dir != ARC_NONE) return 0;
+    if (!atomic_load(&a->done)) return 1;
+    if (a->threaded) { pthread_join(a->thread, NULL); a->threaded = 0; }
+    if (a->failed) { arc_leave(p); return -1; }
+    arc_enter(p, 0);
+    return 0;
+}
+
+// Re-reads the panel after a change on disk; in disk-usage mode the current
+// directory's subtree is scanned again.
+void reload_panel(Panel *p) {
+    if (p->dups) {
+        dup_prune(p);
+    } else if (p->arc) {
+        if (p->arc_dir != ARC_NONE) { free_panel(p); list_dir(p); }
+    } else if (p->find) {
+        find_prune(p);
+    } else if (p->du_active) {
+        du_refresh(p->du, p->du_dir);
+        du_fill(p);
+    } else {
+        if (p->vfs->ops->forget) p->vfs->ops->forget(p->vfs, p->cwd);
+        free_panel(p); list_dir(p);
+    }
+}
+
+// Results of a content search stand in for the listing; only the rows on
+// screen are formatted, however many hits there are.
+void draw_grep(WINDOW *win, Panel *panel, int active) {
+    GrepJob *job = panel->grep;
+    werase(win); box(win,0,0);
+    int h,w; getmaxyx(win,h,w);
+    char line[PATH_MAX_LEN + GREP_TEXT + 64];
+    int rows = panel_rows(panel);
+    char via[64] = "";
+    if (job->indexed) snprintf(via,sizeof(via)," of %ld indexed candidates",job->candidates);
+    snprintf(line,sizeof(line),"[ %s in %s | %d hits, %ld files%s%s ]",job->text,job->root,rows,
+        atomic_load(&job->scanned),via,job->done?"":", searching");
+    mvwaddnstr(win,0,2,line,w-4);
+    int list_h = h-2;
+    if (panel->selected >= rows) panel->selected = rows ? rows - 1 : 0;
+    if (panel->selected < panel->scroll_offset) panel->scroll_offset = panel->selected;
+    if (panel->selected >= panel->scroll_offset + list_h) panel->scroll_offset = panel->selected - list_h + 1;
+    pthread_mutex_lock(&job->lock);
+    for (int i=0;i<list_h;i++) {
+        int idx = panel->scroll_offset + i;
+        if (idx >= rows) break;
+        GrepHit *g = &job->hits[idx];
+        if (idx == panel->selected) wattron(win,A_REVERSE | (active?A_BOLD:0));
+        snprintf(line,sizeof(line),"%s:%ld: %.*s",job->files[g->file],g->line,(int)g->len,g->text);
+        mvwprintw(win,i+1,1,"%-*.*s",w-2,w-2,line);
+        if (idx == panel->selected) wattroff(win,A_REVERSE | (active?A_BOLD:0));
+    }
+    pthread_mutex_unlock(&job->lock);
+    wnoutrefresh(win);
+}
+
+void draw_panel(WINDOW *win, Panel *panel, int active) {
+    if (panel->grep) { draw_grep(win, panel, active); return; }
+    werase(win); box(win,0,0);
+    int h,w; getmaxyx(win,h,w);
+    char line[PATH_MAX_LEN + FILTER_MAX + 64];
+    if (panel->filtered) {
+        snprintf(line,sizeof(line),"[ %s | %s (%d/%d) ]",panel->cwd,panel->filter,panel->view_count,panel->count);
+    } else if (panel->find && panel->find->indexed && name_index) {
+        snprintf(line,sizeof(line),"[ %s | find %s: %d from index, %ld/%llu dirs stale%s, %ld changes ]",panel->cwd,
+            panel->find->text,panel->count,atomic_load(&name_index->stale),(unsigned long long)name_index->hdr->ndirs,
+            atomic_load(&name_index->checked) + 1 < (long)name_index->hdr->ndirs ? " so far" : "",name_index->changes);
+    } else if (panel->find) {
+        snprintf(line,sizeof(line),"[ %s | find %s: %d in %ld dirs%s ]",panel->cwd,panel->find->text,panel->count,
+            atomic_load(&panel->find->dirs),panel->find->done?"":", searching");
+    } else if (panel->dups && panel->dups->applied) {
+        char bytes[24];
+        format_size(panel->dups->reclaimable, bytes, sizeof(bytes));
+        snprintf(line,sizeof(line),"[ %s | duplicates: %ld sets, %d files, %s reclaimable ]",panel->cwd,
+            panel->dups->sets,panel->count,bytes);
+    } else if (panel->dups) {
+        DupJob *job = panel->dups;
+        int stage = atomic_load(&job->stage);
+        if (!stage)
+            snprintf(line,sizeof(line),"[ %s | duplicates: %ld files scanned ]",panel->cwd,atomic_load(&job->scanned));
+        else
+            snprintf(line,sizeof(line),"[ %s | duplicates: %s %ld of %zu files, %lld MB read ]",panel->cwd,
+                stage == 1 ? "reading the ends of" : "hashing",atomic_load(&job->hashed),job->nfiles,atomic_load(&job->bytes) >> 20);
+    } else if (panel->arc && panel->arc_dir == ARC_NONE) {
+        snprintf(line,sizeof(line),"[ %s | indexing, %lld of %lld MB read ]",panel->cwd,
+            atomic_load(&panel->arc->scanned) >> 20,(long long)panel->arc->size >> 20);
+    } else if (panel->arc) {
+        snprintf(line,sizeof(line),"[ %s | archive, %u entries ]",panel->cwd,panel->arc->nnodes - 1);
+    } else if (panel->du_active) {
+        char total[24];
+        format_size(du_node(panel->du, panel->du_dir)->size, total, sizeof(total));
+        snprintf(line,sizeof(line),"[ %s | usage %s%s ]",panel->cwd,total,panel->du->npending?", scanning":"");
+    } else
+        snprintf(line,sizeof(line),"[ %s ]",panel->cwd);
+    mvwaddnstr(win,0,2,line,w-4);
+    int list_h = h-2;
+    int rows = panel_rows(panel);
+    if (panel->selected >= rows) panel->selected = rows ? rows - 1 : 0;
+    if (panel->selected < panel->scroll_offset) panel->scroll_offset = panel->selected;
+    if (panel->selected >= panel->scroll_offset + list_h) panel->scroll_offset = panel->selected - list_h + 1;
+    for (int i=0;i<list_h;i++) {
+        int idx = panel->scroll_offset + i;
+        if (idx >= rows) break;
+        Entry *e = panel_entry(panel, idx);
+        if (idx == panel->selected) wattron(win,A_REVERSE | (active?A_BOLD:0));
+        const char *icon = "";
+        switch(e->type) {
+            case TYPE_FOLDER: icon = "[DIR]"; break;
+            case TYPE_TEXT: icon = "[TXT]"; break;
+            case TYPE_EXEC: icon = "[EXE]"; break;
+            case TYPE_IMAGE: icon = "[IMG]"; break;
+            case TYPE_VIDEO: icon = "[VID]"; break;
+            default: icon = "[OTH]"; break;
+        }
+        char set[16];
+        if (panel->dups) { snprintf(set, sizeof(set), "#%u", e->set); icon = set; }
+        if (e->marked) wattron(win,A_BOLD);
+        char size[24] = "";
+        if (e->size >= 0) {
+            size[0] = e->sizing ? '~' : ' ';
+            format_size(e->size, size + 1, sizeof(size) - 1);
+        }
+        int name_w = w - 2 - 8;
+        snprintf(line,sizeof(line),"%-6s%c%s%s",icon,e->marked?'*':' ',e->type==TYPE_FOLDER?"/":"",e->name);
+        mvwprintw(win,i+1,1,"%-*.*s%8s",name_w,name_w,line,size);
+        if (e->marked) wattroff(win,A_BOLD);
+        if (idx == panel->selected) wattroff(win,A_REVERSE | (active?A_BOLD:0));
+    }
+    wnoutrefresh(win);
+}
+
+void draw_terminal(WINDOW *win, char *input, const char *status, const char *prompt, const char *prompt_buf) {
+    werase(win); box(win,0,0);
+    mvwaddnstr(win,0,2,"[ Terminal | F1: Copy | F2: Paste | F3: Rename | F4: Filter | F5: Delete | F6: Pattern | F7: Mark | F8/^Space: Sizes | F9: Usage | ^R: Rescan | ^F: Find | ^N: Find name | ^B/^X: Index names/contents | ^P/^E: Compare/deep | ^U: Sync | ^D/^L: Duplicates/link | ^T: Filter on/off | ^G: Go to % | ^K: SFTP | ^O: Shell | ^V: Shell output | ^W: Messages | ^A: Latency | ^Y: Follow shell cd | !cmd: Full screen | q: Quit ]",getmaxx(win)-4);
+    int h = getmaxy(win);
+    if (prompt)
+        mvwprintw(win,h-2,1,"%s%s", prompt, prompt_buf);
+    else
+        mvwprintw(win,h-2,1,"> %s", input);
+    if (status) mvwprintw(win,h-1,1,"%s", status);
+    wnoutrefresh(win);
+}
+
+Shell *shell;
+
+// Starts bash in cwd on a new terminal of the shell's size. TERM=dumb and
+// PAGER=cat keep programs from drawing screens the pane cannot show. The
+// startup file comes through a pipe: it reads the user's own, then puts
+// the prompt hook first in PROMPT_COMMAND, where it sees every $?, and
+// keeps the cd that follows the panel out of the history. bash is started
+// with posix_spawn in a session of its own; the terminal it opens as its
+// stdin becomes its controlling one. Nothing runs between fork and exec,
+// where another thread's locks would be held for good.
+int shell_spawn(Shell *s, const char *cwd) {
+    int rc[2];
+    char text[1024], file[32], tty[64];
+    s->fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (s->fd < 0) return -1;
+    if (grantpt(s->fd) != 0 || unlockpt(s->fd) != 0 || ptsname_r(s->fd, tty, sizeof(tty)) != 0 || pipe2(rc, O_CLOEXEC) != 0) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    int len = snprintf(text, sizeof(text),
+        "[ -f ~/.bashrc ] && . ~/.bashrc\n"
+        "exec %d<&-\n"
+        "__mycommander_prompt() { local s=$?; printf '\\033]" SHELL_MARK "%%d;%%s\\007' \"$s\" \"$PWD\"; return $s; }\n"
+        "PROMPT_COMMAND=\"__mycommander_prompt${PROMPT_COMMAND:+;$PROMPT_COMMAND}\"\n"
+        "__mycommander_cd() { builtin cd -- \"$1\"; }\n"
+        "HISTIGNORE=\"${HISTIGNORE:+$HISTIGNORE:}__mycommander_cd *\"\n", rc[0]);
+    int ok = write_all(rc[1], text, len) == 0;
+    close(rc[1]);
+    snprintf(file, sizeof(file), "/dev/fd/%d", rc[0]);
+    struct winsize ws = {.ws_row = s->rows, .ws_col = s->cols};
+    ioctl(s->fd, TIOCSWINSZ, &ws);
+    size_t n = 0, k = 0;
+    while (environ[n]) n++;
+    char **envp = malloc((n + 3) * sizeof(char *));
+    for (size_t i = 0; envp && i < n; i++)
+        if (strncmp(environ[i], "TERM=", 5) && strncmp(environ[i], "PAGER=", 6)) envp[k++] = environ[i];
+    if (envp) { envp[k++] = "TERM=dumb"; envp[k++] = "PAGER=cat"; envp[k] = NULL; }
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    posix_spawn_file_actions_addchdir_np(&fa, access(cwd, X_OK) == 0 ? cwd : "/");
+    posix_spawn_file_actions_addopen(&fa, 0, tty, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&fa, 0, 1);
+    posix_spawn_file_actions_adddup2(&fa, 0, 2);
+    posix_spawn_file_actions_adddup2(&fa, rc[0], rc[0]);   // the same fd: only drops close-on-exec
+    char *argv[] = {"bash", "--noediting", "--rcfile", file, "-i", NULL};
+    pid_t pid;
+    if (!ok || !envp || posix_spawnp(&pid, argv[0], &fa, &attr, argv, envp) != 0) pid = -1;
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    close(rc[0]);
+    if (pid < 0) { close(s->fd); s->fd = -1; return -1; }
+    s->pid = pid;
+    s->busy = 1;        // until the first prompt
+    s->status = 0;
+    snprintf(s->cwd, sizeof(s->cwd), "%s", cwd);
+    fcntl(s->fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+Shell *shell_open(int rows, int cols) {
+    Shell *s = calloc(1, sizeof(Shell));
+    if (!s) return NULL;
+    s->fd = -1;
+    s->rows = rows > 0 ? rows : 1;
+    s->cols = cols > 0 && cols < SHELL_COLS ? cols : SHELL_COLS;
+    const char *tmp = getenv("TMPDIR");
+    snprintf(s->log_path, sizeof(s->log_path), "%s/mycommander-shell-XXXXXX", tmp && tmp[0] ? tmp : "/tmp");
+    s->log = mkostemp(s->log_path, O_CLOEXEC);
+    return s;
+}
+
+// Writes out the lines collected for the log. If the log cannot take
+// them it is given up; the ring still has the newest.
+void shell_flush(Shell *s) {
+    if (s->log >= 0 && s->spill_len && write_all(s->log, s->spill, s->spill_len) != 0) {
+        close(s->log);
+        unlink(s->log_path);
+        s->log = -1;
+    }
+    if (s->log >= 0) s->log_size += s->spill_len;
+    s->spill_len = 0;
+}
+
+// Hangs up bash and whatever it runs, without waiting for them: this is
+// only done on the way out.
+void shell_close(Shell *s) {
+    if (!s) return;
+    if (s->fd >= 0) {
+        close(s->fd);
+        kill(-s->pid, SIGHUP);
+    }
+    if (s->log >= 0) {
+        close(s->log);
+        unlink(s->log_path);
+    }
+    for (int i = 0; i < SHELL_LINES; i++) free(s->lines[i].text);
+    free(s->queued);
+    free(s);
+}
+
+void shell_resize(Shell *s, int rows, int cols) {
+    if (rows < 1) rows = 1;
+    if (cols < 1 || cols > SHELL_COLS) cols = SHELL_COLS;
+    if (rows == s->rows && cols == s->cols) return;
+    s->rows = rows;
+    s->cols = cols;
+    struct winsize ws = {.ws_row = rows, .ws_col = cols};
+    if (s->fd >= 0) ioctl(s->fd, TIOCSWINSZ, &ws);
+}
+
+// Moves the current line into the ring and the log. The oldest lines make
+// room when the ring is out of lines or over SHELL_MEMORY.
+void shell_newline(Shell *s) {
+    if (s->log >= 0) {
+        if (s->spill_len + s->cur_len + 1 > SHELL_SPILL) shell_flush(s);
+        memcpy(s->spill + s->spill_len, s->cur, s->cur_len);
+        s->spill_len += s->cur_len;
+        s->spill[s->spill_len++] = '\n';
+    }
+    while (s->count && (s->count == SHELL_LINES || s->bytes + s->cur_len > SHELL_MEMORY)) {
+        ShellLine *old = &s->lines[s->head];
+        s->bytes -= old->len;
+        free(old->text);
+        old->text = NULL;
+        old->len = 0;
+        s->head = (s->head + 1) % SHELL_LINES;
+        s->count--;
+    }
+    ShellLine *l = &s->lines[(s->head + s->count++) % SHELL_LINES];
+    l->text = s->cur_len ? malloc(s->cur_len) : NULL;
+    l->len = l->text ? s->cur_len : 0;
+    if (l->text) memcpy(l->text, s->cur, s->cur_len);
+    s->bytes += l->len;
+    s->cur_len = s->col = 0;
+    if (s->scroll && s->scroll < s->count) s->scroll++;
+}
+
+void shell_put(Shell *s, char c) {
+    if (s->col >= s->cols) shell_newline(s);
+    while (s->cur_len < s->col) s->cur[s->cur_len++] = ' ';
+    s->cur[s->col++] = c;
+    if (s->col > s->cur_len) s->cur_len = s->col;
+}
+
+// A control string has ended; bash's own tells that it is at its prompt.
+// After a cd sent ahead of a line, that line goes now, or is dropped if
+// the cd failed.
+void shell_control(Shell *s) {
+    s->osc[s->osc_len] = '\0';
+    if (strncmp(s->osc, SHELL_MARK, strlen(SHELL_MARK))) return;
+    char *end, *status = s->osc + strlen(SHELL_MARK);
+    s->status = strtol(status, &end, 10);
+    if (*end == ';') snprintf(s->cwd, sizeof(s->cwd), "%s", end + 1);
+    if (s->queued) {
+        int sent = s->status == 0 && write_all(s->fd, s->queued, s->queued_len) == 0;
+        free(s->queued);
+        s->queued = NULL;
+        s->queued_len = 0;
+        if (sent) return;
+    }
+    if (s->busy) s->done = 1;
+    s->busy = 0;
+}
+
+void shell_feed(Shell *s, const unsigned char *buf, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = buf[i];
+        switch (s->esc) {
+        case ESC_NONE:
+            if (c == 27) s->esc = ESC_START;
+            else if (c == '\n') shell_newline(s);
+            else if (c == '\r') s->col = 0;
+            else if (c == '\b') { if (s->col) s->col--; }
+            else if (c == '\t') s->col = (s->col / 8 + 1) * 8 < s->cols ? (s->col / 8 + 1) * 8 : s->cols - 1;
+            else if (c >= ' ' && c != 127) shell_put(s, c);
+            break;
+        case ESC_START:
+            s->param = 0;
+            if (c == '[') s->esc = ESC_CSI;
+            else if (c == ']' || c == 'P' || c == '_' || c == '^') { s->esc = ESC_STRING; s->osc_len = 0; }
+            else if (c == '(' || c == ')') s->esc = ESC_CHARSET;
+            else s->esc = ESC_NONE;
+            break;
+        case ESC_CHARSET:
+            s->esc = ESC_NONE;
+            break;
+        case ESC_CSI:
+            if (c >= '0' && c <= '9') {
+                s->param = s->param * 10 + c - '0';
+            } else if (c >= 0x40 && c <= 0x7e) {
+                if (c == 'K' && s->param == 0 && s->col < s->cur_len) s->cur_len = s->col;
+                if (c == 'K' && s->param == 2) s->cur_len = 0;
+                s->esc = ESC_NONE;
+            }
+            break;
+        case ESC_STRING:
+            if (c == 7) { shell_control(s); s->esc = ESC_NONE; }
+            else if (c == 27) s->esc = ESC_STRING_END;
+            else if (s->osc_len < (int)sizeof(s->osc) - 1) s->osc[s->osc_len++] = c;
+            break;
+        case ESC_STRING_END:
+            if (c == '\\') shell_control(s);
+            s->esc = ESC_NONE;
+            break;
+        }
+    }
+}
+
+// Takes in what bash has written since the last frame, up to SHELL_READ
+// bytes; returns 1 when a command has finished meanwhile and -1 once bash
+// has exited.
+int shell_update(Shell *s) {
+    if (!s || s->fd < 0) return 0;
+    unsigned char buf[16384];
+    for (size_t total = 0; total < SHELL_READ;) {
+        ssize_t n = read(s->fd, buf, sizeof(buf));
+        if (n > 0) { shell_feed(s, buf, n); total += n; continue; }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) break;
+        close(s->fd);   // EIO: the last process on the terminal is gone
+        s->fd = -1;
+        waitpid(s->pid, NULL, 0);
+        free(s->queued);
+        s->queued = NULL;
+        s->queued_len = 0;
+        if (s->cur_len) shell_newline(s);
+        shell_flush(s);
+        return -1;
+    }
+    shell_flush(s);
+    int done = s->done;
+    s->done = 0;
+    return done;
+}
+
+// Sends a line to bash, starting it in cwd if it is not running. While a
+// command runs the line is that command's input; otherwise bash is first
+// moved to cwd when it has left it, by a line of its own, and the line is
+// held until bash's prompt says the cd is done.
+int shell_run(Shell *s, const char *cwd, const char *line) {
+    if (s->fd < 0 && shell_spawn(s, cwd) != 0) return -1;
+    char cmd[PATH_MAX_LEN * 4 + 32];
+    s->scroll = 0;
+    if (!s->busy) s->mark = s->log_size + s->spill_len;
+    if (!s->busy && strcmp(s->cwd, cwd)) {
+        size_t len = snprintf(cmd, sizeof(cmd), "__mycommander_cd '");
+        for (const char *c = cwd; *c && len < sizeof(cmd) - 8; c++) {
+            if (*c == '\'') len += snprintf(cmd + len, sizeof(cmd) - len, "'\\''");
+            else cmd[len++] = *c;
+        }
+        len += snprintf(cmd + len, sizeof(cmd) - len, "'\n");
+        if (write_all(s->fd, cmd, len) != 0 || !(s->queued = strdup(""))) return -1;
+    }
+    s->busy = 1;
+    size_t n = strlen(line);
+    if (!s->queued) return write_all(s->fd, line, n) == 0 && write_all(s->fd, "\n", 1) == 0 ? 0 : -1;
+    char *grown = realloc(s->queued, s->queued_len + n + 1);
+    if (!grown) return -1;
+    memcpy(grown + s->queued_len, line, n);
+    grown[s->queued_len + n] = '\n';
+    s->queued = grown;
+    s->queued_len += n + 1;
+    return 0;
+}
+
+// The newest lines of output above the input line of the terminal window.
+void draw_shell(WINDOW *win, Shell *s) {
+    int h, w;
+    getmaxyx(win, h, w);
+    int rows = h - 3;
+    if (!s || rows <= 0) return;
+    int last = s->count - s->scroll;    // the current line is number count
+    for (int r = 0; r < rows; r++) {
+        int i = last - (rows - 1 - r);
+        if (i < 0) continue;
+        const char *text = i == s->count ? s->cur : s->lines[(s->head + i) % SHELL_LINES].text;
+        int len = i == s->count ? s->cur_len : s->lines[(s->head + i) % SHELL_LINES].len;
+        if (text) mvwaddnstr(win, 1 + r, 1, text, len < w - 2 ? len : w - 2);
+    }
+    char note[32] = "";
+    if (s->scroll) snprintf(note, sizeof(note), "[%d back]", s->scroll);
+    else if (s->busy && s->fd >= 0) snprintf(note, sizeof(note), "[running]");
+    else if (s->status) snprintf(note, sizeof(note), "[exit %d]", s->status);
+    if (note[0]) mvwaddstr(win, h - 2, w - 1 - strlen(note), note);
+    wnoutrefresh(win);
+}
+
+#ifdef __SSE2__
+uint64_t newline_mask(const char *p) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+    uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+    uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+    uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+    return m0 | m1 << 16 | m2 << 32 | m3 << 48;
+}
+#endif
+
+// Counts the newlines in buf[from, to), continuing from *lines, and writes
+// the start of every LINE_CHECKPOINT-th line to out, which needs room for
+// (to - from) / LINE_CHECKPOINT + 1 offsets. Blocks of 64 bytes are compared
+// at once and only walked bit by bit when they cross a checkpoint.
+size_t scan_newlines(const char *buf, size_t from, size_t to, size_t *lines, size_t *out) {
+    size_t n = 0, line = *lines, i = from;
+#ifdef __SSE2__
+    for (; i + 64 <= to; i += 64) {
+        uint64_t m = newline_mask(buf + i);
+        if (!m) continue;
+        int c = __builtin_popcountll(m);
+        if (line % LINE_CHECKPOINT + c < LINE_CHECKPOINT) { line += c; continue; }
+        for (; m; m &= m - 1)
+            if (++line % LINE_CHECKPOINT == 0) out[n++] = i + __builtin_ctzll(m) + 1;
+    }
+#endif
+    for (; i < to; i++)
+        if (buf[i] == '\n' && ++line % LINE_CHECKPOINT == 0) out[n++] = i + 1;
+    *lines = line;
+    return n;
+}
+
+void *index_worker(void *arg) {
+    Viewer *v = arg;
+    size_t *found = malloc((INDEX_BLOCK / LINE_CHECKPOINT + 1) * sizeof(size_t));
+    pthread_mutex_lock(&v->lock);
+    size_t pos = v->indexed_bytes, lines = v->indexed_lines;
+    pthread_mutex_unlock(&v->lock);
+    while (found && pos < v->size && !atomic_load(&v->stop)) {
+        size_t end = pos + INDEX_BLOCK < v->size ? pos + INDEX_BLOCK : v->size;
+        size_t n = scan_newlines(v->map, pos, end, &lines, found);
+        pthread_mutex_lock(&v->lock);
+        if (v->ncheckpoints + n > v->cap) {
+            size_t cap = v->cap * 2 > v->ncheckpoints + n ? v->cap * 2 : v->ncheckpoints + n;
+            size_t *grown = realloc(v->checkpoints, cap * sizeof(size_t));
+            if (!grown) { pthread_mutex_unlock(&v->lock); break; }
+            v->checkpoints = grown; v->cap = cap;
+        }
+        memcpy(v->checkpoints + v->ncheckpoints, found, n * sizeof(size_t));
+        v->ncheckpoints += n;
+        v->indexed_bytes = end;
+        v->indexed_lines = lines;
+        pthread_mutex_unlock(&v->lock);
+        pos = end;
+    }
+    free(found);
+    pthread_mutex_lock(&v->lock);
+    v->index_done = 1;
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+// Opens path for the viewers, refusing anything but a regular file: a FIFO
+// or a device could block the open or every read. Devices are not opened at
+// all, and O_NONBLOCK keeps the open from waiting for the writer of a FIFO
+// put in place after the stat.
+int open_regular(const char *path, struct stat *st) {
+    if (stat(path, st) != 0) return -1;
+    if (!S_ISREG(st->st_mode)) { errno = EINVAL; return -1; }
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) { close(fd); errno = EINVAL; return -1; }
+    fcntl(fd, F_SETFL, 0);
+    return fd;
+}
+
+// Maps the file and starts indexing it in the background; the viewer can
+// draw and seek by byte offset right away.
+int viewer_open(Viewer *v, const char *path) {
+    memset(v, 0, sizeof(*v));
+    snprintf(v->path, sizeof(v->path), "%s", path);
+    struct stat st;
+    if ((v->fd = open_regular(path, &st)) < 0) return -1;
+    v->size = st.st_size;
+    if (v->size) {
+        v->map = mmap(NULL, v->size, PROT_READ, MAP_SHARED, v->fd, 0);
+        if (v->map == MAP_FAILED) { close(v->fd); return -1; }
+        map_guard(v->map, v->size);
+    }
+    v->cap = 1024;
+    v->checkpoints = malloc(v->cap * sizeof(size_t));
+    if (!v->checkpoints) {
+        if (v->map) { map_unguard(v->map); munmap((void *)v->map, v->size); }
+        close(v->fd);
+        return -1;
+    }
+    v->checkpoints[0] = 0;
+    v->ncheckpoints = 1;
+    pthread_mutex_init(&v->lock, NULL);
+    v->indexer_running = pthread_create(&v->indexer, NULL, index_worker, v) == 0;
+    pthread_mutex_init(&v->search.lock, NULL);
+    return 0;
+}
+
+size_t next_line(Viewer *v, size_t pos) {
+    if (pos >= v->size) return v->size;
+    const char *nl = memchr(v->map + pos, '\n', v->size - pos);
+    return nl ? (size_t)(nl - v->map) + 1 : v->size;
+}
+
+// Start of the line containing the byte just before off.
+size_t line_start_at(Viewer *v, size_t off) {
+    if (off > v->size) off = v->size;
+    const char *nl = off ? memrchr(v->map, '\n', off) : NULL;
+    return nl ? (size_t)(nl - v->map) + 1 : 0;
+}
+
+size_t prev_line(Viewer *v, size_t pos) {
+    return pos ? line_start_at(v, pos - 1) : 0;
+}
+
+// Offset of the first line of the last screenful.
+size_t last_page(Viewer *v, int rows) {
+    size_t pos = v->size && v->map[v->size-1] == '\n' ? line_start_at(v, v->size - 1) : line_start_at(v, v->size);
+    for (int i = 1; i < rows; i++) pos = prev_line(v, pos);
+    return pos;
+}
+
+// Finds where line k (0-based) starts; fails while the index has not got
+// that far.
+int line_offset(Viewer *v, size_t k, size_t *off) {
+    pthread_mutex_lock(&v->lock);
+    int ok = k <= v->indexed_lines;
+    size_t pos = ok ? v->checkpoints[k / LINE_CHECKPOINT] : 0;
+    pthread_mutex_unlock(&v->lock);
+    if (!ok) return -1;
+    for (size_t r = k % LINE_CHECKPOINT; r > 0; r--) pos = next_line(v, pos);
+    *off = pos;
+    return 0;
+}
+
+// Line number of the line containing off, or -1 if not indexed yet.
+long line_number(Viewer *v, size_t off) {
+    pthread_mutex_lock(&v->lock);
+    if (off > v->indexed_bytes) { pthread_mutex_unlock(&v->lock); return -1; }
+    size_t lo = 0, hi = v->ncheckpoints;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (v->checkpoints[mid] <= off) lo = mid; else hi = mid;
+    }
+    size_t pos = v->checkpoints[lo];
+    pthread_mutex_unlock(&v->lock);
+    long line = lo * LINE_CHECKPOINT;
+    const char *p = v->map + pos, *end = v->map + off;
+    while (p < end && (p = memchr(p, '\n', end - p))) { line++; p++; }
+    return line;
+}
+
+// Finds needle in hay. An SSE2 prefilter compares the needle's first and
+// last byte against 16 positions at once; only positions where both agree
+// go on to a full memcmp.
+const char *find_literal(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 0 || m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[m-1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask; mask &= mask - 1) {
+            size_t j = i + __builtin_ctz(mask);
+            if (!memcmp(hay + j + 1, needle + 1, m - 2)) return hay + j;
+        }
+    }
+#endif
+    for (; i + m <= n; i++)
+        if (hay[i] == needle[0] && hay[i+m-1] == needle[m-1] && !memcmp(hay + i + 1, needle + 1, m - 2)) return hay + i;
+    return NULL;
+}
+
+// Collects the matches in [from, to), which both lie on line starts.
+int search_block(Viewer *v, size_t from, size_t to, Hit **found, size_t *n, size_t *cap) {
+    Search *s = &v->search;
+    size_t pos = from;
+    while (pos < to) {
+        Hit hit;
+        if (s->regex) {
+            regmatch_t m = { pos - from, to - from };
+            int flags = REG_STARTEND | (pos > 0 && v->map[pos-1] != '\n' ? REG_NOTBOL : 0);
+            if (regexec(&s->re, v->map + from, 1, &m, flags) != 0) break;
+            hit.off = from + m.rm_so;
+            hit.len = m.rm_eo - m.rm_so;
+        } else {
+            const char *p = find_literal(v->map + pos, to - pos, s->text, strlen(s->text));
+            if (!p) break;
+            hit.off = p - v->map;
+            hit.len = strlen(s->text);
+        }
+        if (*n == *cap) {
+            size_t grown_cap = *cap ? *cap * 2 : 256;
+            Hit *grown = realloc(*found, grown_cap * sizeof(Hit));
+            if (!grown) return -1;
+            *found = grown; *cap = grown_cap;
+        }
+        (*found)[(*n)++] = hit;
+        pos = hit.off + (hit.len ? hit.len : 1);
+    }
+    return 0;
+}
+
+void *search_worker(void *arg) {
+    Viewer *v = arg;
+    Search *s = &v->search;
+    Hit *found = NULL;
+    size_t cap = 0, ahead = 0;
+    while (!atomic_load(&s->stop)) {
+        pthread_mutex_lock(&s->lock);
+        size_t from = s->hi, to = s->lo;
+        pthread_mutex_unlock(&s->lock);
+        if (s->dir > 0) {
+            if (from >= v->size) break;
+            to = from + SEARCH_BLOCK >= v->size ? v->size : next_line(v, from + SEARCH_BLOCK);
+        } else {
+            if (to == 0) break;
+            from = to <= SEARCH_BLOCK ? 0 : line_start_at(v, to - SEARCH_BLOCK);
+        }
+        size_t n = 0;
+        if (search_block(v, from, to, &found, &n, &cap) < 0) break;
+        pthread_mutex_lock(&s->lock);
+        if (s->nhits + n > s->cap) {
+            size_t grown_cap = s->cap * 2 > s->nhits + n ? s->cap * 2 : s->nhits + n;
+            Hit *grown = realloc(s->hits, grown_cap * sizeof(Hit));
+            if (!grown) { pthread_mutex_unlock(&s->lock); break; }
+            s->hits = grown; s->cap = grown_cap;
+        }
+        if (s->dir > 0) {
+            memcpy(s->hits + s->nhits, found, n * sizeof(Hit));
+            s->hi = to;
+        } else {
+            memmove(s->hits + n, s->hits, s->nhits * sizeof(Hit));
+            memcpy(s->hits, found, n * sizeof(Hit));
+            s->lo = from;
+        }
+        s->nhits += n;
+        pthread_mutex_unlock(&s->lock);
+        for (size_t i = 0; i < n; i++)
+            if (s->dir > 0 ? found[i].off >= s->goal : found[i].off < s->goal) ahead++;
+        if (ahead >= SEARCH_AHEAD) break;
+    }
+    free(found);
+    atomic_store(&s->busy, 0);
+    return NULL;
+}
+
+void search_stop(Viewer *v) {
+    Search *s = &v->search;
+    atomic_store(&s->stop, 1);
+    if (s->started) pthread_join(s->thread, NULL);
+    s->started = 0;
+    atomic_store(&s->stop, 0);
+}
+
+// Starts a new search from the top of the screen. Text starting with '/' is
+// an extended regex, matched within lines; anything else is a literal.
+int search_set(Viewer *v, const char *text) {
+    Search *s = &v->search;
+    search_stop(v);
+    if (s->regex) regfree(&s->re);
+    s->regex = text[0] == '/';
+    if (s->regex && regcomp(&s->re, text + 1, REG_EXTENDED | REG_NEWLINE) != 0) {
+        s->regex = 0;
+        s->text[0] = '\0';
+        return -1;
+    }
+    snprintf(s->text, sizeof(s->text), "%s", text);
+    s->nhits = 0;
+    s->lo = s->hi = v->top;
+    return 0;
+}
+
+// Looks up the first match at or after x (dir > 0) or the last one before
+// x (dir < 0) in the hit cache. Returns 1 with *out set, 0 if there is none
+// up to that end of the file, or -1 while the worker is still scanning.
+int search_find(Viewer *v, int dir, size_t x, Hit *out) {
+    Search *s = &v->search;
+    pthread_mutex_lock(&s->lock);
+    int inside = x >= s->lo && x <= s->hi;
+    if (inside) {
+        size_t lo = 0, hi = s->nhits;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (s->hits[mid].off < x) lo = mid + 1; else hi = mid;
+        }
+        int r = -1;
+        if (dir > 0 && lo < s->nhits) { *out = s->hits[lo]; r = 1; }
+        else if (dir < 0 && lo > 0) { *out = s->hits[lo-1]; r = 1; }
+        else if (dir > 0 ? s->hi >= v->size : s->lo == 0) r = 0;
+        if (r >= 0) { pthread_mutex_unlock(&s->lock); return r; }
+    }
+    int running = atomic_load(&s->busy) && s->dir == dir;
+    pthread_mutex_unlock(&s->lock);
+    if (inside && running) return -1;
+    search_stop(v);
+    if (!inside) {
+        s->nhits = 0;
+        s->lo = s->hi = line_start_at(v, x < v->size ? x + 1 : v->size);
+    }
+    s->dir = dir;
+    s->goal = x;
+    atomic_store(&s->busy, 1);
+    s->started = pthread_create(&s->thread, NULL, search_worker, v) == 0;
+    if (!s->started) { atomic_store(&s->busy, 0); return 0; }
+    return -1;
+}
+
+void viewer_close(Viewer *v) {
+    atomic_store(&v->stop, 1);
+    if (v->indexer_running) pthread_join(v->indexer, NULL);
+    search_stop(v);
+    if (v->search.regex) regfree(&v->search.re);
+    free(v->search.hits);
+    pthread_mutex_destroy(&v->search.lock);
+    if (v->map) { map_unguard(v->map); munmap((void *)v->map, v->size); }
+    close(v->fd);
+    free(v->checkpoints);
+    pthread_mutex_destroy(&v->lock);
+}
+
+void draw_viewer(Viewer *v, const char *note) {
+    int h, w; getmaxyx(stdscr, h, w);
+    werase(stdscr);
+    Hit shown[SHOWN_HITS];
+    int nshown = 0;
+    Search *s = &v->search;
+    pthread_mutex_lock(&s->lock);
+    if (s->text[0]) {
+        size_t bottom = v->top;
+        for (int y = 0; y < h - 1; y++) bottom = next_line(v, bottom);
+        size_t lo = 0, hi = s->nhits;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (s->hits[mid].off + s->hits[mid].len <= v->top) lo = mid + 1; else hi = mid;
+        }
+        for (; lo < s->nhits && s->hits[lo].off < bottom && nshown < SHOWN_HITS; lo++) shown[nshown++] = s->hits[lo];
+    }
+    pthread_mutex_unlock(&s->lock);
+    int k = 0;
+    size_t pos = v->top;
+    for (int y = 0; y < h - 1 && pos < v->size; y++) {
+        size_t end = next_line(v, pos);
+        int col = 0;
+        move(y, 0);
+        for (size_t i = pos; i < end && col < v->left + w; i++) {
+            unsigned char c = v->map[i];
+            if (c == '\n') break;
+            while (k < nshown && shown[k].off + shown[k].len <= i) k++;
+            int lit = k < nshown && shown[k].off <= i;
+            int n = c == '\t' ? 8 - col % 8 : 1;
+            for (; n > 0; n--, col++)
+                if (col >= v->left && col < v->left + w)
+                    addch((c == '\t' ? ' ' : isprint(c) ? c : '.') | (lit ? A_REVERSE : 0));
+        }
+        pos = end;
+    }
+    pthread_mutex_lock(&v->lock);
+    int pct = v->size ? (int)(v->indexed_bytes * 100 / v->size) : 100;
+    size_t lines = v->indexed_lines;
+    pthread_mutex_unlock(&v->lock);
+    long line = line_number(v, v->top);
+    char bar[PATH_MAX_LEN + 256], where[64];
+    if (line >= 0) snprintf(where, sizeof(where), "line %ld", line + 1);
+    else snprintf(where, sizeof(where), "offset %zu", v->top);
+    if (pct < 100)
+        snprintf(bar, sizeof(bar), " %s | %s | %zu bytes | indexing %d%% (%zu lines) | %s",
+                 v->path, where, v->size, pct, lines, note ? note : "/ ?: Search | n N: Next | g: Line | o: Offset | F: Follow | h: Hex | e: Edit | q: Close");
+    else
+        snprintf(bar, sizeof(bar), " %s | %s of %zu | %zu bytes | %s",
+                 v->path, where, lines + (v->size && v->map[v->size-1] != '\n'), v->size, note ? note : "/ ?: Search | n N: Next | g: Line | o: Offset | F: Follow | h: Hex | e: Edit | q: Close");
+    attron(A_REVERSE);
+    mvhline(h - 1, 0, ' ', w);
+    mvaddnstr(h - 1, 0, bar, w);
+    attroff(A_REVERSE);
+    refresh();
+}
+
+int viewer_prompt(const char *label, char *buf, int size) {
+    int len = 0;
+    buf[0] = '\0';
+    while (1) {
+        int h = getmaxy(stdscr);
+        mvprintw(h - 1, 0, "%s%s", label, buf);
+        clrtoeol();
+        refresh();
+        int ch = getch();
+        if (ch == '\n') return len > 0;
+        if (ch == 27) return 0;
+        if ((ch == 127 || ch == KEY_BACKSPACE) && len > 0) buf[--len] = '\0';
+        else if (ch >= ' ' && ch < 127 && len < size - 1) { buf[len++] = ch; buf[len] = '\0'; }
+    }
+}
+
+// Treats a file as binary if its first block contains a NUL byte.
+int looks_binary(const char *path) {
+    struct stat st;
+    int fd = open_regular(path, &st);
+    if (fd < 0) return 0;
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+const HexPage *hex_page(HexView *hv, off_t page) {
+    HexPage *slot = &hv->cache[0];
+    for (int i = 0; i < HEX_CACHE; i++) {
+        HexPage *c = &hv->cache[i];
+        if (c->used && c->page == page) { c->used = ++hv->clock; return c; }
+        if (c->used < slot->used) slot = c;
+    }
+    slot->len = pread(hv->fd, slot->data, HEX_PAGE, page * HEX_PAGE);
+    if (slot->len < 0) slot->len = 0;
+    slot->page = page;
+    slot->used = ++hv->clock;
+    return slot;
+}
+
+int hex_byte(HexView *hv, off_t off) {
+    const HexPage *p = hex_page(hv, off / HEX_PAGE);
+    off_t i = off % HEX_PAGE;
+    return i < p->len ? p->data[i] : -1;
+}
+
+// Parses "de ad be ef" or a quoted "string" into raw bytes.
+int parse_bytes(const char *text, char *out, int size) {
+    int n = 0;
+    if (text[0] == '"') {
+        for (const char *p = text + 1; *p && *p != '"' && n < size; p++) out[n++] = *p;
+        return n;
+    }
+    int half = -1;
+    for (const char *p = text; *p; p++) {
+        if (*p == ' ') continue;
+        if (!isxdigit((unsigned char)*p) || n == size) return -1;
+        int d = isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10;
+        if (half < 0) half = d;
+        else { out[n++] = half << 4 | d; half = -1; }
+    }
+    return half < 0 ? n : -1;
+}
+
+// Streams the file from `from` in HEX_SCAN chunks looking for the bytes.
+// Returns the match offset, -1 if there is none, or -2 if a key was pressed.
+off_t hex_search(HexView *hv, off_t from, const char *needle, int m) {
+    char *buf = malloc(HEX_SCAN + m);
+    if (!buf) return -1;
+    off_t found = -1;
+    int h = getmaxy(stdscr);
+    for (off_t pos = from; pos < hv->size; pos += HEX_SCAN) {
+        ssize_t n = pread(hv->fd, buf, HEX_SCAN + m - 1, pos);
+        if (n < m) break;
+        const char *p = find_literal(buf, n, needle, m);
+        if (p) { found = pos + (p - buf); break; }
+        if (input_pending(0)) { found = -2; break; }
+        mvprintw(h - 1, 0, "searching... %d%%", (int)(pos * 100 / hv->size));
+        clrtoeol();
+        refresh();
+    }
+    free(buf);
+    return found;
+}
+
+void draw_hex(HexView *hv, int bpr, const char *note) {
+    int h, w; getmaxyx(stdscr, h, w);
+    werase(stdscr);
+    for (int y = 0; y < h - 1; y++) {
+        off_t row = hv->top + (off_t)y * bpr;
+        if (row >= hv->size) break;
+        mvprintw(y, 0, "%010llx ", (unsigned long long)row);
+        for (int i = 0; i < bpr; i++) {
+            int b = hex_byte(hv, row + i);
+            int lit = row + i >= hv->match && row + i < hv->match + hv->match_len;
+            if (i % 8 == 0) addch(' ');
+            if (lit) attron(A_REVERSE);
+            if (b < 0) printw("   ");
+            else printw("%02x ", b);
+            if (lit) attroff(A_REVERSE);
+        }
+        addch(' ');
+        for (int i = 0; i < bpr; i++) {
+            int b = hex_byte(hv, row + i);
+            if (b < 0) break;
+            int lit = row + i >= hv->match && row + i < hv->match + hv->match_len;
+            addch((isprint(b) ? b : '.') | (lit ? A_REVERSE : 0));
+        }
+    }
+    char bar[PATH_MAX_LEN + 256];
+    snprintf(bar, sizeof(bar), " %s | 0x%llx of 0x%llx | %s", hv->path,
+             (unsigned long long)hv->top, (unsigned long long)hv->size,
+             note ? note : "o: Offset | /: Find bytes | n: Next | q: Close");
+    attron(A_REVERSE);
+    mvhline(h - 1, 0, ' ', w);
+    mvaddnstr(h - 1, 0, bar, w);
+    attroff(A_REVERSE);
+    refresh();
+}
+
+void hex_view(const char *path, off_t start) {
+    HexView *hv = calloc(1, sizeof(HexView));
+    if (!hv) return;
+    latency_skip = 1;
+    snprintf(hv->path, sizeof(hv->path), "%s", path);
+    struct stat st;
+    if ((hv->fd = open_regular(path, &st)) < 0) {
+        free(hv);
+        return;
+    }
+    hv->size = st.st_size;
+    hv->match = -1;
+    char needle[FILTER_MAX], note[64] = "";
+    int m = 0;
+    timeout(-1);
+    while (1) {
+        int h, w; getmaxyx(stdscr, h, w);
+        int bpr = w >= 78 ? 16 : 8;
+        int page = (h - 1) * bpr;
+        off_t last = hv->size > page ? (hv->size - page + bpr - 1) / bpr * bpr : 0;
+        if (start >= 0) { hv->top = start / bpr * bpr; start = -1; }
+        if (hv->top > last) hv->top = last;
+        if (hv->top < 0) hv->top = 0;
+        hv->top -= hv->top % bpr;
+        draw_hex(hv, bpr, note[0] ? note : NULL);
+        note[0] = '\0';
+        int ch = getch();
+        if (ch == 'q' || ch == 27 || ch == KEY_F(3) || ch == 'h') break;
+        if (ch == KEY_DOWN || ch == 'j') hv->top += bpr;
+        else if (ch == KEY_UP || ch == 'k') hv->top -= bpr;
+        else if (ch == KEY_NPAGE || ch == ' ') hv->top += page;
+        else if (ch == KEY_PPAGE || ch == 'b') hv->top -= page;
+        else if (ch == KEY_HOME) hv->top = 0;
+        else if (ch == KEY_END || ch == 'G') hv->top = last;
+        else if (ch == 'o' || ch == 'g') {
+            char buf[32];
+            if (viewer_prompt("Offset: ", buf, sizeof(buf))) start = strtoull(buf, NULL, 0);
+        } else if (ch == '/' || (ch == 'n' && m > 0)) {
+            if (ch == '/') {
+                char buf[FILTER_MAX];
+                if (!viewer_prompt("Find (hex bytes or \"text\"): ", buf, sizeof(buf))) continue;
+                m = parse_bytes(buf, needle, sizeof(needle));
+                if (m <= 0) { m = 0; snprintf(note, sizeof(note), "Invalid byte pattern"); continue; }
+            }
+            off_t from = ch == 'n' && hv->match >= 0 ? hv->match + 1 : hv->top;
+            off_t found = hex_search(hv, from, needle, m);
+            if (found >= 0) {
+                hv->match = found;
+                hv->match_len = m;
+                start = found;
+            } else {
+                snprintf(note, sizeof(note), found == -2 ? "Search cancelled" : "Pattern not found");
+            }
+        }
+    }
+    close(hv->fd);
+    free(hv);
+    timeout(1000);
+}
+
+// Whether the file is now shorter than its mapping, so reads near the end
+// hit the SIGBUS guard's zero pages until viewer_refresh maps it again.
+int viewer_shrank(Viewer *v) {
+    struct stat st;
+    return fstat(v->fd, &st) == 0 && (size_t)st.st_size < v->size;
+}
+
+// Picks up data appended since the file was mapped. The workers are parked
+// while the mapping grows and the indexer resumes where it stopped, so the
+// existing data is never scanned again. A file that shrank was truncated
+// in place and is indexed from the start, on a fresh mapping: the old one
+// may hold zero pages put there by the SIGBUS guard.
+int viewer_refresh(Viewer *v) {
+    struct stat st;
+    if (fstat(v->fd, &st) != 0 || (size_t)st.st_size == v->size) return 0;
+    size_t size = st.st_size;
+    atomic_store(&v->stop, 1);
+    if (v->indexer_running) pthread_join(v->indexer, NULL);
+    atomic_store(&v->stop, 0);
+    search_stop(v);
+    void *map = MAP_FAILED;
+    if (v->map) map_unguard(v->map);
+    if (v->map && size > v->size) map = mremap((void *)v->map, v->size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        if (v->map) munmap((void *)v->map, v->size);
+        map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, v->fd, 0) : NULL;
+        if (map == MAP_FAILED) map = NULL, size = 0;
+    }
+    if (size < v->size) {
+        v->ncheckpoints = 1;
+        v->indexed_bytes = v->indexed_lines = 0;
+        v->search.nhits = 0;
+        v->search.lo = v->search.hi = 0;
+        v->top = 0;
+    }
+    v->map = map;
+    v->size = size;
+    if (map) map_guard(map, size);
+    v->index_done = 0;
+    v->indexer_running = pthread_create(&v->indexer, NULL, index_worker, v) == 0;
+    return 1;
+}
+
+// Watches the file for writes and self-moves, and its directory for a new
+// file appearing under the same name (log rotation).
+int follow_start(const char *path, int *wd) {
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) return -1;
+    *wd = inotify_add_watch(ifd, path, IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    char dir[PATH_MAX_LEN];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+        inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+    }
+    if (*wd < 0) { close(ifd); return -1; }
+    return ifd;
+}
+
+int follow_events(int ifd, int wd, const char *base) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int r = 0;
+    ssize_t n;
+    while ((n = read(ifd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->wd == wd) r |= ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF) ? FOLLOW_ROTATED : FOLLOW_GREW;
+            else if (ev->len && !strcmp(ev->name, base)) r |= FOLLOW_ROTATED;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return r;
+}
+
+// Read-only viewer over a mapped file. Only the shown lines are touched, so
+// the first page of a huge log appears immediately; line numbers and "go to
+// line" become available as the background index catches up.
+// Shows a text file from the line holding byte start; with search set, the
+// first match from there is sought and highlighted.
+void view_file(const char *path, off_t start, const char *search) {
+    Viewer v;
+    if (viewer_open(&v, path) != 0) return;
+    latency_skip = 1;
+    timeout(200);
+    size_t pending = 0;
+    int waiting = 0;
+    int search_dir = 1, seeking = 0;
+    size_t seek_from = 0, cur_hit = 0;
+    char note[128] = "";
+    const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    int ifd = -1, wd = -1, changed = 0;
+    long last_refresh = 0;
+    v.top = line_start_at(&v, start);
+    if (search && search_set(&v, search) == 0) {
+        seeking = 1;
+        seek_from = v.top;
+    }
+    while (1) {
+        int h, w; getmaxyx(stdscr, h, w);
+        if (waiting) {
+            size_t off;
+            pthread_mutex_lock(&v.lock);
+            int done = v.index_done;
+            size_t last = v.indexed_lines;
+            pthread_mutex_unlock(&v.lock);
+            if (line_offset(&v, pending, &off) == 0) { v.top = off; waiting = 0; }
+            else if (done && line_offset(&v, last, &off) == 0) { v.top = line_start_at(&v, off); waiting = 0; }
+        }
+        if (seeking) {
+            Hit hit;
+            int r = search_find(&v, seeking, seek_from, &hit);
+            if (r > 0) {
+                cur_hit = hit.off;
+                v.top = line_start_at(&v, hit.off + 1);
+                size_t col = hit.off - v.top;
+                v.left = col + hit.len < (size_t)w ? 0 : (int)(col - w / 2);
+                note[0] = '\0';
+                seeking = 0;
+            } else if (r == 0) {
+                snprintf(note, sizeof(note), "Pattern not found (%s of file)", seeking > 0 ? "end" : "start");
+                seeking = 0;
+            } else {
+                pthread_mutex_lock(&v.search.lock);
+                size_t at = seeking > 0 ? v.search.hi : v.search.lo;
+                pthread_mutex_unlock(&v.search.lock);
+                snprintf(note, sizeof(note), "searching... %d%% (any key cancels)", v.size ? (int)(at * 100 / v.size) : 100);
+            }
+        }
+        draw_viewer(&v, waiting ? "waiting for index..." : note[0] ? note : ifd >= 0 ? "following (F: stop)" : NULL);
+        int ch;
+        if (ifd >= 0) {
+            // Writes are coalesced: however many IN_MODIFY events arrive,
+            // the mapping is grown at most once per FOLLOW_MS.
+            struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { ifd, POLLIN, 0 } };
+            long due = last_refresh + FOLLOW_MS - now_ms();
+            pthread_mutex_lock(&v.lock);
+            int indexing = v.indexed_bytes < v.size;
+            pthread_mutex_unlock(&v.lock);
+            poll(fds, 2, changed ? (due > 0 ? due : 0) : indexing ? 200 : 1000);
+            int ev = fds[1].revents & POLLIN ? follow_events(ifd, wd, base) : 0;
+            changed |= ev & FOLLOW_GREW;
+            struct stat now, cur;
+            if ((ev & FOLLOW_ROTATED) && stat(path, &now) == 0 && fstat(v.fd, &cur) == 0 && now.st_ino != cur.st_ino) {
+                viewer_close(&v);
+                close(ifd);
+                if (viewer_open(&v, path) != 0) { timeout(1000); return; }
+                ifd = follow_start(path, &wd);
+                changed = 1;
+            }
+            // A truncation is picked up at once instead: until then reads
+            // past the new end only see the guard's zero pages.
+            if (changed && (now_ms() - last_refresh >= FOLLOW_MS || viewer_shrank(&v))) {
+                viewer_refresh(&v);
+                v.top = last_page(&v, h - 1);
+                changed = 0;
+                last_refresh = now_ms();
+            }
+            timeout(0);
+            ch = getch();
+        } else {
+            timeout(seeking ? 50 : 200);
+            ch = getch();
+            if (viewer_shrank(&v)) viewer_refresh(&v);
+        }
+        if (ch == ERR) continue;
+        waiting = 0;
+        note[0] = '\0';
+        if (seeking) {
+            seeking = 0;
+            search_stop(&v);
+            if (ch == 27) continue;
+        }
+        if (ifd >= 0 && ch != 'q') {
+            close(ifd);
+            ifd = -1;
+            if (ch == 'F' || ch == 27) continue;
+        }
+        if (ch == 'q' || ch == 27 || ch == KEY_F(3)) break;
+        if (ch == 'F') {
+            ifd = follow_start(path, &wd);
+            if (ifd < 0) { snprintf(note, sizeof(note), "Cannot watch file"); continue; }
+            viewer_refresh(&v);
+            v.top = last_page(&v, h - 1);
+            last_refresh = now_ms();
+            continue;
+        }
+        if (ch == KEY_DOWN || ch == 'j') {
+            if (next_line(&v, v.top) < v.size) v.top = next_line(&v, v.top);
+        } else if (ch == KEY_UP || ch == 'k') {
+            v.top = prev_line(&v, v.top);
+        } else if (ch == KEY_NPAGE || ch == ' ') {
+            for (int i = 0; i < h - 2 && next_line(&v, v.top) < v.size; i++) v.top = next_line(&v, v.top);
+        } else if (ch == KEY_PPAGE || ch == 'b') {
+            for (int i = 0; i < h - 2; i++) v.top = prev_line(&v, v.top);
+        } else if (ch == KEY_HOME) {
+            v.top = 0;
+        } else if (ch == KEY_END || ch == 'G') {
+            v.top = last_page(&v, h - 1);
+        } else if (ch == KEY_LEFT) {
+            v.left = v.left > 8 ? v.left - 8 : 0;
+        } else if (ch == KEY_RIGHT) {
+            v.left += 8;
+        } else if (ch == 'g' || ch == 'o') {
+            char buf[32];
+            if (!viewer_prompt(ch == 'g' ? "Line: " : "Offset: ", buf, sizeof(buf))) continue;
+            unsigned long long n = strtoull(buf, NULL, 0);
+            if (ch == 'o') {
+                v.top = line_start_at(&v, n < v.size ? n + 1 : v.size);
+            } else {
+                pending = n ? n - 1 : 0;
+                waiting = 1;
+            }
+        } else if (ch == '/' || ch == '?') {
+            char buf[FILTER_MAX];
+            if (!viewer_prompt(ch == '/' ? "Search (text or /regex): " : "Search backward (text or /regex): ", buf, sizeof(buf))) continue;
+            if (search_set(&v, buf) != 0) { snprintf(note, sizeof(note), "Invalid regex"); continue; }
+            search_dir = ch == '/' ? 1 : -1;
+            seeking = search_dir;
+            seek_from = v.top;
+        } else if ((ch == 'n' || ch == 'N') && v.search.text[0]) {
+            seeking = ch == 'n' ? search_dir : -search_dir;
+            seek_from = seeking > 0 ? cur_hit + 1 : cur_hit;
+            if (cur_hit < v.top || cur_hit >= next_line(&v, v.top)) seek_from = v.top;
+        } else if (ch == 'h') {
+            hex_view(path, v.top);
+            timeout(200);
+        } else if (ch == 'e') {
+            // An EDITOR with arguments of its own needs sh to split it; the
+            // path is passed as an argument either way, never quoted.
+            const char *editor = getenv("EDITOR");
+            if (!editor || !editor[0]) editor = "nano";
+            char *direct[] = {(char *)editor, (char *)path, NULL};
+            char *split[] = {"sh", "-c", "$EDITOR \"$1\"", "sh", (char *)path, NULL};
+            run_foreground(strpbrk(editor, " \t") ? split : direct);
+            size_t top = v.top;
+            viewer_close(&v);
+            if (viewer_open(&v, path) != 0) { timeout(1000); return; }
+            v.top = line_start_at(&v, top < v.size ? top + 1 : v.size);
+        }
+    }
+    if (ifd >= 0) close(ifd);
+    viewer_close(&v);
+    timeout(1000);
+}
+
+size_t count_newlines(const char *p, size_t n) {
+    size_t c = 0, i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= n; i += 64) c += __builtin_popcountll(newline_mask(p + i));
+#endif
+    for (; i < n; i++) c += p[i] == '\n';
+    return c;
+}
+
+void grep_push(Pool *pool, int worker, int dir, const char *rel, const char *name) {
+    size_t len = strlen(rel) + strlen(name) + 2;
+    GrepTask *t = malloc(sizeof(GrepTask) + len);
+    if (!t) return;
+    t->dir = dir;
+    snprintf(t->path, len, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    pool_push(pool, worker, t);
+}
+
+// Records the line at [ls, le) of file rel; file is its index once the
+// file has a first hit.
+void grep_add(GrepJob *job, const char *rel, uint32_t *file, long line, const char *map, size_t ls, size_t le) {
+    uint32_t len = le - ls < GREP_TEXT ? le - ls : GREP_TEXT;
+    pthread_mutex_lock(&job->lock);
+    if (*file == UINT32_MAX && job->nfiles == job->files_cap) {
+        uint32_t cap = job->files_cap ? job->files_cap * 2 : 256;
+        char **files = realloc(job->files, cap * sizeof(char *));
+        if (files) { job->files = files; job->files_cap = cap; }
+    }
+    if (job->nhits == job->hits_cap) {
+        size_t cap = job->hits_cap ? job->hits_cap * 2 : 1024;
+        GrepHit *hits = realloc(job->hits, cap * sizeof(GrepHit));
+        if (hits) { job->hits = hits; job->hits_cap = cap; }
+    }
+    char *text = arena_strndup(&job->strings, map + ls, len);
+    if (*file == UINT32_MAX && job->nfiles < job->files_cap)
+        if ((job->files[job->nfiles] = arena_strndup(&job->strings, rel, strlen(rel))) != NULL)
+            *file = job->nfiles++;
+    if (text && *file != UINT32_MAX && job->nhits < job->hits_cap) {
+        for (uint32_t i = 0; i < len; i++)
+            if ((unsigned char)text[i] < ' ') text[i] = ' ';
+        job->hits[job->nhits++] = (GrepHit){*file, len, line, ls, text};
+        atomic_store(&job->count, job->nhits);
+    }
+    if (job->nhits >= GREP_MAX_HITS) atomic_store(&job->pool.cancel, 1);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Searches one file through a read-only mapping, a line-aligned block at a
+// time so a cancel is noticed even inside huge files. Files with a NUL in
+// their first 4 KB are taken for binaries and skipped; one truncated
+// meanwhile reads as NULs past its new end instead of raising SIGBUS.
+void grep_file(GrepJob *job, int worker, const char *path, const char *rel) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return;
+    struct stat st;
+    char head[4096];
+    ssize_t n;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (n = pread(fd, head, sizeof(head), 0)) <= 0 || memchr(head, 0, n)) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    map_guard(map, size);
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    atomic_fetch_add(&job->scanned, 1);
+    uint32_t file = UINT32_MAX;
+    size_t m = strlen(job->text) - job->regex, counted = 0;
+    long line = 1;
+    for (size_t from = 0; from < size && !atomic_load(&job->pool.cancel);) {
+        size_t to = size - from > SEARCH_BLOCK ? from + SEARCH_BLOCK : size;
+        const char *nl = to < size ? memchr(map + to, '\n', size - to) : NULL;
+        if (to < size) to = nl ? (size_t)(nl - map) + 1 : size;
+        for (size_t pos = from; pos < to;) {
+            size_t at;
+            if (job->regex) {
+                regmatch_t rm = { pos - from, to - from };
+                int flags = REG_STARTEND | (pos > 0 && map[pos-1] != '\n' ? REG_NOTBOL : 0);
+                if (regexec(&job->re[worker], map + from, 1, &rm, flags) != 0) break;
+                at = from + rm.rm_so;
+            } else {
+                const char *hit = find_literal(map + pos, to - pos, job->text, m);
+                if (!hit) break;
+                at = hit - map;
+            }
+            const char *ls = at > pos ? memrchr(map + pos, '\n', at - pos) : NULL;
+            size_t start = ls ? (size_t)(ls - map) + 1 : pos;
+            const char *le = memchr(map + at, '\n', size - at);
+            size_t end = le ? (size_t)(le - map) : size;
+            line += count_newlines(map + counted, start - counted);
+            counted = start;
+            grep_add(job, rel, &file, line, map, start, end);
+            pos = end + 1;
+        }
+        from = to;
+    }
+    map_unguard(map);
+    munmap((void *)map, size);
+}
+
+void grep_dir(Pool *pool, int worker, const char *path, const char *rel) {
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' && (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2]))) continue;
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR || type == DT_REG) grep_push(pool, worker, type == DT_DIR, rel, de->d_name);
+    }
+    closedir(dir);
+}
+
+void grep_task(Pool *pool, int worker, void *arg) {
+    GrepTask *t = arg;
+    GrepJob *job = pool->ctx;
+    char path[PATH_MAX_LEN];
+    int sep = t->path[0] && job->root[strlen(job->root) - 1] != '/';
+    snprintf(path, sizeof(path), "%s%s%s", job->root, sep ? "/" : "", t->path);
+    if (t->dir) grep_dir(pool, worker, path, t->path);
+    else grep_file(job, worker, path, t->path);
+    free(t);
+}
+
+// Queues only the files a content index says can match, plus those changed
+// since it was built. Returns -1 when no index helps, so the tree is walked.
+int grep_indexed(GrepJob *job) {
+    ContentIndex *ix = content_for(job->root);
+    char lit[FILTER_MAX];
+    int len = job->regex ? regex_literal(job->text + 1, lit, sizeof(lit)) : snprintf(lit, sizeof(lit), "%s", job->text);
+    if (!ix || len < 3) return -1;
+    content_events(ix);
+    const char *sub = index_covers(ix->root, job->root);
+    int slen = strlen(sub), skip = slen ? slen + 1 : 0;
+    uint32_t *cand;
+    long n = content_query(ix, sub, lit, len, &cand);
+    for (long i = 0; i < n; i++) grep_push(&job->pool, -1, 0, "", ix->names + ix->entries[cand[i]].name + skip);
+    pthread_mutex_lock(&ix->lock);
+    for (int i = 0; i < ix->ndirty; i++) {
+        const char *rel = ix->dirty[i];
+        if (slen && (strncmp(rel, sub, slen) || rel[slen] != '/')) continue;
+        long id = content_lookup(ix, rel);
+        uint32_t key = id;
+        if (id >= 0 && n && bsearch(&key, cand, n, sizeof(uint32_t), compare_u32)) continue;
+        grep_push(&job->pool, -1, 0, "", rel + skip);
+        n++;
+    }
+    pthread_mutex_unlock(&ix->lock);
+    free(cand);
+    job->indexed = 1;
+    job->candidates = n;
+    return 0;
+}
+
+void grep_close(Panel *p) {
+    GrepJob *job = p->grep;
+    if (!job) return;
+    if (!job->done) pool_join(&job->pool, 1);
+    for (int i = 0; i < job->nre; i++) regfree(&job->re[i]);
+    arena_reset(&job->strings);
+    free(job->files);
+    free(job->hits);
+    pthread_mutex_destroy(&job->lock);
+    p->selected = job->selected;
+    p->scroll_offset = job->scroll_offset;
+    free(job);
+    p->grep = NULL;
+}
+
+// Searches every file under the panel's directory for text, or for a regex
+// when text starts with '/'. Hits stream into the panel while it runs.
+int grep_start(Panel *p, const char *text) {
+    grep_close(p);
+    GrepJob *job = calloc(1, sizeof(GrepJob));
+    if (!job) return -1;
+    snprintf(job->text, sizeof(job->text), "%s", text);
+    snprintf(job->root, sizeof(job->root), "%s", p->cwd);
+    job->regex = text[0] == '/';
+    for (; job->regex && job->nre < worker_count(); job->nre++) {
+        if (regcomp(&job->re[job->nre], text + 1, REG_EXTENDED | REG_NEWLINE) != 0) {
+            while (job->nre--) regfree(&job->re[job->nre]);
+            free(job);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pool_init(&job->pool, grep_task, job);
+    job->selected = p->selected;
+    job->scroll_offset = p->scroll_offset;
+    p->grep = job;
+    p->selected = p->scroll_offset = 0;
+    if (grep_indexed(job) != 0) grep_push(&job->pool, -1, 1, "", "");
+    pool_run(&job->pool);
+    return 0;
+}
+
+// Reaps the workers once the search is over; returns 1 while it runs.
+int grep_update(Panel *p) {
+    GrepJob *job = p->grep;
+    if (!job || job->done) return 0;
+    if (atomic_load(&job->pool.pending)) return 1;
+    pool_join(&job->pool, 0);
+    job->done = 1;
+    return 0;
+}
+
+// Opens the selected hit in the viewer at its line, with the search set.
+void grep_open(Panel *p) {
+    GrepJob *job = p->grep;
+    if (p->selected >= panel_rows(p)) return;
+    char path[PATH_MAX_LEN];
+    pthread_mutex_lock(&job->lock);
+    GrepHit g = job->hits[p->selected];
+    int sep = job->root[strlen(job->root) - 1] != '/';
+    snprintf(path, sizeof(path), "%s%s%s", job->root, sep ? "/" : "", job->files[g.file]);
+    pthread_mutex_unlock(&job->lock);
+    view_file(path, g.off, job->text);
+}
+
+// XXH64 over [p, p + len), four independent lanes of 8 bytes; a set
+// cancel is checked every megabyte.
+uint64_t xxh64(const unsigned char *p, size_t len, atomic_int *cancel) {
+    const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL, P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL, P5 = 2870177450012600261ULL;
+#define XXH_ROTL(x, r) ((x) << (r) | (x) >> (64 - (r)))
+#define XXH_ROUND(acc, in) ((acc) += (in) * P2, (acc) = XXH_ROTL(acc, 31), (acc) *= P1)
+    const unsigned char *end = p + len;
+    uint64_t h, k;
+    if (len >= 32) {
+        uint64_t v[4] = { P1 + P2, P2, 0, -P1 };
+        while (end - p >= 32) {
+            const unsigned char *stop = end - p >= (1 << 20) + 32 ? p + (1 << 20) : end - 31;
+            for (; p < stop; p += 32) {
+                uint64_t in[4];
+                memcpy(in, p, 32);
+                for (int i = 0; i < 4; i++) XXH_ROUND(v[i], in[i]);
+            }
+            if (cancel && atomic_load(cancel)) return 0;
+        }
+        h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) + XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            k = 0;
+            XXH_ROUND(k, v[i]);
+            h = (h ^ k) * P1 + P4;
+        }
+    } else {
+        h = P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8) {
+        uint64_t in;
+        memcpy(&in, p, 8);
+        k = 0;
+        XXH_ROUND(k, in);
+        h ^= k;
+        h = XXH_ROTL(h, 27) * P1 + P4;
+    }
+    if (end - p >= 4) {
+        uint32_t in;
+        memcpy(&in, p, 4);
+        h ^= (uint64_t)in * P1;
+        h = XXH_ROTL(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = XXH_ROTL(h, 11) * P1;
+    }
+#undef XXH_ROUND
+#undef XXH_ROTL
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    return h ^ h >> 32;
+}
+
+HashEntry *hash_cache;
+size_t hash_cache_cap, hash_cache_count;
+pthread_mutex_t hash_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the slot for (dev, ino); the caller holds hash_cache_lock.
+HashEntry *hash_cache_slot(dev_t dev, ino_t ino) {
+    if ((hash_cache_count + 1) * 4 > hash_cache_cap * 3) {
+        size_t cap = hash_cache_cap ? hash_cache_cap * 2 : 1024;
+        HashEntry *slots = calloc(cap, sizeof(HashEntry));
+        if (!slots) return NULL;
+        for (size_t i = 0; i < hash_cache_cap; i++) {
+            HashEntry *e = &hash_cache[i];
+            if (!e->ino) continue;
+            size_t j = id_hash(e->dev, e->ino) & (cap - 1);
+            while (slots[j].ino) j = (j + 1) & (cap - 1);
+            slots[j] = *e;
+        }
+        free(hash_cache);
+        hash_cache = slots; hash_cache_cap = cap;
+    }
+    size_t j = id_hash(dev, ino) & (hash_cache_cap - 1);
+    while (hash_cache[j].ino && (hash_cache[j].ino != ino || hash_cache[j].dev != dev))
+        j = (j + 1) & (hash_cache_cap - 1);
+    return &hash_cache[j];
+}
+
+// Hashes the contents of path, or takes the cached hash when the file's
+// mtime and size still match. Returns -1 if the file cannot be read or
+// changed while it was hashed: a truncation leaves the guard's zero pages
+// in the mapping, and the hash would match neither version.
+int hash_file(const char *path, uint64_t *hash, atomic_llong *bytes, atomic_int *cancel) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    pthread_mutex_lock(&hash_cache_lock);
+    HashEntry *e = hash_cache_slot(st.st_dev, st.st_ino);
+    int hit = e && e->ino && e->mtime == mtime_ns(&st) && e->size == st.st_size;
+    if (hit) *hash = e->hash;
+    pthread_mutex_unlock(&hash_cache_lock);
+    if (hit) return 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return -1; }
+    const unsigned char *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : (const unsigned char *)"";
+    if (map == MAP_FAILED) { close(fd); return -1; }
+    if (st.st_size) {
+        map_guard(map, st.st_size);
+        madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    }
+    *hash = xxh64(map, st.st_size, cancel);
+    if (st.st_size) {
+        map_unguard(map);
+        munmap((void *)map, st.st_size);
+    }
+    struct stat after;
+    int changed = fstat(fd, &after) != 0 || after.st_size != st.st_size || mtime_ns(&after) != mtime_ns(&st);
+    close(fd);
+    if (changed || (cancel && atomic_load(cancel))) return -1;
+    if (bytes) atomic_fetch_add(bytes, st.st_size);
+    pthread_mutex_lock(&hash_cache_lock);
+    if ((e = hash_cache_slot(st.st_dev, st.st_ino)) != NULL) {
+        if (!e->ino) hash_cache_count++;
+        *e = (HashEntry){st.st_dev, st.st_ino, mtime_ns(&st), st.st_size, *hash};
+    }
+    pthread_mutex_unlock(&hash_cache_lock);
+    return 0;
+}
+
+Panel *compare_sorting;
+
+int compare_by_name(const void *a, const void *b) {
+    return strcmp(compare_sorting->entries[*(const int *)a].name, compare_sorting->entries[*(const int *)b].name);
+}
+
+void compare_mark(Panel *p, int i) {
+    if (i < 0 || p->entries[i].marked) return;
+    p->entries[i].marked = 1;
+    p->marked++;
+}
+
+void compare_push(Pool *pool, int worker, CompareTop *top, int dir, const char *rel, const char *name) {
+    size_t len = strlen(rel) + strlen(name) + 2;
+    CompareTask *t = malloc(sizeof(CompareTask) + len);
+    if (!t) return;
+    t->top = top;
+    t->dir = dir;
+    snprintf(t->path, len, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    pool_push(pool, worker, t);
+}
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Reads the sorted names of a directory into one allocation; returns how
+// many, or -1.
+int compare_list(const char *path, char ***names) {
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    char **list = NULL;
+    int n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.' && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2]))) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(list, cap * sizeof(char *));
+            if (!grown) break;
+            list = grown;
+        }
+        if (!(list[n] = strdup(e->d_name))) break;
+        n++;
+    }
+    closedir(d);
+    qsort(list, n, sizeof(char *), compare_names);
+    *names = list;
+    return n;
+}
+
+// Compares one pair of same-named entries below a top: directories by
+// their names and the types and sizes of what they hold, regular files by
+// content hash, links by target.
+void compare_task(Pool *pool, int worker, void *arg) {
+    CompareTask *t = arg;
+    CompareJob *job = pool->ctx;
+    char path[2][PATH_MAX_LEN];
+    for (int s = 0; s < 2; s++) {
+        int sep = t->path[0] && job->roots[s][strlen(job->roots[s]) - 1] != '/';
+        snprintf(path[s], sizeof(path[s]), "%s%s%s", job->roots[s], sep ? "/" : "", t->path);
+    }
+    if (atomic_load(&t->top->differs)) { free(t); return; }
+    if (!t->dir) {
+        uint64_t h[2];
+        atomic_fetch_add(&job->files, 1);
+        if (hash_file(path[0], &h[0], &job->bytes, &pool->cancel) != 0 ||
+            hash_file(path[1], &h[1], &job->bytes, &pool->cancel) != 0 || h[0] != h[1])
+            atomic_store(&t->top->differs, 1);
+        free(t);
+        return;
+    }
+    char **names[2] = {NULL, NULL};
+    int n[2] = { compare_list(path[0], &names[0]), compare_list(path[1], &names[1]) };
+    int differs = n[0] < 0 || n[1] < 0;
+    for (int i = 0, j = 0; !differs && (i < n[0] || j < n[1]);) {
+        int c = i == n[0] ? 1 : j == n[1] ? -1 : strcmp(names[0][i], names[1][j]);
+        if (c) { differs = 1; break; }
+        struct stat st[2];
+        char sub[2][PATH_MAX_LEN];
+        for (int s = 0; s < 2; s++) snprintf(sub[s], sizeof(sub[s]), "%s/%s", path[s], names[0][i]);
+        if (lstat(sub[0], &st[0]) != 0 || lstat(sub[1], &st[1]) != 0 ||
+            (st[0].st_mode & S_IFMT) != (st[1].st_mode & S_IFMT)) {
+            differs = 1;
+        } else if (S_ISDIR(st[0].st_mode)) {
+            compare_push(pool, worker, t->top, 1, t->path, names[0][i]);
+        } else if (S_ISREG(st[0].st_mode)) {
+            if (st[0].st_size != st[1].st_size) differs = 1;
+            else compare_push(pool, worker, t->top, 0, t->path, names[0][i]);
+        } else if (S_ISLNK(st[0].st_mode)) {
+            char target[2][PATH_MAX_LEN];
+            ssize_t len[2] = { readlink(sub[0], target[0], PATH_MAX_LEN), readlink(sub[1], target[1], PATH_MAX_LEN) };
+            differs = len[0] != len[1] || len[0] < 0 || memcmp(target[0], target[1], len[0]);
+        }
+        i++; j++;
+    }
+    if (differs) atomic_store(&t->top->differs, 1);
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < n[s]; i++) free(names[s][i]);
+        free(names[s]);
+    }
+    free(t);
+}
+
+CompareJob *compare_job;
+
+void compare_stop(void) {
+    CompareJob *job = compare_job;
+    if (!job) return;
+    if (!job->done) pool_join(&job->pool, 1);
+    free(job->tops);
+    free(job);
+    compare_job = NULL;
+}
+
+// Marks what differs between the two listings: names on one side only,
+// entries of another type, and files of another size. The quick compare
+// also marks the newer of two files with different mtimes; the deep one
+// instead compares equal-sized files, and same-named directories all the
+// way down, by content hash on the pool, marking them as results come in.
+int compare_panels(Panel *a, Panel *b, int deep) {
+    Panel *side[2] = {a, b};
+    compare_stop();
+    for (int s = 0; s < 2; s++)
+        if (side[s]->grep || side[s]->find || side[s]->dups || side[s]->vfs != &vfs_local || side[s]->du_active) return -1;
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < side[s]->count; i++) side[s]->entries[i].marked = 0;
+        side[s]->marked = 0;
+    }
+    int *order = malloc((b->count + 1) * sizeof(int));
+    CompareJob *job = deep ? calloc(1, sizeof(CompareJob)) : NULL;
+    if (!order || (deep && !job) || (deep && !(job->tops = malloc((a->count + 1) * sizeof(CompareTop))))) {
+        free(order);
+        if (job) free(job->tops);
+        free(job);
+        return -1;
+    }
+    for (int i = 0; i < b->count; i++) order[i] = i;
+    compare_sorting = b;
+    qsort(order, b->count, sizeof(int), compare_by_name);
+    char *seen = calloc(b->count + 1, 1);
+    for (int i = 0; i < a->count; i++) {
+        Entry *ea = &a->entries[i];
+        if (!strcmp(ea->name, "..")) continue;
+        int lo = 0, hi = b->count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (strcmp(b->entries[order[mid]].name, ea->name) < 0) lo = mid + 1; else hi = mid;
+        }
+        int j = lo < b->count && !strcmp(b->entries[order[lo]].name, ea->name) ? order[lo] : -1;
+        if (j < 0) { compare_mark(a, i); continue; }
+        if (seen) seen[j] = 1;
+        char path[2][PATH_MAX_LEN];
+        struct stat st[2];
+        snprintf(path[0], sizeof(path[0]), "%s/%s", a->cwd, ea->name);
+        snprintf(path[1], sizeof(path[1]), "%s/%s", b->cwd, ea->name);
+        if (lstat(path[0], &st[0]) != 0 || lstat(path[1], &st[1]) != 0 ||
+            (st[0].st_mode & S_IFMT) != (st[1].st_mode & S_IFMT) ||
+            (S_ISREG(st[0].st_mode) && st[0].st_size != st[1].st_size)) {
+            compare_mark(a, i);
+            compare_mark(b, j);
+        } else if (!deep && S_ISREG(st[0].st_mode) && mtime_ns(&st[0]) != mtime_ns(&st[1])) {
+            if (mtime_ns(&st[0]) > mtime_ns(&st[1])) compare_mark(a, i);
+            else compare_mark(b, j);
+        } else if (deep && (S_ISREG(st[0].st_mode) || S_ISDIR(st[0].st_mode))) {
+            CompareTop *top = &job->tops[job->ntops++];
+            top->entry[0] = i;
+            top->entry[1] = j;
+            atomic_init(&top->differs, 0);
+        }
+    }
+    for (int j = 0; j < b->count; j++)
+        if (seen && !seen[j] && strcmp(b->entries[j].name, "..")) compare_mark(b, j);
+    free(seen);
+    free(order);
+    if (!deep) return 0;
+    for (int s = 0; s < 2; s++) {
+        snprintf(job->roots[s], sizeof(job->roots[s]), "%s", side[s]->cwd);
+        job->counts[s] = side[s]->count;
+    }
+    pool_init(&job->pool, compare_task, job);
+    for (int k = 0; k < job->ntops; k++) {
+        Entry *e = &a->entries[job->tops[k].entry[0]];
+        compare_push(&job->pool, -1, &job->tops[k], e->type == TYPE_FOLDER, "", e->name);
+    }
+    compare_job = job;
+    pool_run(&job->pool);
+    return 0;
+}
+
+// Marks the tops found to differ since the last call and reaps the workers
+// once the deep compare is over; returns 1 while it runs. A listing that
+// changed under the compare cancels it.
+int compare_update(Panel *a, Panel *b, char *status, size_t size) {
+    CompareJob *job = compare_job;
+    if (!job) return 0;
+    Panel *side[2] = {a, b};
+    for (int s = 0; s < 2; s++) {
+        if (strcmp(side[s]->cwd, job->roots[s]) || side[s]->count != job->counts[s] ||
+            side[s]->grep || side[s]->find || side[s]->dups || side[s]->vfs != &vfs_local || side[s]->du_active) {
+            compare_stop();
+            snprintf(status, size, "Compare cancelled");
+            return 0;
+        }
+    }
+    int running = !job->done && atomic_load(&job->pool.pending);
+    for (int k = 0; k < job->ntops; k++) {
+        CompareTop *top = &job->tops[k];
+        if (atomic_load(&top->differs) == 1) {
+            compare_mark(a, top->entry[0]);
+            compare_mark(b, top->entry[1]);
+            atomic_store(&top->differs, 2);
+        }
+    }
+    if (running) {
+        snprintf(status, size, "Comparing: %ld files, %lld MB hashed", atomic_load(&job->files), atomic_load(&job->bytes) >> 20);
+        return 1;
+    }
+    pool_join(&job->pool, 0);
+    job->done = 1;
+    snprintf(status, size, "Compared %ld files: %d differ on the left, %d on the right", atomic_load(&job->files), a->marked, b->marked);
+    compare_stop();
+    return 0;
+}
+
+void sync_add(SyncJob *job, int kind, int to, long long size, const char *rel, const char *name) {
+    size_t len = strlen(rel) + strlen(name) + 2;
+    SyncAction *a = malloc(sizeof(SyncAction) + len);
+    if (!a) return;
+    a->kind = kind;
+    a->to = to;
+    a->size = size;
+    snprintf(a->path, len, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    pthread_mutex_lock(&job->lock);
+    if (job->nactions == job->cap) {
+        size_t cap = job->cap ? job->cap * 2 : 256;
+        SyncAction **grown = realloc(job->actions, cap * sizeof(SyncAction *));
+        if (grown) { job->actions = grown; job->cap = cap; }
+    }
+    if (job->nactions < job->cap) {
+        job->actions[job->nactions++] = a;
+        if (kind == SYNC_COPY || kind == SYNC_LINK) { job->copies++; job->bytes += size; }
+        else if (kind == SYNC_MKDIR) job->dirs++;
+        else if (kind == SYNC_DELETE) job->deletes++;
+        else job->touches++;
+    } else {
+        free(a);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+void sync_push(Pool *pool, int worker, int only, const char *rel, const char *name) {
+    size_t len = strlen(rel) + strlen(name) + 2;
+    SyncTask *t = malloc(sizeof(SyncTask) + len);
+    if (!t) return;
+    t->only = only;
+    snprintf(t->path, len, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    pool_push(pool, worker, t);
+}
+
+void sync_count(SyncJob *job, long *counter) {
+    pthread_mutex_lock(&job->lock);
+    (*counter)++;
+    pthread_mutex_unlock(&job->lock);
+}
+
+// Plans an entry that exists on side from only: a copy, or a directory to
+// create and fill.
+void sync_missing(Pool *pool, int worker, int from, const char *rel, const char *name, const struct stat *st) {
+    SyncJob *job = pool->ctx;
+    if (S_ISDIR(st->st_mode)) {
+        sync_add(job, SYNC_MKDIR, !from, 0, rel, name);
+        sync_push(pool, worker, from, rel, name);
+    } else if (S_ISREG(st->st_mode)) {
+        sync_add(job, SYNC_COPY, !from, st->st_size, rel, name);
+    } else if (S_ISLNK(st->st_mode)) {
+        sync_add(job, SYNC_LINK, !from, 0, rel, name);
+    }
+}
+
+// Plans a name both sides hold. Files whose size and mtime agree are
+// taken as unchanged without being read; with verify, same-sized files are
+// hashed and identical ones only get their times fixed.
+void sync_pair(Pool *pool, int worker, const char *rel, const char *name) {
+    SyncJob *job = pool->ctx;
+    char path[2][PATH_MAX_LEN];
+    struct stat st[2];
+    for (int s = 0; s < 2; s++) {
+        int sep = job->roots[s][strlen(job->roots[s]) - 1] != '/';
+        snprintf(path[s], sizeof(path[s]), "%s%s%s%s%s", job->roots[s], sep ? "/" : "", rel, rel[0] ? "/" : "", name);
+    }
+    if (lstat(path[0], &st[0]) != 0 || lstat(path[1], &st[1]) != 0) return;
+    if ((st[0].st_mode & S_IFMT) != (st[1].st_mode & S_IFMT)) {
+        if (job->two_way || !job->remove) { sync_count(job, &job->conflicts); return; }
+        sync_add(job, SYNC_DELETE, 1, 0, rel, name);
+        sync_missing(pool, worker, 0, rel, name, &st[0]);
+        return;
+    }
+    if (S_ISDIR(st[0].st_mode)) { sync_push(pool, worker, -1, rel, name); return; }
+    int64_t mtime[2] = { mtime_ns(&st[0]), mtime_ns(&st[1]) };
+    int to = job->two_way && mtime[1] > mtime[0] ? 0 : 1;
+    if (S_ISLNK(st[0].st_mode)) {
+        char target[2][PATH_MAX_LEN];
+        ssize_t len[2] = { readlink(path[0], target[0], PATH_MAX_LEN), readlink(path[1], target[1], PATH_MAX_LEN) };
+        if (len[0] == len[1] && len[0] >= 0 && !memcmp(target[0], target[1], len[0])) sync_count(job, &job->unchanged);
+        else sync_add(job, SYNC_LINK, to, 0, rel, name);
+        return;
+    }
+    if (!S_ISREG(st[0].st_mode)) return;
+    if (st[0].st_size == st[1].st_size && mtime[0] == mtime[1]) { sync_count(job, &job->unchanged); return; }
+    if (job->two_way && mtime[0] == mtime[1]) { sync_count(job, &job->conflicts); return; }
+    uint64_t h[2];
+    if (job->verify && st[0].st_size == st[1].st_size &&
+        hash_file(path[0], &h[0], NULL, &pool->cancel) == 0 && hash_file(path[1], &h[1], NULL, &pool->cancel) == 0 && h[0] == h[1]) {
+        sync_add(job, SYNC_TIMES, to, 0, rel, name);
+        return;
+    }
+    sync_add(job, SYNC_COPY, to, st[!to].st_size, rel, name);
+}
+
+void sync_plan_task(Pool *pool, int worker, void *arg) {
+    SyncTask *t = arg;
+    SyncJob *job = pool->ctx;
+    atomic_fetch_add(&job->scanned, 1);
+    char path[2][PATH_MAX_LEN];
+    char **names[2] = {NULL, NULL};
+    int n[2] = {0, 0};
+    for (int s = 0; s < 2; s++) {
+        int sep = t->path[0] && job->roots[s][strlen(job->roots[s]) - 1] != '/';
+        snprintf(path[s], sizeof(path[s]), "%s%s%s", job->roots[s], sep ? "/" : "", t->path);
+        if (t->only < 0 || t->only == s) n[s] = compare_list(path[s], &names[s]);
+    }
+    for (int i = 0, j = 0; i < n[0] || j < n[1];) {
+        int c = i >= n[0] ? 1 : j >= n[1] ? -1 : strcmp(names[0][i], names[1][j]);
+        if (!c) { sync_pair(pool, worker, t->path, names[0][i]); i++; j++; continue; }
+        int from = c < 0 ? 0 : 1;
+        const char *name = from ? names[1][j++] : names[0][i++];
+        char sub[PATH_MAX_LEN];
+        struct stat st;
+        snprintf(sub, sizeof(sub), "%s/%s", path[from], name);
+        if (lstat(sub, &st) != 0) continue;
+        if (from == 0 || job->two_way) sync_missing(pool, worker, from, t->path, name, &st);
+        else if (job->remove) sync_add(job, SYNC_DELETE, 1, 0, t->path, name);
+    }
+    for (int s = 0; s < 2; s++) {
+        for (int i = 0; i < n[s]; i++) free(names[s][i]);
+        free(names[s]);
+    }
+    free(t);
+}
+
+int compare_actions(const void *a, const void *b) {
+    const SyncAction *x = *(SyncAction * const *)a, *y = *(SyncAction * const *)b;
+    if (x->kind != y->kind) return x->kind - y->kind;
+    return strcmp(x->path, y->path);
+}
+
+SyncJob *sync_job;
+
+void sync_stop(void) {
+    SyncJob *job = sync_job;
+    if (!job) return;
+    if (job->planning || job->running) pool_join(&job->pool, 1);
+    for (size_t i = 0; i < job->nactions; i++) free(job->actions[i]);
+    free(job->actions);
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+    sync_job = NULL;
+}
+
+// Starts walking both trees in parallel to list what a sync would do,
+// reading only metadata unless verify is set. The walk runs in the
+// background; sync_plan_update reaps it.
+// Whether either directory is the other or lies inside it, by device and
+// inode along their resolved paths, so that neither names nor symlinks
+// can hide it.
+int dirs_nested(const char *a, const char *b) {
+    char ra[PATH_MAX], rb[PATH_MAX];
+    struct stat sa, sb;
+    if (!realpath(a, ra) || !realpath(b, rb) || stat(ra, &sa) != 0 || stat(rb, &sb) != 0) return 1;
+    return path_within(ra, &sb) || path_within(rb, &sa);
+}
+
+int sync_plan(Panel *from, Panel *to, int two_way, int remove, int verify) {
+    sync_stop();
+    if (from->grep || from->find || from->dups || from->vfs != &vfs_local || from->du_active ||
+        to->grep || to->find || to->dups || to->vfs != &vfs_local || to->du_active ||
+        dirs_nested(from->cwd, to->cwd))
+        return -1;
+    SyncJob *job = calloc(1, sizeof(SyncJob));
+    if (!job) return -1;
+    snprintf(job->roots[0], sizeof(job->roots[0]), "%s", from->cwd);
+    snprintf(job->roots[1], sizeof(job->roots[1]), "%s", to->cwd);
+    job->two_way = two_way;
+    job->remove = remove && !two_way;
+    job->verify = verify;
+    pthread_mutex_init(&job->lock, NULL);
+    pool_init(&job->pool, sync_plan_task, job);
+    sync_push(&job->pool, -1, -1, "", "");
+    job->planning = 1;
+    sync_job = job;
+    pool_run(&job->pool);
+    return 0;
+}
+
+// Reaps the planning walk once it is over and sorts the actions: deletes,
+// then directories parents first, then the rest. Returns 1 while it runs.
+int sync_plan_update(void) {
+    SyncJob *job = sync_job;
+    if (!job || !job->planning) return 0;
+    if (atomic_load(&job->pool.pending)) return 1;
+    pool_join(&job->pool, 0);
+    job->planning = 0;
+    qsort(job->actions, job->nactions, sizeof(SyncAction *), compare_actions);
+    return 0;
+}
+
+void sync_summary(SyncJob *job, char *buf, size_t size) {
+    char bytes[16];
+    pthread_mutex_lock(&job->lock);
+    format_size(job->bytes, bytes, sizeof(bytes));
+    snprintf(buf, size, "Sync %s %s %s%s: %ld copies (%s), %ld dirs, %ld deletes, %ld touched, %ld unchanged, %ld conflicts",
+        job->roots[0], job->two_way ? "<->" : "->", job->roots[1], job->planning ? " (planning)" : "", job->copies, bytes,
+        job->dirs, job->deletes, job->touches, job->unchanged, job->conflicts);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// The keys the sync prompt takes, or the planning walk's progress.
+void sync_help(SyncJob *job, char *buf, size_t size) {
+    if (job->planning)
+        snprintf(buf, size, "Planning: %ld directories read | Esc: cancel", atomic_load(&job->scanned));
+    else
+        snprintf(buf, size, "Enter: run | d: delete extras %s | t: two-way %s | h: hash %s | Esc: cancel",
+            job->remove ? "on" : "off", job->two_way ? "on" : "off", job->verify ? "on" : "off");
+}
+
+// Runs one action, or with a negative index first all deletes and
+// directories in order and then queues the rest for the workers.
+void sync_task(Pool *pool, int worker, void *arg) {
+    long i = *(long *)arg;
+    SyncJob *job = pool->ctx;
+    free(arg);
+    if (i < 0) {
+        size_t k = 0;
+        for (; k < job->nactions && job->actions[k]->kind <= SYNC_MKDIR && !atomic_load(&pool->cancel); k++) {
+            SyncAction *a = job->actions[k];
+            char path[2][PATH_MAX_LEN];
+            struct stat st;
+            for (int s = 0; s < 2; s++) snprintf(path[s], sizeof(path[s]), "%s/%s", job->roots[s], a->path);
+            if (a->kind == SYNC_DELETE) {
+                if (delete_path(path[a->to]) != 0) atomic_fetch_add(&job->failed, 1);
+            } else if (lstat(path[!a->to], &st) != 0 || mkdir(path[a->to], st.st_mode & 07777) != 0) atomic_fetch_add(&job->failed, 1);
+            atomic_fetch_add(&job->done, 1);
+        }
+        for (; k < job->nactions; k++) {
+            long *next = malloc(sizeof(long));
+            if (!next) continue;
+            *next = k;
+            pool_push(pool, worker, next);
+        }
+        return;
+    }
+    SyncAction *a = job->actions[i];
+    char path[2][PATH_MAX_LEN];
+    for (int s = 0; s < 2; s++) snprintf(path[s], sizeof(path[s]), "%s/%s", job->roots[s], a->path);
+    const char *src = path[!a->to], *dst = path[a->to];
+    int ok = 0;
+    if (a->kind == SYNC_COPY) {
+        ok = copy_file(src, dst, &job->written, &pool->cancel) == 0;
+    } else if (a->kind == SYNC_LINK) {
+        char target[PATH_MAX_LEN];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len >= 0) {
+            target[len] = '\0';
+            unlink(dst);
+            ok = symlink(target, dst) == 0;
+        }
+    } else if (a->kind == SYNC_TIMES) {
+        struct stat st;
+        if (stat(src, &st) == 0) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            ok = utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW) == 0;
+        }
+    }
+    if (!ok) atomic_fetch_add(&job->failed, 1);
+    atomic_fetch_add(&job->done, 1);
+}
+
+// Runs the planned actions; fails while the plan is still being made.
+int sync_start(void) {
+    SyncJob *job = sync_job;
+    if (!job || job->planning) return -1;
+    long *first = malloc(sizeof(long));
+    if (!first) return -1;
+    *first = -1;
+    pool_init(&job->pool, sync_task, job);
+    pool_push(&job->pool, -1, first);
+    job->running = 1;
+    pool_run(&job->pool);
+    return 0;
+}
+
+// Reports progress while the sync runs; once it is over, reaps the workers
+// and reloads both panels. Returns 1 while it runs.
+int sync_update(Panel *a, Panel *b, char *status, size_t size) {
+    SyncJob *job = sync_job;
+    if (!job || !job->running) return 0;
+    char written[16], total[16];
+    format_size(atomic_load(&job->written), written, sizeof(written));
+    format_size(job->bytes, total, sizeof(total));
+    if (atomic_load(&job->pool.pending)) {
+        snprintf(status, size, "Syncing: %ld of %zu actions, %s of %s", atomic_load(&job->done), job->nactions, written, total);
+        return 1;
+    }
+    pool_join(&job->pool, 0);
+    job->running = 0;
+    snprintf(status, size, "Synced %s to %s: %zu actions, %s written, %ld failed",
+        job->roots[0], job->roots[1], job->nactions, written, atomic_load(&job->failed));
+    sync_stop();
+    reload_panel(a);
+    reload_panel(b);
+    return 0;
+}
+
+// Lists one directory of the duplicate finder's tree with getdents64,
+// recording non-empty regular files with their inode and size. Other file
+// systems are not entered, since nothing there could be linked anyway.
+void dup_walk(Pool *pool, int worker, void *arg) {
+    char *rel = arg;
+    DupJob *job = pool->ctx;
+    char path[PATH_MAX_LEN];
+    int sep = rel[0] && job->root[strlen(job->root) - 1] != '/';
+    snprintf(path, sizeof(path), "%s%s%s", job->root, sep ? "/" : "", rel);
+    int fd = atomic_load(&job->cancel) ? -1 : open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_dev != job->dev) {
+        if (fd >= 0) close(fd);
+        free(rel);
+        return;
+    }
+    char buf[32768];
+    char name[PATH_MAX_LEN];
+    int rlen = strlen(rel);
+    ssize_t n;
+    while ((n = getdents64(fd, buf, sizeof(buf))) > 0 && !atomic_load(&job->cancel)) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *base = de->d_name;
+            if (base[0] == '.' && (!base[1] || (base[1] == '.' && !base[2]))) continue;
+            if (de->d_type != DT_REG && de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) continue;
+            int len = snprintf(name, sizeof(name), "%s%s%s", rel, rlen ? "/" : "", base);
+            if (len >= (int)sizeof(name)) continue;
+            int dir = de->d_type == DT_DIR;
+            if (!dir) {
+                if (fstatat(fd, base, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                dir = S_ISDIR(st.st_mode);
+            }
+            if (dir) {
+                char *sub = strdup(name);
+                if (sub) pool_push(pool, worker, sub);
+                continue;
+            }
+            if (!S_ISREG(st.st_mode) || !st.st_size) continue;
+            atomic_fetch_add(&job->scanned, 1);
+            pthread_mutex_lock(&job->lock);
+            if (job->nfiles == job->cap) {
+                size_t cap = job->cap ? job->cap * 2 : 1024;
+                DupFile *files = realloc(job->files, cap * sizeof(DupFile));
+                if (files) { job->files = files; job->cap = cap; }
+            }
+            char *copy = job->nfiles < job->cap ? arena_strndup(&job->strings, name, len) : NULL;
+            if (copy) job->files[job->nfiles++] = (DupFile){copy, st.st_dev, st.st_ino, st.st_size, 0, 0};
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    close(fd);
+    free(rel);
+}
+
+// Hashes a range of files: in stage 1 their first and last DUP_EDGE bytes,
+// which for small files is all of them; in stage 2 the whole of the larger
+// ones, through the hash cache.
+void dup_hash(Pool *pool, int worker, void *arg) {
+    DupTask *t = arg;
+    DupJob *job = pool->ctx;
+    int stage = atomic_load(&job->stage);
+    char path[PATH_MAX_LEN];
+    int sep = job->root[strlen(job->root) - 1] != '/';
+    for (size_t i = t->from; i < t->to && !atomic_load(&job->cancel); i++) {
+        DupFile *f = &job->files[i];
+        snprintf(path, sizeof(path), "%s%s%s", job->root, sep ? "/" : "", f->path);
+        if (stage == 2) {
+            f->failed = hash_file(path, &f->hash, &job->bytes, &job->cancel) != 0;
+        } else {
+            unsigned char buf[2 * DUP_EDGE];
+            size_t head = f->size > 2 * DUP_EDGE ? DUP_EDGE : (size_t)f->size;
+            size_t len = f->size > 2 * DUP_EDGE ? 2 * DUP_EDGE : head;
+            int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            f->failed = fd < 0 || pread(fd, buf, head, 0) != (ssize_t)head ||
+                (len > head && pread(fd, buf + head, DUP_EDGE, f->size - DUP_EDGE) != DUP_EDGE);
+            if (fd >= 0) close(fd);
+            if (!f->failed) f->hash = xxh64(buf, len, NULL);
+            atomic_fetch_add(&job->bytes, len);
+        }
+        atomic_fetch_add(&job->hashed, 1);
+    }
+    free(t);
+}
+
+// Largest first; within a size by hash, then inode, so the paths of one
+// inode sit together.
+int compare_dups(const void *a, const void *b) {
+    const DupFile *fa = a, *fb = b;
+    if (fa->size != fb->size) return fa->size < fb->size ? 1 : -1;
+    if (fa->hash != fb->hash) return fa->hash < fb->hash ? -1 : 1;
+    if (fa->dev != fb->dev) return fa->dev < fb->dev ? -1 : 1;
+    if (fa->ino != fb->ino) return fa->ino < fb->ino ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
+
+int compare_dup_paths(const void *a, const void *b) {
+    const DupFile *fa = a, *fb = b;
+    if (fa->size != fb->size) return fa->size < fb->size ? 1 : -1;
+    if (fa->hash != fb->hash) return fa->hash < fb->hash ? -1 : 1;
+    return strcmp(fa->path, fb->path);
+}
+
+// Keeps the files sharing their size and hash with another file, dropping
+// unreadable ones and all but one path of an inode.
+void dup_keep(DupJob *job) {
+    qsort(job->files, job->nfiles, sizeof(DupFile), compare_dups);
+    size_t kept = 0;
+    for (size_t i = 0, j; i < job->nfiles; i = j) {
+        off_t size = job->files[i].size;
+        uint64_t hash = job->files[i].hash;
+        size_t start = kept;
+        for (j = i; j < job->nfiles && job->files[j].size == size && job->files[j].hash == hash; j++) {
+            DupFile *f = &job->files[j];
+            if (f->failed || (kept > start && job->files[kept - 1].dev == f->dev && job->files[kept - 1].ino == f->ino)) continue;
+            job->files[kept++] = *f;
+        }
+        if (kept - start < 2) kept = start;
+    }
+    job->nfiles = kept;
+}
+
+// Runs the stages one after another, each on a fresh pool over what the
+// previous one kept, so only files that could still be duplicates are read.
+void *dup_finder(void *arg) {
+    DupJob *job = arg;
+    char *rel = strdup("");
+    if (rel) {
+        pool_init(&job->pool, dup_walk, job);
+        pool_push(&job->pool, -1, rel);
+        pool_run(&job->pool);
+        pool_join(&job->pool, 0);
+    }
+    for (int stage = 1; stage <= 2 && !atomic_load(&job->cancel); stage++) {
+        dup_keep(job);
+        atomic_store(&job->hashed, 0);
+        atomic_store(&job->stage, stage);
+        pool_init(&job->pool, dup_hash, job);
+        size_t batch = stage == 1 ? DUP_BATCH : 1;
+        for (size_t i = 0; i < job->nfiles; i += batch) {
+            if (stage == 2 && job->files[i].size <= 2 * DUP_EDGE) break;
+            DupTask *t = malloc(sizeof(DupTask));
+            if (!t) break;
+            t->from = i;
+            t->to = i + batch < job->nfiles ? i + batch : job->nfiles;
+            pool_push(&job->pool, -1, t);
+        }
+        pool_run(&job->pool);
+        pool_join(&job->pool, 0);
+    }
+    if (!atomic_load(&job->cancel)) {
+        dup_keep(job);
+        qsort(job->files, job->nfiles, sizeof(DupFile), compare_dup_paths);
+    }
+    atomic_store(&job->done, 1);
+    return NULL;
+}
+
+// Looks for files with equal contents under the panel's directory. The
+// panel then lists them set by set, largest first, with every member but
+// the first of each marked, ready for F5.
+int dup_start(Panel *p) {
+    struct stat st;
+    if (stat(p->cwd, &st) != 0) return -1;
+    DupJob *job = calloc(1, sizeof(DupJob));
+    if (!job) return -1;
+    snprintf(job->root, sizeof(job->root), "%s", p->cwd);
+    job->dev = st.st_dev;
+    pthread_mutex_init(&job->lock, NULL);
+    if (pthread_create(&job->thread, NULL, dup_finder, job) != 0) {
+        pthread_mutex_destroy(&job->lock);
+        free(job);
+        return -1;
+    }
+    find_stop(p);
+    dup_stop(p);
+    size_cancel(p);
+    clear_filter(p);
+    p->du_active = 0;
+    arena_reset(&p->names);
+    p->count = p->marked = 0;
+    p->selected = p->scroll_offset = 0;
+    p->dups = job;
+    return 0;
+}
+
+// Moves the sets into the panel once the search is over; returns 1 while
+// it runs.
+int dup_update(Panel *p) {
+    DupJob *job = p->dups;
+    if (!job || job->applied) return 0;
+    if (!atomic_load(&job->done)) return 1;
+    pthread_join(job->thread, NULL);
+    job->applied = 1;
+    if (job->nfiles > (size_t)p->cap) {
+        Entry *grown = realloc(p->entries, job->nfiles * sizeof(Entry));
+        if (grown) { p->entries = grown; p->cap = job->nfiles; }
+    }
+    uint32_t set = 0;
+    for (size_t i = 0; i < job->nfiles && p->count < p->cap; i++) {
+        DupFile *f = &job->files[i];
+        int first = !i || f->size != f[-1].size || f->hash != f[-1].hash;
+        Entry *e = &p->entries[p->count];
+        e->name_len = strlen(f->path);
+        if (!(e->name = arena_strndup(&p->names, f->path, e->name_len))) break;
+        e->sig = name_signature(e->name, e->name_len);
+        struct stat st = {.st_mode = S_IFREG};
+        e->type = detect_file_type(e->name, &st);
+        e->marked = !first;
+        e->size = f->size;
+        e->sizing = 0;
+        e->node = DU_NONE;
+        e->set = set += first;
+        p->marked += e->marked;
+        p->count++;
+    }
+    arena_reset(&job->strings);
+    free(job->files);
+    job->files = NULL;
+    job->nfiles = 0;
+    dup_count(p);
+    if (p->filtered || p->filter[0]) { p->filter_dirty = 1; p->filter_reusable = 0; }
+    return 0;
+}
+
+// Whether two regular files hold the same bytes, read and compared in
+// full: equal 64-bit hashes alone may be a collision, and a cached hash
+// was not even read again.
+int same_contents(const char *a, const char *b) {
+    int fa = open(a, O_RDONLY | O_CLOEXEC | O_NOFOLLOW), fb = open(b, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    struct stat sa, sb;
+    int same = fa >= 0 && fb >= 0 && fstat(fa, &sa) == 0 && fstat(fb, &sb) == 0 &&
+        S_ISREG(sa.st_mode) && S_ISREG(sb.st_mode) && sa.st_size == sb.st_size;
+    char ba[65536], bb[65536];
+    for (off_t off = 0; same && off < sa.st_size;) {
+        size_t want = sa.st_size - off < (off_t)sizeof(ba) ? (size_t)(sa.st_size - off) : sizeof(ba);
+        same = pread(fa, ba, want, off) == (ssize_t)want && pread(fb, bb, want, off) == (ssize_t)want && !memcmp(ba, bb, want);
+        off += want;
+    }
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return same;
+}
+
+// Replaces each marked member of a set by a hard link to the set's first
+// unmarked one, once both still hold the same bytes. The link is made
+// beside the member and renamed over it, so a failure leaves the member
+// as it was.
+int dup_link(Panel *p, int *failed) {
+    char keep[PATH_MAX_LEN], path[PATH_MAX_LEN], tmp[PATH_MAX_LEN];
+    int linked = 0;
+    *failed = 0;
+    for (int i = 0, j; i < p->count; i = j) {
+        int keeper = -1;
+        for (j = i; j < p->count && p->entries[j].set == p->entries[i].set; j++)
+            if (keeper < 0 && !p->entries[j].marked) keeper = j;
+        if (keeper < 0) continue;
+        snprintf(keep, sizeof(keep), "%s/%s", p->cwd, p->entries[keeper].name);
+        for (int k = i; k < j; k++) {
+            if (!p->entries[k].marked) continue;
+            snprintf(path, sizeof(path), "%s/%s", p->cwd, p->entries[k].name);
+            char *slash = strrchr(path, '/');
+            snprintf(tmp, sizeof(tmp), "%.*s/.%s.mclink", (int)(slash - path), path, slash + 1);
+            if (!same_contents(keep, path) || link(keep, tmp) != 0) {
+                (*failed)++;
+            } else if (rename(tmp, path) != 0) {
+                unlink(tmp);
+                (*failed)++;
+            } else {
+                linked++;
+            }
+        }
+    }
+    dup_prune(p);
+    return linked;
+}
+
+// Deletes the marked members of each set. While the set keeps an unmarked
+// member, a marked one goes only if its bytes are that member's.
+int dup_delete(Panel *p, int *failed) {
+    char keep[PATH_MAX_LEN], path[PATH_MAX_LEN];
+    int deleted = 0;
+    *failed = 0;
+    for (int i = 0, j; i < p->count; i = j) {
+        int keeper = -1;
+        for (j = i; j < p->count && p->entries[j].set == p->entries[i].set; j++)
+            if (keeper < 0 && !p->entries[j].marked) keeper = j;
+        if (keeper >= 0) snprintf(keep, sizeof(keep), "%s/%s", p->cwd, p->entries[keeper].name);
+        for (int k = i; k < j; k++) {
+            if (!p->entries[k].marked) continue;
+            snprintf(path, sizeof(path), "%s/%s", p->cwd, p->entries[k].name);
+            if ((keeper < 0 || same_contents(keep, path)) && p->vfs->ops->unlink(p->vfs, path) == 0) deleted++;
+            else (*failed)++;
+        }
+    }
+    return deleted;
+}
+
+// Lists a local directory in the panel, leaving any search shown there.
+int change_dir(Panel *p, const char *path) {
+    if (chdir(path) != 0) return -1;
+    size_cancel(p);
+    find_stop(p);
+    clear_filter(p);
+    getcwd(p->cwd, PATH_MAX_LEN); free_panel(p); list_dir(p);
+    p->selected = p->scroll_offset = 0;
+    return 0;
+}
+
+void open_entry(Panel *p) {
+    if (p->grep) { grep_open(p); return; }
+    Entry *e = cur_entry(p);
+    if (!e) return;
+    char path[PATH_MAX_LEN];
+    snprintf(path, sizeof(path), "%s/%s", p->cwd, e->name);
+    if (p->arc && e->type == TYPE_FOLDER) {
+        if (e->node == ARC_NONE) arc_leave(p);
+        else arc_enter(p, e->node);
+        return;
+    }
+    // Files of other backends are viewed from a temporary copy, removed
+    // once the viewer closes.
+    if (p->vfs != &vfs_local) {
+        if (e->type == TYPE_FOLDER) { vfs_enter(p, e->name); return; }
+        char tmp[PATH_MAX_LEN];
+        if (vfs_temp(p->vfs, path, tmp, sizeof(tmp)) != 0) return;
+        if (looks_binary(tmp)) hex_view(tmp, 0);
+        else view_file(tmp, 0, NULL);
+        unlink(tmp);
+        return;
+    }
+    if (e->type != TYPE_FOLDER && archive_kind(e->name) >= 0 && arc_open(p, path) == 0) return;
+    if (p->du_active && e->type == TYPE_FOLDER) {
+        if (e->node != DU_NONE) { du_enter(p, e->node); return; }
+        p->du_active = 0;   // ".." above the tree's root
+    }
+    if (e->type == TYPE_FOLDER) {
+        change_dir(p, path);
+    } else if (e->type == TYPE_TEXT) {
+        view_file(path, 0, NULL);
+    } else if ((e->type != TYPE_IMAGE && e->type != TYPE_VIDEO) || !(getenv("DISPLAY") || getenv("WAYLAND_DISPLAY"))) {
+        if (looks_binary(path)) hex_view(path, 0);
+        else view_file(path, 0, NULL);
+    } else {
+        char *argv[] = {"xdg-open", path, NULL};
+        if (proc_start(argv) != 0) {
+            if (looks_binary(path)) hex_view(path, 0);
+            else view_file(path, 0, NULL);
+        }
+    }
+}
+void sftp_put(SftpBuf *b, const void *p, size_t n) {
+    if (b->bad) return;
+    if (b->len + n > b->cap) {
+        size_t cap = (b->len + n) * 2;
+        unsigned char *data = realloc(b->data, cap);
+        if (!data) { b->bad = 1; return; }
+        b->data = data; b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+void sftp_u32(SftpBuf *b, uint32_t v) {
+    unsigned char c[4] = {v >> 24, v >> 16, v >> 8, v};
+    sftp_put(b, c, 4);
+}
+
+void sftp_u64(SftpBuf *b, uint64_t v) {
+    sftp_u32(b, v >> 32);
+    sftp_u32(b, v);
+}
+
+void sftp_str(SftpBuf *b, const void *s, size_t n) {
+    sftp_u32(b, n);
+    sftp_put(b, s, n);
+}
+
+// Starts a request: room for the length, the type, and the id.
+void sftp_begin(SftpBuf *b, int type) {
+    unsigned char head[9] = {0, 0, 0, 0, type};
+    b->len = 0;
+    b->bad = 0;
+    sftp_put(b, head, sizeof(head));
+}
+
+uint32_t in_u32(SftpIn *in) {
+    if (in->end - in->p < 4) { in->bad = 1; in->p = in->end; return 0; }
+    uint32_t v = (uint32_t)in->p[0] << 24 | in->p[1] << 16 | in->p[2] << 8 | in->p[3];
+    in->p += 4;
+    return v;
+}
+
+uint64_t in_u64(SftpIn *in) {
+    uint64_t hi = in_u32(in);
+    return hi << 32 | in_u32(in);
+}
+
+const char *in_str(SftpIn *in, uint32_t *len) {
+    *len = in_u32(in);
+    if ((size_t)(in->end - in->p) < *len) { in->bad = 1; in->p = in->end; *len = 0; return ""; }
+    const char *s = (const char *)in->p;
+    in->p += *len;
+    return s;
+}
+
+SftpAttrs in_attrs(SftpIn *in) {
+    SftpAttrs a = {in_u32(in)};
+    if (a.flags & SSH_ATTR_SIZE) a.size = in_u64(in);
+    if (a.flags & SSH_ATTR_UIDGID) { in_u32(in); in_u32(in); }
+    if (a.flags & SSH_ATTR_PERMISSIONS) a.mode = in_u32(in);
+    if (a.flags & SSH_ATTR_ACMODTIME) { a.atime = in_u32(in); a.mtime = in_u32(in); }
+    if (a.flags & SSH_ATTR_EXTENDED) {
+        uint32_t len;
+        for (uint32_t n = in_u32(in); n-- && !in->bad;) { in_str(in, &len); in_str(in, &len); }
+    }
+    return a;
+}
+
+int read_all(int fd, void *buf, size_t n) {
+    for (char *p = buf; n;) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r; n -= r;
+    }
+    return 0;
+}
+
+// Files every reply in the slot waiting for its id. VERSION carries no id
+// and goes to slot 0, which connecting keeps for it.
+void *sftp_reader(void *arg) {
+    Sftp *s = arg;
+    unsigned char head[4];
+    while (read_all(s->fd, head, 4) == 0) {
+        uint32_t len = (uint32_t)head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+        unsigned char *msg = len >= 5 && len <= SFTP_MAX_PACKET ? malloc(len) : NULL;
+        if (!msg || read_all(s->fd, msg, len) != 0) { free(msg); break; }
+        uint32_t id = msg[0] == SSH_FXP_VERSION ? 0 : (uint32_t)msg[1] << 24 | msg[2] << 16 | msg[3] << 8 | msg[4];
+        pthread_mutex_lock(&s->lock);
+        SftpSlot *slot = &s->slots[id % SFTP_SLOTS];
+        clock_gettime(CLOCK_MONOTONIC, &s->heard);
+        if (slot->state == SLOT_WAIT && slot->id == id) {
+            slot->reply = msg;
+            slot->len = len;
+            slot->state = SLOT_DONE;
+            s->inflight--;
+            msg = NULL;
+            pthread_cond_broadcast(&s->cond);
+        }
+        pthread_mutex_unlock(&s->lock);
+        free(msg);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->dead = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Sends a request begun with sftp_begin and returns its id, or 0 once the
+// connection is gone. Ids skip past slots still busy, so a slow reply
+// holds up no one but its own sender.
+uint32_t sftp_send(Sftp *s, SftpBuf *b) {
+    if (b->bad) return 0;
+    pthread_mutex_lock(&s->lock);
+    int tries = 0;
+    while (!s->dead && s->slots[s->next_id % SFTP_SLOTS].state != SLOT_FREE) {
+        if (++s->next_id == 0) s->next_id = 1;
+        if (++tries == SFTP_SLOTS) { pthread_cond_wait(&s->cond, &s->lock); tries = 0; }
+    }
+    uint32_t id = s->next_id++;
+    if (!s->next_id) s->next_id = 1;
+    SftpSlot *slot = &s->slots[id % SFTP_SLOTS];
+    if (s->dead) { pthread_mutex_unlock(&s->lock); return 0; }
+    slot->id = id;
+    slot->state = SLOT_WAIT;
+    if (!s->inflight++) clock_gettime(CLOCK_MONOTONIC, &s->heard);
+    pthread_mutex_unlock(&s->lock);
+    uint32_t len = b->len - 4;
+    unsigned char fill[] = {len >> 24, len >> 16, len >> 8, len};
+    unsigned char idb[] = {id >> 24, id >> 16, id >> 8, id};
+    memcpy(b->data, fill, 4);
+    memcpy(b->data + 5, idb, 4);
+    pthread_mutex_lock(&s->write_lock);
+    int ok = 1;
+    for (size_t off = 0; ok && off < b->len;) {
+        ssize_t w = send(s->fd, b->data + off, b->len - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) ok = 0;
+        else off += w;
+    }
+    pthread_mutex_unlock(&s->write_lock);
+    if (ok) return id;
+    pthread_mutex_lock(&s->lock);
+    slot->state = SLOT_FREE;
+    s->inflight--;
+    s->dead = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+// Waits for the reply to id and frees its slot; the caller frees *reply.
+// When the server has said nothing for SFTP_TIMEOUT_MS while requests are
+// outstanding, the connection is given up: it is marked dead and shut, so
+// every waiter returns and the panel reports it lost.
+int sftp_wait(Sftp *s, uint32_t id, unsigned char **reply, uint32_t *len) {
+    SftpSlot *slot = &s->slots[id % SFTP_SLOTS];
+    pthread_mutex_lock(&s->lock);
+    while (slot->state != SLOT_DONE && !s->dead) {
+        struct timespec until = s->heard, now;
+        until.tv_sec += SFTP_TIMEOUT_MS / 1000;
+        if (pthread_cond_timedwait(&s->cond, &s->lock, &until) != ETIMEDOUT || slot->state == SLOT_DONE) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - s->heard.tv_sec) * 1000L + (now.tv_nsec - s->heard.tv_nsec) / 1000000 < SFTP_TIMEOUT_MS) continue;
+        s->dead = 1;
+        shutdown(s->fd, SHUT_RDWR);
+        pthread_cond_broadcast(&s->cond);
+    }
+    int ok = slot->state == SLOT_DONE;
+    if (slot->state == SLOT_WAIT) s->inflight--;
+    *reply = ok ? slot->reply : NULL;
+    *len = ok ? slot->len : 0;
+    slot->reply = NULL;
+    slot->state = SLOT_FREE;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return ok ? 0 : -1;
+}
+
+// Waits for id and points in past the reply's type and id; returns the
+// type, or -1. The caller frees *reply.
+int sftp_reply(Sftp *s, uint32_t id, SftpIn *in, unsigned char **reply) {
+    uint32_t len;
+    if (!id || sftp_wait(s, id, reply, &len) != 0) { *reply = NULL; return -1; }
+    *in = (SftpIn){*reply + 5, *reply + len, 0};
+    return (*reply)[0];
+}
+
+int sftp_call(Sftp *s, SftpBuf *b, SftpIn *in, unsigned char **reply) {
+    return sftp_reply(s, sftp_send(s, b), in, reply);
+}
+
+// Waits for a request answered by a STATUS; 0 when it is SSH_FX_OK.
+int sftp_status(Sftp *s, uint32_t id) {
+    SftpIn in;
+    unsigned char *reply;
+    int ok = sftp_reply(s, id, &in, &reply) == SSH_FXP_STATUS && in_u32(&in) == SSH_FX_OK && !in.bad;
+    free(reply);
+    return ok ? 0 : -1;
+}
+
+// Sends a request that takes a path and nothing else.
+uint32_t sftp_path(Sftp *s, SftpBuf *b, int type, const char *path) {
+    sftp_begin(b, type);
+    sftp_str(b, path, strlen(path));
+    return sftp_send(s, b);
+}
+
+int sftp_stat(Sftp *s, int type, const char *path, SftpAttrs *out) {
+    SftpBuf b = {0};
+    SftpIn in;
+    unsigned char *reply;
+    int ok = sftp_reply(s, sftp_path(s, &b, type, path), &in, &reply) == SSH_FXP_ATTRS;
+    if (ok) *out = in_attrs(&in);
+    free(reply);
+    free(b.data);
+    return ok && !in.bad ? 0 : -1;
+}
+
+// Opens a remote file or directory; handle holds up to 256 bytes.
+int sftp_handle(Sftp *s, SftpBuf *b, int type, const char *path, uint32_t pflags, uint32_t mode, char *handle, uint32_t *hlen) {
+    sftp_begin(b, type);
+    sftp_str(b, path, strlen(path));
+    if (type == SSH_FXP_OPEN) {
+        sftp_u32(b, pflags);
+        sftp_u32(b, mode ? SSH_ATTR_PERMISSIONS : 0);
+        if (mode) sftp_u32(b, mode);
+    }
+    SftpIn in;
+    unsigned char *reply;
+    int ok = sftp_call(s, b, &in, &reply) == SSH_FXP_HANDLE;
+    const char *h = ok ? in_str(&in, hlen) : NULL;
+    ok = ok && !in.bad && *hlen <= 256;
+    if (ok) memcpy(handle, h, *hlen);
+    free(reply);
+    return ok ? 0 : -1;
+}
 
-typedef enum {
-    TYPE_FOLDER,
-    TYPE_TEXT,
-    TYPE_EXEC,
-    TYPE_IMAGE,
-    TYPE_VIDEO,
-    TYPE_OTHER
-} FileType;
+int sftp_close_handle(Sftp *s, SftpBuf *b, const char *handle, uint32_t hlen) {
+    sftp_begin(b, SSH_FXP_CLOSE);
+    sftp_str(b, handle, hlen);
+    return sftp_status(s, sftp_send(s, b));
+}
 
-typedef struct {
-    char *name;
-    FileType type;
-} Entry;
+void sftp_dir_free(SftpDir *d) {
+    free(d->path);
+    free(d->ents);
+    free(d->attrs);
+    arena_reset(&d->names);
+    memset(d, 0, sizeof(*d));
+}
 
-typedef struct {
-    Entry entries[MAX_FILES];
-    int count;
-    int selected;
-    int scroll_offset;
-    char cwd[PATH_MAX_LEN];
-} Panel;
+int sftp_dir_add(SftpDir *d, const char *name, uint32_t len, SftpAttrs at) {
+    if (d->n == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 256;
+        VfsEntry *ents = realloc(d->ents, cap * sizeof(VfsEntry));
+        if (ents) d->ents = ents;
+        SftpAttrs *attrs = realloc(d->attrs, cap * sizeof(SftpAttrs));
+        if (attrs) d->attrs = attrs;
+        if (!ents || !attrs) return -1;
+        d->cap = cap;
+    }
+    char *copy = arena_strndup(&d->names, name, len);
+    if (!copy) return -1;
+    d->ents[d->n] = (VfsEntry){.name = copy, .name_len = len, .size = at.flags & SSH_ATTR_SIZE ? (int64_t)at.size : -1,
+        .mode = at.flags & SSH_ATTR_PERMISSIONS ? at.mode : 0, .node = DU_NONE};
+    d->attrs[d->n++] = at;
+    return 0;
+}
 
-FileType detect_file_type(const char *path, struct stat *st) {
-    if (S_ISDIR(st->st_mode)) return TYPE_FOLDER;
-    if (st->st_mode & S_IXUSR) return TYPE_EXEC;
-    const char *ext = strrchr(path, '.');
-    if (ext) {
-        if (strcmp(ext, ".txt") == 0 || strcmp(ext, ".md") == 0) return TYPE_TEXT;
-        if (strcmp(ext, ".png") == 0 || strcmp(ext, ".jpg") == 0) return TYPE_IMAGE;
-        if (strcmp(ext, ".mp4") == 0 || strcmp(ext, ".mkv") == 0) return TYPE_VIDEO;
+// Lists a remote directory with READDIRs pipelined on one handle; with
+// follow, every symlink is then stat'ed, all in one more round trip.
+int sftp_read_dir(Sftp *s, const char *path, int follow, SftpDir *d) {
+    SftpBuf b = {0};
+    char handle[256];
+    uint32_t hlen, ids[SFTP_WINDOW];
+    int ends[SFTP_WINDOW];
+    if (sftp_handle(s, &b, SSH_FXP_OPENDIR, path, 0, 0, handle, &hlen) != 0) { free(b.data); return -1; }
+    int failed = 0, eof = 0, head = 0, count = 0;
+    while (count || (!eof && !failed)) {
+        while (!eof && !failed && count < SFTP_READDIRS) {
+            sftp_begin(&b, SSH_FXP_READDIR);
+            sftp_str(&b, handle, hlen);
+            if (!(ids[(head + count) % SFTP_READDIRS] = sftp_send(s, &b))) failed = 1;
+            else count++;
+        }
+        if (!count) break;
+        SftpIn in;
+        unsigned char *reply;
+        int type = sftp_reply(s, ids[head], &in, &reply);
+        head = (head + 1) % SFTP_READDIRS;
+        count--;
+        if (type == SSH_FXP_NAME) {
+            for (uint32_t n = in_u32(&in), len, llen; n-- && !in.bad && !failed;) {
+                const char *name = in_str(&in, &len);
+                in_str(&in, &llen);
+                SftpAttrs at = in_attrs(&in);
+                if (!in.bad && sftp_dir_add(d, name, len, at) != 0) failed = 1;
+            }
+            failed |= in.bad;
+        } else {
+            eof = 1;    // replies are in order, so the rest are EOF too
+            if (type != SSH_FXP_STATUS || in_u32(&in) != SSH_FX_EOF) failed = 1;
+        }
+        free(reply);
     }
-    return TYPE_OTHER;
+    sftp_close_handle(s, &b, handle, hlen);
+    char full[PATH_MAX_LEN];
+    head = count = 0;
+    for (int i = 0; follow && !failed && (i < d->n || count);) {
+        while (i < d->n && count < SFTP_WINDOW) {
+            if (!S_ISLNK(d->attrs[i].mode)) { i++; continue; }
+            snprintf(full, sizeof(full), "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", d->ents[i].name);
+            ends[(head + count) % SFTP_WINDOW] = i++;
+            ids[(head + count++) % SFTP_WINDOW] = sftp_path(s, &b, SSH_FXP_STAT, full);
+        }
+        if (!count) break;
+        SftpIn in;
+        unsigned char *reply;
+        VfsEntry *e = &d->ents[ends[head]];
+        if (sftp_reply(s, ids[head], &in, &reply) == SSH_FXP_ATTRS) {
+            SftpAttrs at = in_attrs(&in);
+            e->mode = at.flags & SSH_ATTR_PERMISSIONS ? at.mode : 0;
+            e->size = at.flags & SSH_ATTR_SIZE ? (int64_t)at.size : -1;
+        } else {
+            e->mode = 0;    // dangling, as a local listing shows it
+        }
+        free(reply);
+        head = (head + 1) % SFTP_WINDOW;
+        count--;
+    }
+    free(b.data);
+    return failed ? -1 : 0;
 }
 
-int compare_entries(const void *a, const void *b) {
-    Entry *ea = (Entry *)a;
-    Entry *eb = (Entry *)b;
-    if (ea->type == TYPE_FOLDER && eb->type != TYPE_FOLDER) return -1;
-    if (ea->type != TYPE_FOLDER && eb->type == TYPE_FOLDER) return 1;
-    return strcmp(ea->name, eb->name);
+// Drops the cached listings of path and everything below it.
+void sftp_forget(Sftp *s, const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') len--;
+    for (int i = 0; i < SFTP_CACHE; i++) {
+        const char *p = s->cache[i].path;
+        if (p && !strncmp(p, path, len) && (!p[len] || p[len] == '/')) sftp_dir_free(&s->cache[i]);
+    }
 }
 
-void list_dir(Panel *panel) {
-    DIR *dir = opendir(panel->cwd);
-    if (!dir) return;
+// A listing from the cache, or read into the least recently used slot.
+SftpDir *sftp_list(Sftp *s, const char *path) {
+    SftpDir *slot = &s->cache[0];
+    for (int i = 0; i < SFTP_CACHE; i++) {
+        SftpDir *d = &s->cache[i];
+        if (d->path && !strcmp(d->path, path)) { d->used = ++s->clock; return d; }
+        if (slot->path && (!d->path || d->used < slot->used)) slot = d;
+    }
+    sftp_dir_free(slot);
+    if (sftp_read_dir(s, path, 1, slot) != 0 || !(slot->path = strdup(path))) { sftp_dir_free(slot); return NULL; }
+    slot->used = ++s->clock;
+    return slot;
+}
 
-    panel->count = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && panel->count < MAX_FILES) {
-        if (strcmp(entry->d_name, ".") == 0) continue;  // skip "."
-        panel->entries[panel->count].name = strdup(entry->d_name);
-        char full[PATH_MAX_LEN];
-        snprintf(full, PATH_MAX_LEN, "%s/%s", panel->cwd, entry->d_name);
-        struct stat st;
-        if (stat(full, &st) == 0)
-            panel->entries[panel->count].type = detect_file_type(full, &st);
-        else panel->entries[panel->count].type = TYPE_OTHER;
-        panel->count++;
+// Copies a remote file with up to SFTP_WINDOW READs in flight, asking for
+// no more than the size it was listed with; a short read is asked again
+// for its remainder.
+int sftp_fetch(Sftp *s, const char *remote, const char *local, const SftpAttrs *at) {
+    SftpBuf b = {0};
+    char handle[256];
+    uint32_t hlen;
+    struct { uint32_t id; uint64_t off; uint32_t len; } q[SFTP_WINDOW];
+    if (sftp_handle(s, &b, SSH_FXP_OPEN, remote, SSH_FXF_READ, 0, handle, &hlen) != 0) { free(b.data); return -1; }
+    int fd = open(local, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, at->mode & 0777 ? at->mode & 0777 : 0644);
+    int failed = fd < 0, eof = 0, head = 0, count = 0;
+    uint64_t next = 0, size = at->flags & SSH_ATTR_SIZE ? at->size : UINT64_MAX;
+    while (count || (!eof && !failed && next < size)) {
+        if (atomic_load(&s->cancel)) failed = 1;
+        while (!eof && !failed && next < size && count < SFTP_WINDOW) {
+            sftp_begin(&b, SSH_FXP_READ);
+            sftp_str(&b, handle, hlen);
+            sftp_u64(&b, next);
+            sftp_u32(&b, SFTP_CHUNK);
+            int at = (head + count) % SFTP_WINDOW;
+            q[at].off = next;
+            q[at].len = SFTP_CHUNK;
+            if (!(q[at].id = sftp_send(s, &b))) failed = 1;
+            else count++, next += SFTP_CHUNK;
+        }
+        if (!count) break;
+        SftpIn in;
+        unsigned char *reply;
+        uint64_t off = q[head].off;
+        uint32_t want = q[head].len, n;
+        int type = sftp_reply(s, q[head].id, &in, &reply);
+        head = (head + 1) % SFTP_WINDOW;
+        count--;
+        if (type == SSH_FXP_DATA) {
+            const char *data = in_str(&in, &n);
+            if (in.bad || n > want || pwrite(fd, data, n, off) != (ssize_t)n) failed = 1;
+            else atomic_fetch_add(&s->moved, n);
+            if (!failed && n < want && off + n < size) {
+                sftp_begin(&b, SSH_FXP_READ);
+                sftp_str(&b, handle, hlen);
+                sftp_u64(&b, off + n);
+                sftp_u32(&b, want - n);
+                int at = (head + count) % SFTP_WINDOW;
+                q[at] = (typeof(q[0])){sftp_send(s, &b), off + n, want - n};
+                if (!q[at].id) failed = 1;
+                else count++;
+            }
+        } else if (type == SSH_FXP_STATUS && in_u32(&in) == SSH_FX_EOF) {
+            eof = 1;
+        } else {
+            failed = 1;
+        }
+        free(reply);
     }
-    closedir(dir);
-    qsort(panel->entries, panel->count, sizeof(Entry), compare_entries);
+    sftp_close_handle(s, &b, handle, hlen);
+    free(b.data);
+    if (fd >= 0) {
+        struct timespec times[2] = {{at->atime, 0}, {at->mtime, 0}};
+        if (at->flags & SSH_ATTR_ACMODTIME) futimens(fd, times);
+        failed |= close(fd) != 0;
+        if (failed) unlink(local);
+    }
+    return failed ? -1 : 0;
 }
 
-void free_panel(Panel *panel) {
-    for (int i = 0; i < panel->count; i++) free(panel->entries[i].name);
+// Copies a local file to a new remote one with up to SFTP_WINDOW WRITEs
+// in flight, then sets its times; the CLOSE reports late write errors.
+int sftp_upload(Sftp *s, const char *local, const char *remote) {
+    int fd = open(local, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return -1; }
+    SftpBuf b = {0};
+    char handle[256], buf[SFTP_CHUNK];
+    uint32_t hlen, ids[SFTP_WINDOW];
+    if (sftp_handle(s, &b, SSH_FXP_OPEN, remote, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_EXCL, st.st_mode & 0777,
+                    handle, &hlen) != 0) {
+        free(b.data);
+        close(fd);
+        return -1;
+    }
+    int failed = 0, head = 0, count = 0;
+    for (off_t off = 0; count || (off < st.st_size && !failed);) {
+        if (atomic_load(&s->cancel)) failed = 1;
+        while (!failed && off < st.st_size && count < SFTP_WINDOW) {
+            ssize_t n = pread(fd, buf, sizeof(buf), off);
+            if (n <= 0) { failed = 1; break; }
+            sftp_begin(&b, SSH_FXP_WRITE);
+            sftp_str(&b, handle, hlen);
+            sftp_u64(&b, off);
+            sftp_str(&b, buf, n);
+            if (!(ids[(head + count) % SFTP_WINDOW] = sftp_send(s, &b))) failed = 1;
+            else count++, off += n, atomic_fetch_add(&s->moved, n);
+        }
+        if (!count) break;
+        failed |= sftp_status(s, ids[head]) != 0;
+        head = (head + 1) % SFTP_WINDOW;
+        count--;
+    }
+    sftp_begin(&b, SSH_FXP_FSETSTAT);
+    sftp_str(&b, handle, hlen);
+    sftp_u32(&b, SSH_ATTR_ACMODTIME);
+    sftp_u32(&b, st.st_atime);
+    sftp_u32(&b, st.st_mtime);
+    uint32_t times = sftp_send(s, &b);
+    sftp_begin(&b, SSH_FXP_CLOSE);
+    sftp_str(&b, handle, hlen);
+    uint32_t done = sftp_send(s, &b);
+    sftp_status(s, times);
+    failed |= sftp_status(s, done) != 0;
+    if (failed) sftp_status(s, sftp_path(s, &b, SSH_FXP_REMOVE, remote));
+    free(b.data);
+    close(fd);
+    return failed ? -1 : 0;
 }
 
-void draw_panel(WINDOW *win, Panel *panel, int active) {
-    werase(win); box(win,0,0);
-    mvwprintw(win,0,2,"[ %s ]",panel->cwd);
-    int h,w; getmaxyx(win,h,w);
-    int list_h = h-2;
-    if (panel->selected < panel->scroll_offset) panel->scroll_offset = panel->selected;
-    if (panel->selected >= panel->scroll_offset + list_h) panel->scroll_offset = panel->selected - list_h + 1;
-    for (int i=0;i<list_h;i++) {
-        int idx = panel->scroll_offset + i;
-        if (idx >= panel->count) break;
-        if (idx == panel->selected) wattron(win,A_REVERSE | (active?A_BOLD:0));
-        const char *icon = "";
-        switch(panel->entries[idx].type) {
-            case TYPE_FOLDER: icon = "[DIR]"; break;
-            case TYPE_TEXT: icon = "[TXT]"; break;
-            case TYPE_EXEC: icon = "[EXE]"; break;
-            case TYPE_IMAGE: icon = "[IMG]"; break;
-            case TYPE_VIDEO: icon = "[VID]"; break;
-            default: icon = "[OTH]"; break;
+void sftp_task(Pool *pool, int worker, void *arg) {
+    SftpTask *t = arg;
+    SftpJob *job = pool->ctx;
+    int failed = atomic_load(&job->s->cancel) ||
+                 (t->put ? sftp_upload(job->s, t->from, t->to) : sftp_fetch(job->s, t->from, t->to, &t->at));
+    if (failed) atomic_store(&job->failed, 1);
+    free(t);
+}
+
+void sftp_queue(SftpJob *job, int put, const char *from, const char *to, const SftpAttrs *at) {
+    size_t flen = strlen(from) + 1;
+    SftpTask *t = malloc(sizeof(SftpTask) + flen + strlen(to) + 1);
+    if (!t) { atomic_store(&job->failed, 1); return; }
+    *t = (SftpTask){.put = put};
+    if (at) t->at = *at;
+    memcpy(t->from, from, flen);
+    t->to = t->from + flen;
+    strcpy(t->to, to);
+    pool_push(&job->pool, -1, t);
+}
+
+// Walks a remote tree into a new local one; directories and links are made
+// here, files are queued for the job's pool.
+int sftp_get_walk(SftpJob *job, const char *remote, const char *local, const SftpAttrs *at) {
+    Sftp *s = job->s;
+    if (S_ISREG(at->mode)) { sftp_queue(job, 0, remote, local, at); return 0; }
+    if (S_ISLNK(at->mode)) {
+        SftpBuf b = {0};
+        SftpIn in;
+        unsigned char *reply;
+        uint32_t len;
+        int ok = sftp_reply(s, sftp_path(s, &b, SSH_FXP_READLINK, remote), &in, &reply) == SSH_FXP_NAME &&
+                 in_u32(&in) == 1;
+        const char *target = ok ? in_str(&in, &len) : NULL;
+        char link[PATH_MAX_LEN];
+        ok = ok && !in.bad && len < sizeof(link);
+        if (ok) { memcpy(link, target, len); link[len] = '\0'; }
+        free(reply);
+        free(b.data);
+        return ok ? symlink(link, local) : -1;
+    }
+    if (!S_ISDIR(at->mode) || mkdir(local, 0700) != 0) return -1;
+    SftpDir d = {0};
+    int failed = sftp_read_dir(s, remote, 0, &d) != 0;
+    char from[PATH_MAX_LEN], to[PATH_MAX_LEN];
+    for (int i = 0; i < d.n && !failed; i++) {
+        const char *name = d.ents[i].name;
+        if (is_dot_entry(name)) continue;
+        if (atomic_load(&s->cancel)) { failed = 1; break; }
+        snprintf(from, sizeof(from), "%s%s%s", remote, remote[strlen(remote) - 1] == '/' ? "" : "/", name);
+        snprintf(to, sizeof(to), "%s/%s", local, name);
+        failed |= sftp_get_walk(job, from, to, &d.attrs[i]) != 0;
+    }
+    sftp_dir_free(&d);
+    chmod(local, (at->mode & 07777) | 0700);
+    return failed ? -1 : 0;
+}
+
+int sftp_put_walk(SftpJob *job, const char *local, const char *remote) {
+    Sftp *s = job->s;
+    struct stat st;
+    if (lstat(local, &st) != 0) return -1;
+    if (S_ISREG(st.st_mode)) { sftp_queue(job, 1, local, remote, NULL); return 0; }
+    SftpBuf b = {0};
+    if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX_LEN];
+        ssize_t n = readlink(local, link, sizeof(link) - 1);
+        if (n < 0) return -1;
+        // OpenSSH takes the target first, against the draft's order.
+        sftp_begin(&b, SSH_FXP_SYMLINK);
+        sftp_str(&b, link, n);
+        sftp_str(&b, remote, strlen(remote));
+        int failed = sftp_status(s, sftp_send(s, &b)) != 0;
+        free(b.data);
+        return failed ? -1 : 0;
+    }
+    sftp_begin(&b, SSH_FXP_MKDIR);
+    sftp_str(&b, remote, strlen(remote));
+    sftp_u32(&b, SSH_ATTR_PERMISSIONS);
+    sftp_u32(&b, (st.st_mode & 0777) | 0700);
+    int failed = !S_ISDIR(st.st_mode) || sftp_status(s, sftp_send(s, &b)) != 0;
+    free(b.data);
+    DIR *dir = failed ? NULL : opendir(local);
+    if (!dir) return -1;
+    struct dirent *de;
+    char from[PATH_MAX_LEN], to[PATH_MAX_LEN];
+    while ((de = readdir(dir)) != NULL && !failed) {
+        if (is_dot_entry(de->d_name)) continue;
+        if (atomic_load(&s->cancel)) { failed = 1; break; }
+        snprintf(from, sizeof(from), "%s/%s", local, de->d_name);
+        snprintf(to, sizeof(to), "%s/%s", remote, de->d_name);
+        failed |= sftp_put_walk(job, from, to) != 0;
+    }
+    closedir(dir);
+    return failed ? -1 : 0;
+}
+
+// Removes a remote tree; the files of each directory go in one pipelined
+// batch of REMOVEs.
+int sftp_remove(Sftp *s, const char *remote, const SftpAttrs *at) {
+    SftpBuf b = {0};
+    if (!S_ISDIR(at->mode)) {
+        int failed = sftp_status(s, sftp_path(s, &b, SSH_FXP_REMOVE, remote)) != 0;
+        free(b.data);
+        return failed ? -1 : 0;
+    }
+    SftpDir d = {0};
+    int failed = sftp_read_dir(s, remote, 0, &d) != 0, head = 0, count = 0;
+    uint32_t ids[SFTP_WINDOW];
+    char path[PATH_MAX_LEN];
+    for (int i = 0; !failed && (i < d.n || count);) {
+        while (i < d.n && count < SFTP_WINDOW) {
+            const char *name = d.ents[i].name;
+            int dir = S_ISDIR(d.attrs[i].mode);
+            snprintf(path, sizeof(path), "%s/%s", remote, name);
+            if (is_dot_entry(name)) { i++; continue; }
+            if (dir) { failed |= sftp_remove(s, path, &d.attrs[i++]) != 0; continue; }
+            ids[(head + count++) % SFTP_WINDOW] = sftp_path(s, &b, SSH_FXP_REMOVE, path);
+            i++;
         }
-        if (panel->entries[idx].type == TYPE_FOLDER)
-            mvwprintw(win,i+1,1,"%-6s /%s",icon,panel->entries[idx].name);
-        else
-            mvwprintw(win,i+1,1,"%-6s %s",icon,panel->entries[idx].name);
-        if (idx == panel->selected) wattroff(win,A_REVERSE | (active?A_BOLD:0));
+        if (!count) continue;
+        failed |= sftp_status(s, ids[head]) != 0;
+        head = (head + 1) % SFTP_WINDOW;
+        count--;
     }
-    wrefresh(win);
+    while (count) { sftp_status(s, ids[head]); head = (head + 1) % SFTP_WINDOW; count--; }
+    sftp_dir_free(&d);
+    failed |= sftp_status(s, sftp_path(s, &b, SSH_FXP_RMDIR, remote)) != 0;
+    free(b.data);
+    return failed ? -1 : 0;
 }
 
-void draw_terminal(WINDOW *win, char *input, const char *status, int rename_mode, char *rename_buf) {
-    werase(win); box(win,0,0);
-    mvwprintw(win,0,2,"[ Terminal | F1: Copy | F2: Paste | F3: Rename | F5: Delete | q: Quit ]");
-    if (rename_mode)
-        mvwprintw(win,1,1,"Rename to: %s", rename_buf);
-    else
-        mvwprintw(win,1,1,"> %s", input);
-    if (status) mvwprintw(win,2,1,"%s", status);
-    wrefresh(win);
+// The remote path of a panel path on this connection.
+const char *sftp_remote(Sftp *s, const char *path) {
+    const char *rel = path + strlen(s->root);
+    return *rel ? rel : "/";
 }
 
-void open_entry(Panel *p) {
-    char *sel = p->entries[p->selected].name;
-    if (!strcmp(sel,"..")) chdir("..");
-    else {
-        Entry *e = &p->entries[p->selected];
-        if (e->type == TYPE_FOLDER) {
-            chdir(sel);
-        } else if (e->type == TYPE_TEXT) {
-            def_prog_mode();
-            endwin();
-            char cmd[PATH_MAX_LEN + 64];
-            snprintf(cmd, sizeof(cmd), "nano \"%s\"", sel);
-            system(cmd);
-            reset_prog_mode();
-            refresh();
-        } else {
-            if (fork() == 0) {
-                char cmd[PATH_MAX_LEN + 64];
-                snprintf(cmd, sizeof(cmd), "xdg-open \"%s\" > /dev/null 2>&1", sel);
-                execlp("sh", "sh", "-c", cmd, NULL);
-                exit(1);
+void *sftp_open_dir(Vfs *fs, const char *path) {
+    Sftp *s = fs->ctx;
+    SftpDir *d = sftp_list(s, sftp_remote(s, path));
+    SftpHandle *h = d ? malloc(sizeof(SftpHandle)) : NULL;
+    if (h) *h = (SftpHandle){d, 0};
+    return h;
+}
+
+int sftp_read_batch(Vfs *fs, void *dir, VfsEntry *out, int max) {
+    SftpHandle *h = dir;
+    int n = h->dir->n - h->next < max ? h->dir->n - h->next : max;
+    memcpy(out, h->dir->ents + h->next, n * sizeof(VfsEntry));
+    h->next += n;
+    return n;
+}
+
+void sftp_close_dir(Vfs *fs, void *dir) {
+    free(dir);
+}
+
+int sftp_vfs_stat(Vfs *fs, const char *path, VfsEntry *out) {
+    Sftp *s = fs->ctx;
+    SftpAttrs at;
+    if (sftp_stat(s, SSH_FXP_LSTAT, sftp_remote(s, path), &at) != 0) return -1;
+    *out = (VfsEntry){.name = path, .name_len = strlen(path), .mode = at.mode,
+        .size = at.flags & SSH_ATTR_SIZE ? (int64_t)at.size : -1, .node = DU_NONE};
+    return 0;
+}
+
+// Runs a copy in or out: the walk queues the files, then SFTP_STREAMS of
+// them are in flight at once over the one connection.
+int sftp_transfer(Sftp *s, int put, const char *from, const char *to) {
+    SftpJob job = {.s = s};
+    SftpAttrs at;
+    atomic_init(&job.failed, 0);
+    pool_init_workers(&job.pool, sftp_task, &job, SFTP_STREAMS);
+    int failed = put ? sftp_put_walk(&job, from, to) != 0
+                     : sftp_stat(s, SSH_FXP_LSTAT, from, &at) != 0 || sftp_get_walk(&job, from, to, &at) != 0;
+    pool_run(&job.pool);
+    pool_join(&job.pool, 0);
+    return failed || atomic_load(&job.failed) ? -1 : 0;
+}
+
+int sftp_get(Vfs *fs, const char *path, const char *local) {
+    Sftp *s = fs->ctx;
+    return sftp_transfer(s, 0, sftp_remote(s, path), local);
+}
+
+int sftp_vfs_put(Vfs *fs, const char *local, const char *path) {
+    Sftp *s = fs->ctx;
+    const char *remote = sftp_remote(s, path);
+    sftp_forget(s, remote);
+    return sftp_transfer(s, 1, local, remote);
+}
+
+// Removes a file or a whole tree; as locally, "." and ".." are refused.
+int sftp_unlink(Vfs *fs, const char *path) {
+    Sftp *s = fs->ctx;
+    const char *remote = sftp_remote(s, path), *base = strrchr(remote, '/');
+    if (is_dot_entry(base ? base + 1 : remote)) return -1;
+    SftpAttrs at;
+    sftp_forget(s, remote);
+    return sftp_stat(s, SSH_FXP_LSTAT, remote, &at) == 0 ? sftp_remove(s, remote, &at) : -1;
+}
+
+int sftp_rename(Vfs *fs, const char *from, const char *to) {
+    Sftp *s = fs->ctx;
+    SftpBuf b = {0};
+    sftp_forget(s, sftp_remote(s, from));
+    sftp_begin(&b, SSH_FXP_RENAME);
+    sftp_str(&b, sftp_remote(s, from), strlen(sftp_remote(s, from)));
+    sftp_str(&b, sftp_remote(s, to), strlen(sftp_remote(s, to)));
+    int failed = sftp_status(s, sftp_send(s, &b)) != 0;
+    free(b.data);
+    return failed ? -1 : 0;
+}
+
+void sftp_vfs_forget(Vfs *fs, const char *path) {
+    Sftp *s = fs->ctx;
+    sftp_forget(s, sftp_remote(s, path));
+}
+
+const VfsOps sftp_ops = {
+    .caps = VFS_WRITE | VFS_STATS,
+    .open_dir = sftp_open_dir,
+    .read_batch = sftp_read_batch,
+    .close_dir = sftp_close_dir,
+    .stat = sftp_vfs_stat,
+    .get = sftp_get,
+    .put = sftp_vfs_put,
+    .unlink = sftp_unlink,
+    .rename = sftp_rename,
+    .forget = sftp_vfs_forget,
+};
+
+void sftp_close(Sftp *s) {
+    vfs_unmount(&s->vfs);
+    shutdown(s->fd, SHUT_RDWR);
+    pthread_join(s->reader, NULL);
+    close(s->fd);
+    kill(s->pid, SIGTERM);
+    waitpid(s->pid, NULL, 0);
+    for (int i = 0; i < SFTP_SLOTS; i++) free(s->slots[i].reply);
+    for (int i = 0; i < SFTP_CACHE; i++) sftp_dir_free(&s->cache[i]);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->write_lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
+
+// Starts "ssh -s host sftp" on a socket pair and resolves path (the login
+// directory when empty) to the absolute one the panel opens at. ssh runs
+// in batch mode in its own session, so it never prompts on the terminal.
+Sftp *sftp_connect(const char *host, const char *path, char *cwd, size_t size) {
+    int sv[2];
+    if (!host[0] || host[0] == '-' || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) return NULL;
+    Sftp *s = calloc(1, sizeof(Sftp));
+    char *argv[] = {"ssh", "-oBatchMode=yes", "-oConnectTimeout=10", "-s", (char *)host, "sftp", NULL};
+    const int fds[3] = {sv[1], sv[1], -2};
+    pid_t pid = s ? spawn(argv, fds, 1) : -1;
+    close(sv[1]);
+    if (pid < 0) { close(sv[0]); free(s); return NULL; }
+    s->pid = pid;
+    s->fd = sv[0];
+    s->next_id = 1;
+    snprintf(s->root, sizeof(s->root), "sftp://%s", host);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->write_lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    s->slots[0].state = SLOT_WAIT;
+    s->inflight = 1;
+    clock_gettime(CLOCK_MONOTONIC, &s->heard);
+    if (pthread_create(&s->reader, NULL, sftp_reader, s) != 0) {
+        close(s->fd);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        free(s);
+        return NULL;
+    }
+    unsigned char init[] = {0, 0, 0, 5, SSH_FXP_INIT, 0, 0, 0, 3}, *reply = NULL;
+    uint32_t len, rlen;
+    SftpBuf b = {0};
+    SftpIn in;
+    int ok = send(s->fd, init, sizeof(init), MSG_NOSIGNAL) == sizeof(init) && sftp_wait(s, 0, &reply, &len) == 0 &&
+             len >= 5 && ((uint32_t)reply[1] << 24 | reply[2] << 16 | reply[3] << 8 | reply[4]) >= 3;
+    free(reply);
+    reply = NULL;
+    ok = ok && sftp_reply(s, sftp_path(s, &b, SSH_FXP_REALPATH, path[0] ? path : "."), &in, &reply) == SSH_FXP_NAME &&
+         in_u32(&in) == 1;
+    const char *real = ok ? in_str(&in, &rlen) : "";
+    ok = ok && !in.bad && rlen && real[0] == '/' && strlen(s->root) + rlen < size;
+    if (ok) snprintf(cwd, size, "%s%.*s", s->root, (int)rlen, real);
+    free(reply);
+    free(b.data);
+    if (!ok) { sftp_close(s); return NULL; }
+    s->vfs = (Vfs){&sftp_ops, s, s->root};
+    vfs_mount(&s->vfs);
+    return s;
+}
+
+CopyJob *copy_job;
+
+void copy_task(Pool *pool, int worker, void *arg) {
+    CopyJob *job = pool->ctx;
+    job->failed = sftp_transfer(job->s, job->put, job->from, job->to) != 0;
+}
+
+// Whether a paste from src to dst goes to the background: one side is
+// local and the other an SFTP panel.
+int copy_backgrounds(Vfs *src, Vfs *dst) {
+    return (src == &vfs_local && dst->ops == &sftp_ops) || (src->ops == &sftp_ops && dst == &vfs_local);
+}
+
+// Starts copying from to to, on one worker that runs the usual parallel
+// transfer. The remote listing is forgotten here, as the cache belongs to
+// the UI thread. Fails while another copy runs.
+int copy_start(Vfs *src, const char *from, Vfs *dst, const char *to) {
+    CopyJob *job = copy_job ? NULL : calloc(1, sizeof(CopyJob));
+    if (!job) return -1;
+    job->put = src == &vfs_local;
+    job->s = (job->put ? dst : src)->ctx;
+    snprintf(job->from, sizeof(job->from), "%s", job->put ? from : sftp_remote(job->s, from));
+    snprintf(job->to, sizeof(job->to), "%s", job->put ? sftp_remote(job->s, to) : to);
+    if (job->put) sftp_forget(job->s, job->to);
+    atomic_store(&job->s->cancel, 0);
+    atomic_store(&job->s->moved, 0);
+    pool_init_workers(&job->pool, copy_task, job, 1);
+    pool_push(&job->pool, -1, job);
+    copy_job = job;
+    pool_run(&job->pool);
+    return 0;
+}
+
+void copy_cancel(void) {
+    if (copy_job) atomic_store(&copy_job->s->cancel, 1);
+}
+
+// Abandons the copy along with its connection, which is about to close:
+// shutting it wakes every waiter at once, however stalled the link.
+void copy_stop(void) {
+    CopyJob *job = copy_job;
+    if (!job) return;
+    copy_cancel();
+    shutdown(job->s->fd, SHUT_RDWR);
+    pool_join(&job->pool, 1);
+    free(job);
+    copy_job = NULL;
+}
+
+// Reports progress while the copy runs; once it is over, reaps the worker
+// and reloads both panels. Returns 1 while it runs.
+int copy_update(Panel *a, Panel *b, char *status, size_t size) {
+    CopyJob *job = copy_job;
+    if (!job) return 0;
+    const char *base = strrchr(job->to, '/') ? strrchr(job->to, '/') + 1 : job->to;
+    char moved[16];
+    format_size(atomic_load(&job->s->moved), moved, sizeof(moved));
+    if (atomic_load(&job->pool.pending)) {
+        snprintf(status, size, "Copying %s: %s (Esc: cancel)", base, moved);
+        return 1;
+    }
+    pool_join(&job->pool, 0);
+    if (atomic_load(&job->s->cancel)) snprintf(status, size, "Copy of %s cancelled", base);
+    else snprintf(status, size, job->failed ? "Cannot paste %s" : "Pasted %s (%s)", base, moved);
+    free(job);
+    copy_job = NULL;
+    reload_panel(a);
+    reload_panel(b);
+    return 0;
+}
+
+// Opens "host" or "host:path" in the panel, over a new connection.
+int sftp_open(Panel *p, const char *target) {
+    char host[256], cwd[PATH_MAX_LEN];
+    const char *colon = strchr(target, ':');
+    int hlen = colon ? colon - target : (int)strlen(target);
+    if (hlen >= (int)sizeof(host)) return -1;
+    snprintf(host, sizeof(host), "%.*s", hlen, target);
+    Sftp *s = sftp_connect(host, colon ? colon + 1 : "", cwd, sizeof(cwd));
+    if (!s) return -1;
+    size_cancel(p);
+    find_stop(p);
+    dup_stop(p);
+    grep_close(p);
+    clear_filter(p);
+    p->du_active = 0;
+    snprintf(s->back, sizeof(s->back), "%s", p->cwd);
+    p->sftp = s;
+    p->vfs = &s->vfs;
+    snprintf(p->cwd, sizeof(p->cwd), "%s", cwd);
+    free_panel(p);
+    p->selected = p->scroll_offset = 0;
+    if (list_dir(p) != 0) {
+        snprintf(p->cwd, sizeof(p->cwd), "%s", s->root);
+        strcat(p->cwd, "/");
+        list_dir(p);
+    }
+    return 0;
+}
+
+// Closes the panel's connection and lists the directory it was opened from.
+void sftp_leave(Panel *p) {
+    Sftp *s = p->sftp;
+    if (!s) return;
+    if (copy_job && copy_job->s == s) copy_stop();
+    p->sftp = NULL;
+    p->vfs = &vfs_local;
+    clear_filter(p);
+    snprintf(p->cwd, sizeof(p->cwd), "%s", s->back);
+    sftp_close(s);
+    free_panel(p); list_dir(p);
+    p->selected = p->scroll_offset = 0;
+}
+
+// Returns -1 (and leaves) once the panel's ssh has gone away.
+int sftp_update(Panel *p) {
+    Sftp *s = p->sftp;
+    if (!s) return 0;
+    pthread_mutex_lock(&s->lock);
+    int dead = s->dead;
+    pthread_mutex_unlock(&s->lock);
+    if (!dead) return 0;
+    sftp_leave(p);
+    return -1;
+}
+
+Message messages[MESSAGE_LOG];   // ring, oldest at message_head
+int message_head, message_count;
+int status_timer = -1;
+
+// Logs msg, which the caller has put in the status line, and has it taken
+// down after STATUS_MS. Keys go on being handled meanwhile; the timer is
+// part of the main loop's poll set.
+void status_post(const char *msg) {
+    Message *m = &messages[(message_head + message_count) % MESSAGE_LOG];
+    if (message_count < MESSAGE_LOG) message_count++;
+    else message_head = (message_head + 1) % MESSAGE_LOG;
+    m->at = time(NULL);
+    snprintf(m->text, sizeof(m->text), "%s", msg);
+    if (status_timer < 0) status_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = {.it_value = {STATUS_MS / 1000, STATUS_MS % 1000 * 1000000L}};
+    if (status_timer >= 0) timerfd_settime(status_timer, 0, &its, NULL);
+}
+
+// Clears the status line when the timer has fired, unless something else
+// has been put there since the last message.
+void status_expire(char *status) {
+    uint64_t fired;
+    if (status_timer < 0 || read(status_timer, &fired, sizeof(fired)) != sizeof(fired)) return;
+    if (message_count && !strcmp(status, messages[(message_head + message_count - 1) % MESSAGE_LOG].text))
+        status[0] = '\0';
+}
+
+// The newest messages, with their times, above the input line.
+void draw_messages(WINDOW *win) {
+    int h, w;
+    getmaxyx(win, h, w);
+    int rows = h - 3;
+    for (int r = 0; r < rows && r < message_count; r++) {
+        Message *m = &messages[(message_head + message_count - 1 - r) % MESSAGE_LOG];
+        char at[16];
+        struct tm tm;
+        localtime_r(&m->at, &tm);
+        strftime(at, sizeof(at), "%H:%M:%S", &tm);
+        mvwprintw(win, rows - r, 1, "%s  %.*s", at, w > 12 ? w - 12 : 0, m->text);
+    }
+    if (!message_count) mvwaddstr(win, 1, 1, "No messages");
+    wnoutrefresh(win);
+}
+
+// Per action, from a key arriving to its handler returning, and to the
+// frame that shows it being sent to the terminal.
+Histogram latency_handled[ACT_COUNT], latency_frame[ACT_COUNT];
+const char *action_names[ACT_COUNT] = {"navigate", "open", "copy", "delete", "refresh", "command", "edit", "other"};
+
+// Which histograms a key's latency goes to. While a prompt or the filter
+// takes text, typing is editing whatever the key.
+int key_action(int ch, int editing, int ilen) {
+    if (editing && (ch == '\n' || ch == 27 || ch == 127 || ch == KEY_BACKSPACE || (ch >= ' ' && ch < 256))) return ACT_EDIT;
+    switch (ch) {
+    case KEY_UP: case KEY_DOWN: case KEY_PPAGE: case KEY_NPAGE: case KEY_HOME: case KEY_END: case '\t':
+        return ACT_NAVIGATE;
+    case '\n':
+        return ilen ? ACT_COMMAND : ACT_OPEN;
+    case KEY_F(1): case KEY_F(2):
+        return ACT_COPY;
+    case KEY_F(5):
+        return ACT_DELETE;
+    case 18:  // Ctrl-R
+        return ACT_REFRESH;
+    }
+    return (ch >= ' ' && ch < 256) || ch == 127 || ch == KEY_BACKSPACE ? ACT_EDIT : ACT_OTHER;
+}
+
+void format_us(char *out, size_t size, uint64_t us) {
+    if (us < 10000) snprintf(out, size, "%lluus", (unsigned long long)us);
+    else if (us < 10000000) snprintf(out, size, "%.1fms", us / 1000.0);
+    else snprintf(out, size, "%.1fs", us / 1000000.0);
+}
+
+// Writes the percentiles of every action that has samples to path.
+int latency_report(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    static const double qs[] = {0.5, 0.9, 0.99, 0.999, 1};
+    fprintf(f, "%-9s %-8s %9s %9s %9s %9s %9s %9s %9s\n", "action", "until", "samples", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int a = 0; a < ACT_COUNT; a++) {
+        for (int stage = 0; stage < 2; stage++) {
+            const Histogram *h = stage ? &latency_frame[a] : &latency_handled[a];
+            if (!h->n) continue;
+            char v[16];
+            fprintf(f, "%-9s %-8s %9llu", action_names[a], stage ? "frame" : "handled", (unsigned long long)h->n);
+            format_us(v, sizeof(v), h->sum / h->n);
+            fprintf(f, " %9s", v);
+            for (int i = 0; i < 5; i++) {
+                format_us(v, sizeof(v), hist_value(h, qs[i]));
+                fprintf(f, " %9s", v);
             }
+            fprintf(f, "\n");
         }
     }
-    getcwd(p->cwd, PATH_MAX_LEN); free_panel(p); list_dir(p);
-    p->selected = p->scroll_offset = 0;
+    return fclose(f) == 0 ? 0 : -1;
 }
 
-void sleep_ms(int ms) {
-    timeout(ms);
-    getch();
-    timeout(1000);
+// Where ^A writes the report: $MYCOMMANDER_LATENCY, which also has it
+// written at exit, or else a file in the private temporary directory,
+// removed once viewed. Returns 1 for the latter, -1 if there is neither.
+int latency_path(char *out, size_t size) {
+    const char *env = getenv("MYCOMMANDER_LATENCY");
+    if (env && env[0]) { snprintf(out, size, "%s", env); return 0; }
+    if (vfs_tmp_dir() != 0) return -1;
+    snprintf(out, size, "%s/latency.txt", vfs_tmp);
+    return 1;
 }
 
 int main() {
-    Panel l,r; getcwd(l.cwd,PATH_MAX_LEN); strcpy(r.cwd,"/");
+    Panel l = {.vfs = &vfs_local}, r = {.vfs = &vfs_local}; getcwd(l.cwd,PATH_MAX_LEN); strcpy(r.cwd,"/");
     list_dir(&l); list_dir(&r);
 
     int h,w; initscr(); noecho(); curs_set(0); keypad(stdscr,1);
     getmaxyx(stdscr,h,w);
+    struct sigaction sa = {.sa_handler = on_interrupt};
+    sigaction(SIGINT, &sa, NULL);
+    map_guard_init();
 
     const int terminal_height = 3;
     int ph = h - terminal_height;
     int th = terminal_height;
+    int shell_shown = 0;    // the terminal window takes half the screen for the shell's output
+    int shell_follow = 0;   // the active panel moves to wherever a command leaves the shell
+    int messages_shown = 0; // the same, for the message log instead
 
     WINDOW *lw = newwin(ph,w/2,0,0);
     WINDOW *rw = newwin(ph,w/2,0,w/2);
@@ -174,8 +8410,10 @@ int main() {
     char input[512]={0}; int ilen=0;
     char clipboard[PATH_MAX_LEN] = "";
     char status[256] = "";
-    int rename_mode = 0;
-    char rename_buf[PATH_MAX_LEN] = "";
+    enum {PROMPT_NONE, PROMPT_RENAME, PROMPT_PATTERN, PROMPT_MARK, PROMPT_PERCENT, PROMPT_GREP, PROMPT_FIND, PROMPT_SYNC, PROMPT_CONNECT} prompt = PROMPT_NONE;
+    char prompt_buf[PATH_MAX_LEN] = "";
+    int filter_mode = 0;
+    char filter_prompt[64];
 
     nodelay(stdscr, TRUE);
     timeout(1000);
@@ -184,7 +8422,11 @@ int main() {
 
     draw_panel(lw,&l,focus==FOCUS_L);
     draw_panel(rw,&r,focus==FOCUS_R);
-    draw_terminal(tw,input,status,rename_mode,rename_buf);
+    draw_terminal(tw,input,status,NULL,NULL);
+    doupdate();
+    long last_frame = now_ms();
+    long latency_pending[ACT_COUNT] = {0};  // the first key of each action not yet on screen
+    long input_at = 0;                      // when the keys queued now were first seen
 
     while(1) {
         getmaxyx(stdscr,h,w);
@@ -198,60 +8440,201 @@ int main() {
             continue;
         }
 
-        if (h != last_h || w != last_w) {
-            ph = h - terminal_height;
-            th = terminal_height;
+        if (h != last_h || w != last_w || th != (shell_shown || messages_shown ? h/2 : terminal_height)) {
+            th = shell_shown || messages_shown ? h/2 : terminal_height;
+            ph = h - th;
 
             wresize(lw, ph, w/2);
             wresize(rw, ph, w/2);
+            mvwin(tw, ph, 0);
             wresize(tw, th, w);
 
             mvwin(rw, 0, w/2);
             mvwin(tw, ph, 0);
+            if (shell) shell_resize(shell, th - 3, w - 2);
 
             last_w = w; last_h = h;
         }
 
+        int wait;
+        if ((l.du_active && l.du->npending) || (r.du_active && r.du->npending)) wait = 0;
+        else wait = (l.sizing || r.sizing || (l.grep && !l.grep->done) || (r.grep && !r.grep->done) ||
+            (l.find && !l.find->done) || (r.find && !r.find->done) || (l.dups && !l.dups->applied) ||
+            (r.dups && !r.dups->applied) || (l.arc && l.arc_dir == ARC_NONE) || (r.arc && r.arc_dir == ARC_NONE) || compare_job || (sync_job && (sync_job->planning || sync_job->running)) || copy_job ? FRAME_MAX_MS * 2 : 1000);
+        // Output from the shell and background processes, and the status
+        // line's timer, wake the loop as a key does.
+        struct pollfd fds[3 + 2 * PROC_MAX] = {{STDIN_FILENO, POLLIN, 0}};
+        int nfds = 1;
+        if (status_timer >= 0) fds[nfds++] = (struct pollfd){status_timer, POLLIN, 0};
+        if (shell && shell->fd >= 0) fds[nfds++] = (struct pollfd){shell->fd, POLLIN, 0};
+        nfds += proc_fds(fds + nfds);
+        if (wait) {
+            poll(fds, nfds, wait);
+            if ((fds[0].revents & POLLIN) && !input_at) input_at = now_us();
+            wait = 0;
+        }
+        timeout(wait);
         int ch = getch();
-        if (ch == 'q') break;
+        // Keys drained from one wake all arrived by the time it was seen; the
+        // next key to find the queue empty starts a new stamp.
+        if (ch != ERR && !input_at) input_at = now_us();
+        long key_at = ch != ERR ? input_at : 0;
+        if (ch == ERR || !input_pending(0)) input_at = 0;
+        int action = key_action(ch, prompt || filter_mode, ilen);
+        latency_skip = 0;
+        if (interrupted) {
+            interrupted = 0;
+            if (!shell_shown) break;
+            if (shell && shell->fd >= 0) write_all(shell->fd, "\x03", 1);
+        }
+        if (ch == 'q' && !prompt && !filter_mode && !ilen) break;
 
-        if (rename_mode) {
+        if (prompt == PROMPT_SYNC) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r, *other = p == &l ? &r : &l;
+            if (ch == '\n') {
+                if (sync_start() == 0) prompt = PROMPT_NONE;
+            } else if (ch == 27 || ch == 'q') {
+                sync_stop();
+                prompt = PROMPT_NONE;
+            } else if ((ch == 'd' || ch == 't' || ch == 'h') && sync_job && !sync_job->planning) {
+                int two_way = sync_job->two_way ^ (ch == 't');
+                int remove = sync_job->remove ^ (ch == 'd');
+                int verify = sync_job->verify ^ (ch == 'h');
+                sync_plan(p, other, two_way, remove, verify);
+            }
+            if (prompt == PROMPT_SYNC && sync_job) {
+                sync_summary(sync_job, prompt_buf, sizeof(prompt_buf));
+                sync_help(sync_job, status, sizeof(status));
+            } else {
+                status[0] = '\0';
+            }
+        } else if (prompt) {
             if (ch == '\n') {
                 Panel *p = (focus == FOCUS_L) ? &l : &r;
-                char oldpath[PATH_MAX_LEN], newpath[PATH_MAX_LEN];
-                snprintf(oldpath, sizeof(oldpath), "%s/%s", p->cwd, p->entries[p->selected].name);
-                snprintf(newpath, sizeof(newpath), "%s/%s", p->cwd, rename_buf);
-                rename(oldpath, newpath);
-                free_panel(p); list_dir(p);
-                rename_mode = 0;
-                rename_buf[0] = '\0';
-            } else if (ch == KEY_F(3)) {
-                rename_mode = 0;
-                rename_buf[0] = '\0';
+                Entry *e = cur_entry(p);
+                if (prompt == PROMPT_RENAME && e) {
+                    // A find result's name is a path below cwd; the new name
+                    // goes in the same directory.
+                    char oldpath[PATH_MAX_LEN], newpath[PATH_MAX_LEN];
+                    const char *slash = strrchr(e->name, '/');
+                    int dir = slash ? (int)(slash - e->name) + 1 : 0;
+                    snprintf(oldpath, sizeof(oldpath), "%s/%s", p->cwd, e->name);
+                    snprintf(newpath, sizeof(newpath), "%s/%.*s%s", p->cwd, dir, e->name, prompt_buf);
+                    p->vfs->ops->rename(p->vfs, oldpath, newpath);
+                    reload_panel(p);
+                } else if (prompt == PROMPT_PERCENT && prompt_buf[0]) {
+                    int pct = atoi(prompt_buf);
+                    if (pct > 100) pct = 100;
+                    move_selection(p, (long)(panel_rows(p) - 1) * pct / 100, ph - 2);
+                } else if (prompt == PROMPT_GREP && prompt_buf[0] && strcmp(prompt_buf, "/")) {
+                    if (grep_start(p, prompt_buf) != 0) {
+                        snprintf(status, sizeof(status), "Invalid regex: %s", prompt_buf + 1);
+                        status_post(status);
+                    }
+                } else if (prompt == PROMPT_FIND && prompt_buf[0]) {
+                    if (find_start(p, prompt_buf) != 0) {
+                        snprintf(status, sizeof(status), "Invalid pattern: %s", prompt_buf);
+                        status_post(status);
+                    }
+                } else if (prompt == PROMPT_CONNECT && prompt_buf[0]) {
+                    snprintf(status, sizeof(status), "Connecting to %s", prompt_buf);
+                    draw_terminal(tw,input,status,NULL,NULL);
+                    doupdate();
+                    if (sftp_open(p, prompt_buf) != 0) {
+                        snprintf(status, sizeof(status), "Cannot connect to %s", prompt_buf);
+                        status_post(status);
+                    } else {
+                        status[0] = '\0';
+                    }
+                } else if (prompt == PROMPT_PATTERN && !prompt_buf[0]) {
+                    clear_filter(p);
+                } else if (prompt == PROMPT_PATTERN || prompt == PROMPT_MARK) {
+                    Pattern *pat = compile_pattern(prompt_buf);
+                    if (!pat) {
+                        snprintf(status, sizeof(status), "Invalid pattern: %s", prompt_buf);
+                    } else if (prompt == PROMPT_PATTERN) {
+                        clear_filter(p);
+                        snprintf(p->filter, sizeof(p->filter), "%s", prompt_buf);
+                        p->filter_kind = FILTER_PATTERN;
+                        p->filtered = p->filter_dirty = 1;
+                    } else {
+                        int n = mark_matches(p, pat);
+                        snprintf(status, sizeof(status), "Marked %d, %d total", n, p->marked);
+                    }
+                    if (status[0]) status_post(status);
+                }
+                prompt = PROMPT_NONE;
+                prompt_buf[0] = '\0';
+            } else if (ch == 27 || ch == KEY_F(3)) {
+                prompt = PROMPT_NONE;
+                prompt_buf[0] = '\0';
             } else if (ch == 127 || ch == KEY_BACKSPACE) {
-                int l = strlen(rename_buf);
-                if (l > 0) rename_buf[l-1] = '\0';
-            } else if (ch < 256 && strlen(rename_buf) < PATH_MAX_LEN-1) {
-                int l = strlen(rename_buf);
-                rename_buf[l] = ch; rename_buf[l+1] = '\0';
+                int l = strlen(prompt_buf);
+                if (l > 0) prompt_buf[l-1] = '\0';
+            } else if (ch >= ' ' && ch < 256 && strlen(prompt_buf) < (prompt == PROMPT_RENAME || prompt == PROMPT_CONNECT ? PATH_MAX_LEN : FILTER_MAX)-1) {
+                int l = strlen(prompt_buf);
+                prompt_buf[l] = ch; prompt_buf[l+1] = '\0';
             }
+        } else if (filter_mode && (ch == '\n' || ch == 27 || ch == 127 || ch == KEY_BACKSPACE || (ch >= ' ' && ch < 256))) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            int len = strlen(p->filter);
+            if (ch == '\n') {
+                filter_mode = 0;
+                if (!len) clear_filter(p);
+            } else if (ch == 27) {
+                filter_mode = 0;
+                clear_filter(p);
+            } else if (ch == 127 || ch == KEY_BACKSPACE) {
+                if (len > 0) { p->filter[len-1] = '\0'; p->filter_dirty = 1; }
+            } else if (len < FILTER_MAX-1) {
+                p->filter[len] = ch; p->filter[len+1] = '\0';
+                p->filter_dirty = 1;
+            }
+        } else if (!((focus == FOCUS_L ? l.vfs : r.vfs)->ops->caps & VFS_WRITE) &&
+                   (ch == KEY_F(2) || ch == KEY_F(3) || ch == KEY_F(5))) {
+            snprintf(status, sizeof(status), "This panel is read-only");
+            status_post(status);
+        } else if ((focus == FOCUS_L ? l.vfs : r.vfs) != &vfs_local && (ch == KEY_F(8) || ch == KEY_F(9) ||
+                   ch == 0 || ch == 2 || ch == 4 || ch == 6 || ch == 14 || ch == 24)) {
+            snprintf(status, sizeof(status), "Only local directories can be searched or measured");
+            status_post(status);
         } else if (ch == '\t') {
             focus = (focus == FOCUS_L) ? FOCUS_R : FOCUS_L;
+            filter_mode = 0;
         }
         else if (ch == KEY_UP || ch == KEY_DOWN) {
             Panel *p = (focus == FOCUS_L) ? &l : &r;
             if (ch == KEY_UP && p->selected > 0) p->selected--;
-            if (ch == KEY_DOWN && p->selected < p->count - 1) p->selected++;
+            if (ch == KEY_DOWN && p->selected < panel_rows(p) - 1) p->selected++;
+        }
+        else if (ch == KEY_PPAGE || ch == KEY_NPAGE || ch == KEY_HOME || ch == KEY_END) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            int page = ph - 3;
+            if (ch == KEY_PPAGE) move_selection(p, p->selected - page, ph - 2);
+            if (ch == KEY_NPAGE) move_selection(p, p->selected + page, ph - 2);
+            if (ch == KEY_HOME) move_selection(p, 0, ph - 2);
+            if (ch == KEY_END) move_selection(p, panel_rows(p) - 1, ph - 2);
         }
         else if (ch == '\n') {
-            if (ilen > 0) {
-                def_prog_mode(); endwin();
+            if (ilen > 0 && input[0] == '!') {
+                // Full-screen programs get the whole terminal, as before.
                 Panel *p = (focus == FOCUS_L) ? &l : &r;
                 chdir(p->cwd);
-                char cmd[1024];
-                snprintf(cmd, sizeof(cmd), "bash -c '%s'", input);
-                system(cmd);
-                reset_prog_mode(); refresh();
+                char *argv[] = {"bash", "-c", input + 1, NULL};
+                run_foreground(argv);
+                ilen = 0; input[0] = '\0';
+            } else if (ilen > 0) {
+                Panel *p = (focus == FOCUS_L) ? &l : &r;
+                char cwd[PATH_MAX_LEN];
+                if (p->vfs == &vfs_local) snprintf(cwd, sizeof(cwd), "%s", p->cwd);
+                else if (!getcwd(cwd, sizeof(cwd))) strcpy(cwd, "/");
+                if (!shell) shell = shell_open(h/2 - 3, w - 2);
+                if (!shell || shell_run(shell, cwd, input) != 0) {
+                    snprintf(status, sizeof(status), "Cannot run bash");
+                    status_post(status);
+                }
+                shell_shown = 1;
+                messages_shown = 0;
                 ilen = 0; input[0] = '\0';
             } else {
                 Panel *p = (focus == FOCUS_L) ? &l : &r;
@@ -260,42 +8643,250 @@ int main() {
         }
         else if (ch == KEY_F(1)) {
             Panel *p = (focus == FOCUS_L) ? &l : &r;
-            snprintf(clipboard, sizeof(clipboard), "%s/%s", p->cwd, p->entries[p->selected].name);
-            snprintf(status, sizeof(status), "Copied %s", p->entries[p->selected].name);
-            sleep_ms(1000); status[0] = '\0';
+            Entry *e = cur_entry(p);
+            if (e) {
+                snprintf(clipboard, sizeof(clipboard), "%s/%s", p->cwd, e->name);
+                snprintf(status, sizeof(status), "Copied %s", e->name);
+                status_post(status);
+            }
+        }
+        else if (ch == KEY_F(2) && clipboard[0] && copy_job) {
+            snprintf(status, sizeof(status), "A copy is already running");
+            status_post(status);
         }
         else if (ch == KEY_F(2) && clipboard[0]) {
             Panel *p = (focus == FOCUS_L) ? &l : &r;
-            chdir(p->cwd);
+            Vfs *from = vfs_resolve(clipboard);
             char *base = strrchr(clipboard, '/');
             if (!base) base = clipboard; else base++;
             char target[PATH_MAX_LEN];
-            snprintf(target, sizeof(target), "%s", base);
+            snprintf(target, sizeof(target), "%s/%s", p->cwd, base);
             int i = 1;
-            while (access(target, F_OK) == 0) {
-                snprintf(target, sizeof(target), "%s%d", base, i++);
+            VfsEntry st;
+            while (p->vfs->ops->stat(p->vfs, target, &st) == 0) {
+                snprintf(target, sizeof(target), "%s/%s%d", p->cwd, base, i++);
+            }
+            if (copy_backgrounds(from, p->vfs)) {
+                if (copy_start(from, clipboard, p->vfs, target) != 0) {
+                    snprintf(status, sizeof(status), "Cannot paste %s", strrchr(target, '/') + 1);
+                    status_post(status);
+                }
+            } else {
+                int failed = vfs_copy(from, clipboard, p->vfs, target) != 0;
+                reload_panel(p);
+                snprintf(status, sizeof(status), failed ? "Cannot paste %s" : "Pasted %s", strrchr(target, '/') + 1);
+                status_post(status);
             }
-            char cmd[PATH_MAX_LEN * 2 + 32];
-            snprintf(cmd, sizeof(cmd), "cp -r \"%s\" \"%s\"", clipboard, target);
-            def_prog_mode(); endwin(); system(cmd); reset_prog_mode(); refresh();
-            free_panel(p); list_dir(p);
-            snprintf(status, sizeof(status), "Pasted %s", target);
-            sleep_ms(1000); status[0] = '\0';
+        }
+        else if (ch == 27 && copy_job) {
+            copy_cancel();
         }
         else if (ch == KEY_F(3)) {
-            rename_mode = !rename_mode;
-            rename_buf[0] = '\0';
+            prompt = PROMPT_RENAME;
+            prompt_buf[0] = '\0';
+            filter_mode = 0;
+        }
+        else if (ch == KEY_F(4)) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            filter_mode = 1;
+            if (p->filter_kind != FILTER_FUZZY) clear_filter(p);
+            p->filtered = p->filter_dirty = 1;
         }
         else if (ch == KEY_F(5)) {
             Panel *p = (focus == FOCUS_L) ? &l : &r;
+            Entry *e = cur_entry(p);
+            char path[PATH_MAX_LEN];
+            if (p->marked && p->dups) {
+                int failed, n = dup_delete(p, &failed);
+                reload_panel(p);
+                if (failed) snprintf(status, sizeof(status), "Deleted %d duplicates, %d failed or differ", n, failed);
+                else snprintf(status, sizeof(status), "Deleted %d duplicates", n);
+                status_post(status);
+            } else if (p->marked) {
+                int n = 0, failed = 0;
+                for (int i = 0; i < p->count; i++) {
+                    if (!p->entries[i].marked || is_dot_entry(p->entries[i].name)) continue;
+                    snprintf(path, sizeof(path), "%s/%s", p->cwd, p->entries[i].name);
+                    if (p->vfs->ops->unlink(p->vfs, path) == 0) n++;
+                    else failed++;
+                }
+                reload_panel(p);
+                if (failed) snprintf(status, sizeof(status), "Deleted %d entries, %d failed", n, failed);
+                else snprintf(status, sizeof(status), "Deleted %d entries", n);
+                status_post(status);
+            } else if (e && is_dot_entry(e->name)) {
+                snprintf(status, sizeof(status), "Cannot delete %s", e->name);
+                status_post(status);
+            } else if (e) {
+                char name[PATH_MAX_LEN];
+                snprintf(name, sizeof(name), "%s", e->name);
+                snprintf(path, sizeof(path), "%s/%s", p->cwd, name);
+                int failed = p->vfs->ops->unlink(p->vfs, path) != 0;
+                reload_panel(p);
+                snprintf(status, sizeof(status), failed ? "Cannot delete %s" : "Deleted %s", name);
+                status_post(status);
+            }
+        }
+        else if (ch == KEY_F(6) || ch == KEY_F(7)) {
+            prompt = ch == KEY_F(6) ? PROMPT_PATTERN : PROMPT_MARK;
+            prompt_buf[0] = '\0';
+            filter_mode = 0;
+        }
+        else if (ch == KEY_IC) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            Entry *e = cur_entry(p);
+            if (e && strcmp(e->name, "..")) {
+                e->marked = !e->marked;
+                p->marked += e->marked ? 1 : -1;
+            }
+            if (p->selected < panel_rows(p) - 1) p->selected++;
+        }
+        else if (ch == 20) {  // Ctrl-T
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            toggle_filter(p);
+        }
+        else if (ch == 7) {  // Ctrl-G
+            prompt = PROMPT_PERCENT;
+            prompt_buf[0] = '\0';
+            filter_mode = 0;
+        }
+        else if (ch == 0 || ch == KEY_F(8)) {  // Ctrl-Space
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            size_start(p, ch == KEY_F(8));
+        }
+        else if (ch == 6) {  // Ctrl-F
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (p->grep) {
+                grep_close(p);
+            } else {
+                prompt = PROMPT_GREP;
+                prompt_buf[0] = '\0';
+                filter_mode = 0;
+            }
+        }
+        else if (ch == 14) {  // Ctrl-N
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (p->find) {
+                find_stop(p);
+                clear_filter(p);
+                reload_panel(p);
+                p->selected = p->scroll_offset = 0;
+            } else {
+                prompt = PROMPT_FIND;
+                prompt_buf[0] = '\0';
+                filter_mode = 0;
+            }
+        }
+        else if (ch == 2 || ch == 24) {  // Ctrl-B, Ctrl-X
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (index_build_start(p->cwd, ch == 24) != 0) {
+                snprintf(status, sizeof(status), "An index is already being built");
+                status_post(status);
+            }
+        }
+        else if (ch == 4) {  // Ctrl-D
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (p->dups) {
+                dup_stop(p);
+                clear_filter(p);
+                reload_panel(p);
+                p->selected = p->scroll_offset = 0;
+            } else if (dup_start(p) != 0) {
+                snprintf(status, sizeof(status), "Cannot search %s for duplicates", p->cwd);
+                status_post(status);
+            }
+        }
+        else if (ch == 12 && (focus == FOCUS_L ? l.dups : r.dups)) {  // Ctrl-L
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            int failed;
+            int n = dup_link(p, &failed);
+            snprintf(status, sizeof(status), "Linked %d duplicates, %d failed", n, failed);
+            status_post(status);
+        }
+        else if (ch == KEY_F(9)) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            du_toggle(p);
+        }
+        else if (ch == 21 && !sync_job) {  // Ctrl-U
+            Panel *p = (focus == FOCUS_L) ? &l : &r, *other = p == &l ? &r : &l;
+            if (sync_plan(p, other, 0, 0, 0) != 0) {
+                snprintf(status, sizeof(status), "Sync needs two directory listings, neither inside the other");
+                status_post(status);
+            } else {
+                prompt = PROMPT_SYNC;
+                sync_summary(sync_job, prompt_buf, sizeof(prompt_buf));
+                sync_help(sync_job, status, sizeof(status));
+                filter_mode = 0;
+            }
+        }
+        else if (ch == 16 || ch == 5) {  // Ctrl-P, Ctrl-E
+            if (compare_panels(&l, &r, ch == 5) != 0) {
+                snprintf(status, sizeof(status), "Compare needs two directory listings");
+            } else if (ch == 16) {
+                snprintf(status, sizeof(status), "%d differ on the left, %d on the right", l.marked, r.marked);
+            }
+            if (ch == 16 || !compare_job) status_post(status);
+        }
+        else if (ch == 15) {  // Ctrl-O
+            shell_shown = messages_shown || !shell_shown;
+            messages_shown = 0;
+        }
+        else if (ch == 23) {  // Ctrl-W
+            messages_shown = !messages_shown;
+        }
+        else if (ch == 22 && shell && shell->log >= 0) {  // Ctrl-V
+            // The whole log, from the output of the last command
+            shell_flush(shell);
+            view_file(shell->log_path, shell->mark, NULL);
+        }
+        else if (ch == 1) {  // Ctrl-A
             char path[PATH_MAX_LEN];
-            snprintf(path, sizeof(path), "%s/%s", p->cwd, p->entries[p->selected].name);
-            char cmd[PATH_MAX_LEN + 16];
-            snprintf(cmd, sizeof(cmd), "rm -rf \"%s\"", path);
-            def_prog_mode(); endwin(); system(cmd); reset_prog_mode(); refresh();
-            free_panel(p); list_dir(p);
-            snprintf(status, sizeof(status), "Deleted %s", p->entries[p->selected].name);
-            sleep_ms(1000); status[0] = '\0';
+            int temp = latency_path(path, sizeof(path));
+            if (temp < 0) {
+                snprintf(status, sizeof(status), "Cannot make a temporary directory");
+                status_post(status);
+            } else if (latency_report(path) == 0) {
+                view_file(path, 0, NULL);
+                if (temp) unlink(path);
+            } else {
+                if (temp) unlink(path);
+                snprintf(status, sizeof(status), "Cannot write %s", path);
+                status_post(status);
+            }
+        }
+        else if (ch == 25) {  // Ctrl-Y
+            shell_follow = !shell_follow;
+            snprintf(status, sizeof(status), shell_follow ? "The panel follows the shell's directory" : "The panel no longer follows the shell");
+            status_post(status);
+        }
+        else if ((ch == KEY_SPREVIOUS || ch == KEY_SNEXT) && shell && shell_shown && !messages_shown) {
+            int page = th - 3 > 1 ? th - 4 : 1;
+            shell->scroll += ch == KEY_SPREVIOUS ? page : -page;
+            if (shell->scroll > shell->count) shell->scroll = shell->count;
+            if (shell->scroll < 0) shell->scroll = 0;
+        }
+        else if (ch == 11) {  // Ctrl-K
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (p->sftp) {
+                sftp_leave(p);
+            } else if (p->arc) {
+                snprintf(status, sizeof(status), "Leave the archive before connecting");
+                status_post(status);
+            } else {
+                prompt = PROMPT_CONNECT;
+                prompt_buf[0] = '\0';
+                filter_mode = 0;
+            }
+        }
+        else if (ch == 18) {  // Ctrl-R
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            Entry *e = cur_entry(p);
+            if (p->du_active && e && e->type == TYPE_FOLDER && strcmp(e->name, "..")) {
+                du_refresh(p->du, e->node);
+                du_fill(p);
+            } else {
+                reload_panel(p);
+            }
         }
         else if (ch != ERR) {
             if (ch == 127 || ch == KEY_BACKSPACE) {
@@ -305,10 +8896,119 @@ int main() {
             }
         }
 
+        if (ch != ERR && !latency_skip) {
+            hist_add(&latency_handled[action], now_us() - key_at);
+            if (!latency_pending[action]) latency_pending[action] = key_at;
+        }
+
+        // Drain queued keys (a held arrow, a pasted query) before drawing, but
+        // still show a frame every FRAME_MAX_MS while input keeps coming.
+        if (ch != ERR && input_pending(0) && now_ms() - last_frame < FRAME_MAX_MS) continue;
+
+        if (l.filtered && l.filter_dirty && apply_filter(&l) < 0) continue;
+        if (r.filtered && r.filter_dirty && apply_filter(&r) < 0) continue;
+        size_update(&l);
+        size_update(&r);
+        du_update(&l, FRAME_MAX_MS / 2);
+        du_update(&r, FRAME_MAX_MS / 2);
+        grep_update(&l);
+        grep_update(&r);
+        find_update(&l);
+        find_update(&r);
+        dup_update(&l);
+        dup_update(&r);
+        if (arc_update(&l) < 0 || arc_update(&r) < 0) {
+            snprintf(status, sizeof(status), "Cannot read the archive");
+            status_post(status);
+        }
+        if (proc_update(status, sizeof(status))) status_post(status);
+        if (shell_update(shell) > 0 && shell_follow) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            if (p->vfs == &vfs_local && !p->grep && !p->dups && !p->du_active && strcmp(p->cwd, shell->cwd))
+                change_dir(p, shell->cwd);
+        }
+        if (sftp_update(&l) < 0 || sftp_update(&r) < 0) {
+            snprintf(status, sizeof(status), "The SFTP connection was lost");
+            status_post(status);
+        }
+        if (name_index) index_events(name_index);
+        if (content_index) content_events(content_index);
+        if (index_build && !index_build_update(status, sizeof(status))) status_post(status);
+        if (compare_job && !compare_update(&l, &r, status, sizeof(status))) status_post(status);
+        if (sync_job && sync_job->planning) {
+            // The prompt shows the plan as it grows, and its keys once done.
+            sync_plan_update();
+            if (prompt == PROMPT_SYNC) {
+                sync_summary(sync_job, prompt_buf, sizeof(prompt_buf));
+                sync_help(sync_job, status, sizeof(status));
+            }
+        }
+        if (sync_job && sync_job->running && !sync_update(&l, &r, status, sizeof(status))) status_post(status);
+        if (copy_job && !copy_update(&l, &r, status, sizeof(status))) status_post(status);
+        status_expire(status);
+
         draw_panel(lw,&l,focus==FOCUS_L);
         draw_panel(rw,&r,focus==FOCUS_R);
-        draw_terminal(tw,input,status,rename_mode,rename_buf);
+        if (prompt == PROMPT_RENAME) {
+            draw_terminal(tw,input,status,"Rename to: ",prompt_buf);
+        } else if (prompt == PROMPT_PATTERN) {
+            draw_terminal(tw,input,status,"Filter (glob or /regex): ",prompt_buf);
+        } else if (prompt == PROMPT_MARK) {
+            draw_terminal(tw,input,status,"Mark (glob or /regex): ",prompt_buf);
+        } else if (prompt == PROMPT_PERCENT) {
+            draw_terminal(tw,input,status,"Go to %: ",prompt_buf);
+        } else if (prompt == PROMPT_FIND) {
+            draw_terminal(tw,input,status,"Find name (glob, /regex or ~fuzzy): ",prompt_buf);
+        } else if (prompt == PROMPT_GREP) {
+            draw_terminal(tw,input,status,"Find in files (text or /regex): ",prompt_buf);
+        } else if (prompt == PROMPT_CONNECT) {
+            draw_terminal(tw,input,status,"Connect to (user@host[:path]): ",prompt_buf);
+        } else if (prompt == PROMPT_SYNC) {
+            if ((int)strlen(prompt_buf) > w - 2) prompt_buf[w - 2] = '\0';
+            draw_terminal(tw,input,status,"",prompt_buf);
+        } else if (filter_mode) {
+            Panel *p = (focus == FOCUS_L) ? &l : &r;
+            snprintf(filter_prompt, sizeof(filter_prompt), "Filter [%d/%d]: ", p->view_count, p->count);
+            draw_terminal(tw,input,status,filter_prompt,p->filter);
+        } else {
+            draw_terminal(tw,input,status,NULL,NULL);
+        }
+        if (messages_shown) draw_messages(tw);
+        else if (shell_shown) draw_shell(tw, shell);
+        doupdate();
+        last_frame = now_ms();
+        for (int a = 0; a < ACT_COUNT; a++) {
+            if (!latency_pending[a]) continue;
+            hist_add(&latency_frame[a], now_us() - latency_pending[a]);
+            latency_pending[a] = 0;
+        }
     }
+    size_cancel(&l);
+    size_cancel(&r);
+    du_free(l.du);
+    du_free(r.du);
+    grep_close(&l);
+    grep_close(&r);
+    find_stop(&l);
+    find_stop(&r);
+    dup_stop(&l);
+    dup_stop(&r);
+    shell_close(shell);
+    copy_stop();
+    if (l.sftp) sftp_close(l.sftp);
+    if (r.sftp) sftp_close(r.sftp);
+    for (int i = 0; i < ARC_CACHE; i++) arc_free(archives[i]);
+    if (vfs_tmp[0]) rmdir(vfs_tmp);
+    index_close(name_index);
+    content_close(content_index);
+    compare_stop();
+    sync_stop();
     endwin();
+    const char *latency_env = getenv("MYCOMMANDER_LATENCY");
+    if (latency_env && latency_env[0]) {
+        char path[PATH_MAX_LEN];
+        latency_path(path, sizeof(path));
+        latency_report(path);
+    }
     return 0;
 }